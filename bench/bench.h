@@ -0,0 +1,64 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_BENCH_H
+#define BITCOIN_BENCH_BENCH_H
+
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Each bench program times its code by default, and runs its checks
+ * instead when given -check; ctest runs the checks.
+ * Build with -DCMAKE_BUILD_TYPE=Release for numbers worth comparing.
+ */
+inline bool BenchCheckMode(int argc, char** argv)
+{
+    return argc > 1 && strcmp(argv[1], "-check") == 0;
+}
+
+/** Fail the checks, telling which one */
+#define BENCH_CHECK(cond)                                                          \
+    do {                                                                           \
+        if (!(cond)) {                                                             \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                               \
+        }                                                                          \
+    } while (0)
+
+inline int64_t BenchNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/** Keep the compiler from optimizing away a result that is never used */
+template <typename T>
+inline void BenchKeep(const T& value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+/** Call f in batches of doubling size until nMinNanos have passed.
+ * @returns nanoseconds per call
+ */
+template <typename F>
+double BenchTime(F f, int64_t nMinNanos = 200000000)
+{
+    uint64_t nCalls = 0, nBatch = 1;
+    const int64_t nStart = BenchNow();
+    int64_t nElapsed;
+    do {
+        for (uint64_t i = 0; i < nBatch; i++)
+            f();
+        nCalls += nBatch;
+        nBatch *= 2;
+        nElapsed = BenchNow() - nStart;
+    } while (nElapsed < nMinNanos);
+    return (double)nElapsed / nCalls;
+}
+
+#endif // BITCOIN_BENCH_BENCH_H
@@ -0,0 +1,133 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Size and speed of the JSON-RPC wire encodings on payloads shaped like
+// real requests and replies. With -check, check every payload survives a
+// round trip through every encoding.
+
+#include "bench.h"
+
+#include "protocol.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+static const RPCEncoding encodings[] = {RPC_ENCODING_JSON, RPC_ENCODING_CBOR, RPC_ENCODING_MSGPACK};
+
+static std::string Hex(uint64_t n, size_t nDigits)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(nDigits, '0');
+    for (size_t i = 0; i < nDigits; i++) {
+        n = n * 6364136223846793005ULL + 1442695040888963407ULL;
+        hex[i] = digits[n >> 60];
+    }
+    return hex;
+}
+
+/** A transaction as a verbose block lists it */
+static json MakeTransaction(size_t n)
+{
+    json vin = json::array(), vout = json::array();
+    for (size_t i = 0; i < 2; i++) {
+        vin.push_back({{"txid", Hex(n * 7 + i, 64)}, {"vout", i}, {"sequence", 4294967295u},
+                       {"scriptSig", {{"asm", Hex(n + i, 140)}, {"hex", Hex(n + i, 142)}}}});
+        vout.push_back({{"value", 0.5 + n * 0.001}, {"n", i},
+                        {"scriptPubKey", {{"hex", Hex(n * 3 + i, 50)}, {"type", "pubkeyhash"}}}});
+    }
+    return {{"txid", Hex(n, 64)}, {"size", 225}, {"vsize", 225}, {"version", 2}, {"locktime", 0},
+            {"vin", vin}, {"vout", vout}};
+}
+
+/** Payloads to compare, by name */
+static std::vector<std::pair<std::string, json>> MakePayloads()
+{
+    std::vector<std::pair<std::string, json>> payloads;
+    payloads.emplace_back("request", json{{"jsonrpc", "1.0"}, {"id", 1}, {"method", "getblockhash"}, {"params", {500000}}});
+
+    json header = {{"hash", Hex(1, 64)}, {"confirmations", 1024}, {"height", 500000}, {"version", 536870912},
+                   {"merkleroot", Hex(2, 64)}, {"time", 1513622125}, {"nonce", 1560058197u},
+                   {"bits", "1761e9f8"}, {"difficulty", 1873105475221.611}, {"chainwork", Hex(3, 64)},
+                   {"previousblockhash", Hex(4, 64)}};
+    payloads.emplace_back("block header", header);
+
+    json txids = json::array();
+    for (size_t i = 0; i < 2000; i++)
+        txids.push_back(Hex(i, 64));
+    json block = header;
+    block["tx"] = txids;
+    payloads.emplace_back("block, txids", block);
+
+    json transactions = json::array();
+    for (size_t i = 0; i < 500; i++)
+        transactions.push_back(MakeTransaction(i));
+    block["tx"] = transactions;
+    payloads.emplace_back("block, verbose", block);
+
+    json numbers = json::array();
+    for (size_t i = 0; i < 10000; i++)
+        numbers.push_back(i % 2 ? json(i * 1000003) : json(i * 0.25));
+    payloads.emplace_back("numbers", numbers);
+    return payloads;
+}
+
+static std::string Encode(const json& value, RPCEncoding encoding)
+{
+    std::string out;
+    RPCEncode(nlohmann::detail::output_adapter<char>(out), value, encoding);
+    return out;
+}
+
+static json Decode(const std::string& data, RPCEncoding encoding)
+{
+    return RPCDecode(nlohmann::detail::input_adapter(data.data(), data.size()), encoding);
+}
+
+static void RunChecks()
+{
+    for (const auto& payload : MakePayloads()) {
+        for (RPCEncoding encoding : encodings) {
+            const std::string data = Encode(payload.second, encoding);
+            // JSON text keeps 15 significant digits of a double, so it is
+            // exact only from the second round on
+            if (encoding == RPC_ENCODING_JSON)
+                BENCH_CHECK(Encode(Decode(data, encoding), encoding) == data);
+            else
+                BENCH_CHECK(Decode(data, encoding) == payload.second);
+            // A truncated body is an error, not a shorter value
+            bool fThrown = false;
+            try {
+                Decode(data.substr(0, data.size() - 1), encoding);
+            } catch (const std::exception&) {
+                fThrown = true;
+            }
+            BENCH_CHECK(fThrown);
+        }
+    }
+    printf("ok\n");
+}
+
+int main(int argc, char** argv)
+{
+    if (BenchCheckMode(argc, argv)) {
+        RunChecks();
+        return 0;
+    }
+
+    printf("bytes, then microseconds to encode / decode\n");
+    printf("%-16s %26s %26s %26s\n", "payload", RPCEncodingMediaType(RPC_ENCODING_JSON),
+           RPCEncodingMediaType(RPC_ENCODING_CBOR), RPCEncodingMediaType(RPC_ENCODING_MSGPACK));
+    for (const auto& payload : MakePayloads()) {
+        printf("%-16s", payload.first.c_str());
+        for (RPCEncoding encoding : encodings) {
+            const std::string data = Encode(payload.second, encoding);
+            const double nEncode = BenchTime([&payload, encoding] { BenchKeep(Encode(payload.second, encoding)); });
+            const double nDecode = BenchTime([&data, encoding] { BenchKeep(Decode(data, encoding)); });
+            printf(" %8zu %8.1f / %7.1f", data.size(), nEncode / 1e3, nDecode / 1e3);
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,294 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Reply throughput against body size, for each way a handler can hand over
+// the body: copied, moved (sent by reference from nReferenceThreshold on)
+// and shared (always by reference). Runs the server in process and fetches
+// from it over a keep-alive connection. With -check, check the bodies
+// around the threshold arrive intact, that a chunked reply reaches a slow
+// but steady reader in full, and that one to a client that stops reading is
+// given up on.
+
+#include "bench.h"
+
+#include "httpserver.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <event2/http.h>
+#include <map>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/** Port the HTTP server binds to */
+static const uint16_t BENCH_HTTP_PORT = 6666;
+/** Size of the pieces a chunked reply is written in */
+static const size_t BENCH_STREAM_PIECE = 65536;
+/** Body of the chunked replies, well beyond what the socket buffers hold */
+static const size_t BENCH_STREAM_SIZE = 16 * 1024 * 1024;
+
+//! Bodies of the shared replies by size, filled before the server starts
+static std::map<size_t, std::shared_ptr<const std::string>> sharedBodies;
+
+static std::string MakeBody(size_t nSize)
+{
+    std::string body(nSize, 0);
+    for (size_t i = 0; i < nSize; i++)
+        body[i] = 'a' + i % 26;
+    return body;
+}
+
+// The copy and move handlers both build a fresh body, as a handler
+// serializing its result does; they differ only in how they hand it over
+
+static bool ReplyCopy(HTTPRequest* req, const std::string& strSize)
+{
+    const std::string body(*sharedBodies.at(std::stoul(strSize)));
+    req->WriteReply(HTTP_OK, body);
+    return true;
+}
+
+static bool ReplyMove(HTTPRequest* req, const std::string& strSize)
+{
+    std::string body(*sharedBodies.at(std::stoul(strSize)));
+    req->WriteReply(HTTP_OK, std::move(body));
+    return true;
+}
+
+static bool ReplyShared(HTTPRequest* req, const std::string& strSize)
+{
+    req->WriteReply(HTTP_OK, sharedBodies.at(std::stoul(strSize)));
+    return true;
+}
+
+//! Chunked replies sent in full, and given up on by the server
+static std::atomic<int> nStreamsSent(0);
+static std::atomic<int> nStreamsAbandoned(0);
+
+/** Send the body piece by piece, as a handler streaming its result does */
+static bool ReplyStream(HTTPRequest* req, const std::string& strSize)
+{
+    const std::string& body = *sharedBodies.at(std::stoul(strSize));
+    req->StartReply(HTTP_OK);
+    bool fConnected = true;
+    for (size_t nPos = 0; nPos < body.size() && fConnected; nPos += BENCH_STREAM_PIECE)
+        fConnected = req->WriteReplyChunk(body.data() + nPos, std::min(BENCH_STREAM_PIECE, body.size() - nPos));
+    req->EndReply();
+    if (fConnected)
+        nStreamsSent++;
+    else
+        nStreamsAbandoned++;
+    return true;
+}
+
+/** Blocking HTTP/1.1 client on one keep-alive connection */
+class BenchClient
+{
+private:
+    int fd;
+    std::string buffer; //!< received but not yet consumed
+
+    bool Receive(size_t nMax = 65536)
+    {
+        // ACK at once: the server does not set TCP_NODELAY, so a reply
+        // written in two pieces would otherwise wait for a delayed ACK
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+        char data[65536];
+        const ssize_t n = recv(fd, data, std::min(nMax, sizeof(data)), 0);
+        if (n <= 0)
+            return false;
+        buffer.append(data, n);
+        return true;
+    }
+
+    /** Receive until nSize bytes are buffered, taking at most nMax bytes
+     * from the socket at a time and pausing nPauseMicros after each read
+     */
+    void ReceiveAtLeast(size_t nSize, size_t nMax, int64_t nPauseMicros)
+    {
+        while (buffer.size() < nSize) {
+            BENCH_CHECK(Receive(nMax));
+            if (nPauseMicros)
+                std::this_thread::sleep_for(std::chrono::microseconds(nPauseMicros));
+        }
+    }
+
+public:
+    /** @param[in] nReceiveBuffer  socket receive buffer size, 0 for the default */
+    explicit BenchClient(int nReceiveBuffer = 0) : fd(socket(AF_INET, SOCK_STREAM, 0))
+    {
+        // Set before connecting, so the window the server sees stays small
+        if (nReceiveBuffer)
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &nReceiveBuffer, sizeof(nReceiveBuffer));
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(BENCH_HTTP_PORT);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        BENCH_CHECK(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    }
+    ~BenchClient()
+    {
+        close(fd);
+    }
+
+    /** Send a GET request for path */
+    void Send(const std::string& path)
+    {
+        const std::string request = "GET " + path + " HTTP/1.1\r\nHost: bench\r\n\r\n";
+        BENCH_CHECK(send(fd, request.data(), request.size(), 0) == (ssize_t)request.size());
+    }
+
+    /** GET path and return the body of the reply */
+    std::string Get(const std::string& path)
+    {
+        Send(path);
+        size_t nHeaderEnd;
+        while ((nHeaderEnd = buffer.find("\r\n\r\n")) == std::string::npos)
+            BENCH_CHECK(Receive());
+        BENCH_CHECK(buffer.compare(0, 12, "HTTP/1.1 200") == 0);
+        const size_t nLength = buffer.find("Content-Length: ");
+        BENCH_CHECK(nLength < nHeaderEnd);
+        const size_t nBody = std::stoul(buffer.substr(nLength + 16));
+        buffer.erase(0, nHeaderEnd + 4);
+        while (buffer.size() < nBody)
+            BENCH_CHECK(Receive());
+        std::string body = buffer.substr(0, nBody);
+        buffer.erase(0, nBody);
+        return body;
+    }
+
+    /** GET path, whose reply has a chunked body, and read the body slowly
+     * @param[in] nMax          most bytes taken from the socket at once
+     * @param[in] nPauseMicros  pause between reads
+     */
+    std::string GetChunked(const std::string& path, size_t nMax, int64_t nPauseMicros)
+    {
+        Send(path);
+        size_t nHeaderEnd;
+        while ((nHeaderEnd = buffer.find("\r\n\r\n")) == std::string::npos)
+            BENCH_CHECK(Receive(nMax));
+        BENCH_CHECK(buffer.compare(0, 12, "HTTP/1.1 200") == 0);
+        BENCH_CHECK(buffer.find("Transfer-Encoding: chunked") < nHeaderEnd);
+        buffer.erase(0, nHeaderEnd + 4);
+        std::string body;
+        while (true) {
+            size_t nLineEnd;
+            while ((nLineEnd = buffer.find("\r\n")) == std::string::npos)
+                ReceiveAtLeast(buffer.size() + 1, nMax, nPauseMicros);
+            const size_t nChunk = std::stoul(buffer.substr(0, nLineEnd), nullptr, 16);
+            ReceiveAtLeast(nLineEnd + 2 + nChunk + 2, nMax, nPauseMicros);
+            body.append(buffer, nLineEnd + 2, nChunk);
+            buffer.erase(0, nLineEnd + 2 + nChunk + 2);
+            if (nChunk == 0)
+                return body;
+        }
+    }
+
+    /** Read and discard until the server closes the connection */
+    void WaitClose()
+    {
+        while (Receive())
+            buffer.clear();
+    }
+};
+
+static const char* const replyPaths[] = {"/copy/", "/move/", "/shared/"};
+
+static void RunChecks(BenchClient& client, const std::vector<size_t>& sizes)
+{
+    for (size_t nSize : sizes) {
+        const std::string expected = MakeBody(nSize);
+        for (const char* path : replyPaths)
+            BENCH_CHECK(client.Get(path + std::to_string(nSize)) == expected);
+    }
+
+    // A reader that takes a few seconds over the reply, well past the stall
+    // timeout, but never stops reading gets all of it
+    {
+        BenchClient slow(16384);
+        const std::string body = slow.GetChunked("/stream/" + std::to_string(BENCH_STREAM_SIZE), 16384, 2000);
+        BENCH_CHECK(body == *sharedBodies.at(BENCH_STREAM_SIZE));
+        BENCH_CHECK(nStreamsSent.load() == 1 && nStreamsAbandoned.load() == 0);
+    }
+
+    // A client that stops reading is given up on and disconnected
+    {
+        BenchClient idle(16384);
+        idle.Send("/stream/" + std::to_string(BENCH_STREAM_SIZE));
+        const int64_t nDeadline = BenchNow() + 30000000000;
+        while (nStreamsAbandoned.load() == 0 && BenchNow() < nDeadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        BENCH_CHECK(nStreamsAbandoned.load() == 1 && nStreamsSent.load() == 1);
+        idle.WaitClose();
+    }
+    printf("ok\n");
+}
+
+static void RunBench(BenchClient& client, const std::vector<size_t>& sizes)
+{
+    printf("microseconds per request (MB/s)\n");
+    printf("%10s %20s %20s %20s\n", "size", "copy", "move", "shared");
+    for (size_t nSize : sizes) {
+        printf("%10zu", nSize);
+        for (const char* path : replyPaths) {
+            const std::string strPath = path + std::to_string(nSize);
+            const double nNanos = BenchTime([&client, &strPath] {
+                BenchKeep(client.Get(strPath));
+            });
+            printf(" %11.1f (%6.0f)", nNanos / 1e3, nSize * 1e3 / nNanos);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const bool fCheck = BenchCheckMode(argc, argv);
+    HTTPServerOptions options;
+    if (fCheck) {
+        // Keep the chunked reply checks short
+        options.nReplyHighWatermark = BENCH_STREAM_PIECE;
+        options.nReplyStallTimeout = 1;
+    }
+    const size_t nThreshold = options.nReferenceThreshold;
+    std::vector<size_t> sizes;
+    if (fCheck) {
+        sizes = {1, nThreshold - 1, nThreshold, nThreshold + 1, 4 * nThreshold};
+    } else {
+        for (size_t nSize = 1024; nSize <= 64 * nThreshold; nSize *= 4) {
+            if (nSize == nThreshold)
+                sizes.push_back(nThreshold - 1);
+            sizes.push_back(nSize);
+        }
+    }
+    for (size_t nSize : sizes)
+        sharedBodies[nSize] = std::make_shared<const std::string>(MakeBody(nSize));
+    if (fCheck)
+        sharedBodies[BENCH_STREAM_SIZE] = std::make_shared<const std::string>(MakeBody(BENCH_STREAM_SIZE));
+
+    BENCH_CHECK(InitHTTPServer(options));
+    RegisterHTTPHandler("/copy/", false, ReplyCopy);
+    RegisterHTTPHandler("/move/", false, ReplyMove);
+    RegisterHTTPHandler("/shared/", false, ReplyShared);
+    RegisterHTTPHandler("/stream/", false, ReplyStream);
+    BENCH_CHECK(StartHTTPServer());
+    {
+        BenchClient client;
+        if (fCheck)
+            RunChecks(client, sizes);
+        else
+            RunBench(client, sizes);
+    }
+    InterruptHTTPServer();
+    StopHTTPServer();
+    return 0;
+}
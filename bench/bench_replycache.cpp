@@ -0,0 +1,278 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// RPCReplyCache lookup and insertion time, from one thread and from several
+// at once. With -check, check hits and misses, expiry, eviction under the
+// memory cap, and that a result computed across an invalidation is never
+// served; and check that RPCSingleFlight runs concurrent calls of a key
+// once and hands every caller its result or its exception.
+
+#include "bench.h"
+
+#include "replycache.h"
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+static std::shared_ptr<const std::string> MakeResult(const std::string& value)
+{
+    return std::make_shared<const std::string>(value);
+}
+
+static void CheckHitAndMiss()
+{
+    RPCReplyCache cache;
+    BENCH_CHECK(!cache.Get("k1"));
+    const std::shared_ptr<const std::string> result = MakeResult("[1,2,3]");
+    cache.Insert("m", "k1", cache.Generation("m"), 60000, result);
+    BENCH_CHECK(cache.Get("k1") == result);
+    BENCH_CHECK(!cache.Get("k2"));
+    // Inserting a key again replaces its entry
+    const std::shared_ptr<const std::string> newer = MakeResult("[4]");
+    cache.Insert("m", "k1", cache.Generation("m"), 60000, newer);
+    BENCH_CHECK(cache.Get("k1") == newer);
+
+    const RPCReplyCacheStats stats = cache.Stats();
+    BENCH_CHECK(stats.nEntries == 1 && stats.nInsertions == 2);
+    BENCH_CHECK(stats.nHits == 2 && stats.nMisses == 2);
+
+    cache.Clear();
+    BENCH_CHECK(!cache.Get("k1"));
+    BENCH_CHECK(cache.Stats().nEntries == 0 && cache.Stats().nBytes == 0);
+}
+
+static void CheckExpiry()
+{
+    RPCReplyCache cache;
+    cache.Insert("m", "short", cache.Generation("m"), 50, MakeResult("1"));
+    cache.Insert("m", "long", cache.Generation("m"), 60000, MakeResult("2"));
+    // A result without a TTL is not cached at all
+    cache.Insert("m", "none", cache.Generation("m"), 0, MakeResult("3"));
+    BENCH_CHECK(cache.Get("short") && cache.Get("long") && !cache.Get("none"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    BENCH_CHECK(!cache.Get("short"));
+    BENCH_CHECK(cache.Get("long"));
+    const RPCReplyCacheStats stats = cache.Stats();
+    BENCH_CHECK(stats.nExpired == 1 && stats.nEntries == 1 && stats.nInsertions == 2);
+}
+
+static void CheckEviction()
+{
+    // Room for a handful of entries per shard
+    const size_t nMaxBytes = 64 * 1024;
+    const std::string value(500, 'x');
+    RPCReplyCache cache(nMaxBytes);
+    const size_t nInserts = 1000;
+    for (size_t i = 0; i < nInserts; i++) {
+        const std::string key = "k" + std::to_string(i);
+        cache.Insert("m", key, cache.Generation("m"), 60000, MakeResult(value));
+        BENCH_CHECK(cache.Stats().nBytes <= nMaxBytes);
+        // The entry just inserted is never the one evicted
+        BENCH_CHECK(cache.Get(key));
+    }
+    RPCReplyCacheStats stats = cache.Stats();
+    BENCH_CHECK(stats.nEvictions > 0);
+    BENCH_CHECK(stats.nEntries + stats.nEvictions == nInserts);
+
+    // A result too big for its share of the cap is not cached
+    cache.Insert("m", "big", cache.Generation("m"), 60000, MakeResult(std::string(nMaxBytes, 'x')));
+    BENCH_CHECK(!cache.Get("big"));
+
+    // Shrinking the cap evicts right away
+    cache.SetMaxSize(nMaxBytes / 4);
+    stats = cache.Stats();
+    BENCH_CHECK(stats.nBytes <= nMaxBytes / 4 && stats.nEntries > 0);
+    cache.SetMaxSize(0);
+    BENCH_CHECK(cache.Stats().nEntries == 0 && cache.Stats().nBytes == 0);
+}
+
+static void CheckInvalidation()
+{
+    RPCReplyCache cache;
+    // Invalidating a method makes its entries stale, and only its entries
+    cache.Insert("m", "k1", cache.Generation("m"), 60000, MakeResult("1"));
+    cache.Insert("other", "k2", cache.Generation("other"), 60000, MakeResult("2"));
+    cache.Invalidate("m");
+    BENCH_CHECK(!cache.Get("k1"));
+    // Methods hashing to the same generation counter would invalidate each other
+    BENCH_CHECK(cache.Generation("m") == cache.Generation("other") || cache.Get("k2"));
+
+    // A result computed while the method was invalidated is dropped
+    const uint64_t nGeneration = cache.Generation("m");
+    const uint64_t nInsertions = cache.Stats().nInsertions;
+    cache.Invalidate("m");
+    cache.Insert("m", "k1", nGeneration, 60000, MakeResult("1"));
+    BENCH_CHECK(cache.Stats().nInsertions == nInsertions);
+    BENCH_CHECK(!cache.Get("k1"));
+
+    // Producers insert what they read, while the value keeps being changed
+    // and invalidated; a reader must never get a value older than the last
+    // change whose invalidation had finished before it looked
+    RPCReplyCache raced;
+    std::atomic<uint64_t> nValue(0);       //!< changed before each invalidation
+    std::atomic<uint64_t> nInvalidated(0); //!< value whose invalidation finished
+    std::atomic<bool> fDone(false);
+    std::atomic<uint64_t> nServed(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 2; i++) {
+        threads.emplace_back([&] {
+            while (!fDone.load()) {
+                const uint64_t nGen = raced.Generation("m");
+                const uint64_t n = nValue.load();
+                raced.Insert("m", "key", nGen, 60000, MakeResult(std::to_string(n)));
+            }
+        });
+        threads.emplace_back([&] {
+            while (!fDone.load()) {
+                const uint64_t nMin = nInvalidated.load();
+                std::shared_ptr<const std::string> result = raced.Get("key");
+                if (result) {
+                    BENCH_CHECK(std::stoull(*result) >= nMin);
+                    nServed++;
+                }
+            }
+        });
+    }
+    threads.emplace_back([&] {
+        const int64_t nEnd = BenchNow() + 500000000;
+        while (BenchNow() < nEnd) {
+            const uint64_t n = nValue.fetch_add(1) + 1;
+            raced.Invalidate("m");
+            nInvalidated = n;
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        fDone = true;
+    });
+    for (std::thread& thread : threads)
+        thread.join();
+    // Make sure the check saw the cache serve something
+    BENCH_CHECK(nServed.load() > 0);
+}
+
+/** Call Do for one key from nThreads threads at once. The producer waits
+ * until every other call has joined it, then returns result or, if it is
+ * null, throws.
+ * @returns what each thread got, null for an exception
+ */
+static std::vector<std::shared_ptr<const std::string>> FlightCalls(RPCSingleFlight& flight, size_t nThreads,
+                                                                   std::atomic<int>& nProduced,
+                                                                   std::shared_ptr<const std::string> result)
+{
+    const uint64_t nCoalesced = flight.Stats()["m"].nCoalesced + nThreads - 1;
+    const auto produce = [&flight, &nProduced, &result, nCoalesced]() -> std::shared_ptr<const std::string> {
+        nProduced++;
+        const int64_t nDeadline = BenchNow() + 10000000000;
+        while (flight.Stats()["m"].nCoalesced < nCoalesced && BenchNow() < nDeadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        if (!result)
+            throw std::runtime_error("producer failed");
+        return result;
+    };
+    std::vector<std::shared_ptr<const std::string>> results(nThreads);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < nThreads; i++) {
+        threads.emplace_back([&flight, &produce, &results, i] {
+            try {
+                results[i] = flight.Do("m", "key", produce);
+                BENCH_CHECK(results[i]);
+            } catch (const std::runtime_error& e) {
+                BENCH_CHECK(strcmp(e.what(), "producer failed") == 0);
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+    return results;
+}
+
+static void CheckSingleFlight()
+{
+    const size_t nThreads = 8;
+    RPCSingleFlight flight;
+    std::atomic<int> nProduced(0);
+
+    // The producer runs once and every caller gets its result
+    const std::shared_ptr<const std::string> result = MakeResult("[1]");
+    for (const std::shared_ptr<const std::string>& got : FlightCalls(flight, nThreads, nProduced, result))
+        BENCH_CHECK(got == result);
+    BENCH_CHECK(nProduced.load() == 1);
+    BENCH_CHECK(flight.Stats()["m"].nCalls == nThreads && flight.Stats()["m"].nCoalesced == nThreads - 1);
+
+    // Once it is done, the next call runs the producer again; its
+    // exception reaches every caller
+    for (const std::shared_ptr<const std::string>& got : FlightCalls(flight, nThreads, nProduced, nullptr))
+        BENCH_CHECK(!got);
+    BENCH_CHECK(nProduced.load() == 2);
+
+    // And a call after a failure starts afresh
+    const std::shared_ptr<const std::string> later = MakeResult("[2]");
+    BENCH_CHECK(flight.Do("m", "key", [&later] { return later; }) == later);
+    BENCH_CHECK(flight.Stats()["m"].nCalls == 2 * nThreads + 1);
+    BENCH_CHECK(flight.Stats()["m"].nCoalesced == 2 * (nThreads - 1));
+}
+
+static void RunChecks()
+{
+    CheckHitAndMiss();
+    CheckExpiry();
+    CheckEviction();
+    CheckInvalidation();
+    CheckSingleFlight();
+    printf("ok\n");
+}
+
+int main(int argc, char** argv)
+{
+    if (BenchCheckMode(argc, argv)) {
+        RunChecks();
+        return 0;
+    }
+
+    const size_t nKeys = 10000;
+    RPCReplyCache cache;
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < nKeys; i++) {
+        keys.push_back("getblockheader[\"" + std::to_string(i) + "\",true]");
+        cache.Insert("getblockheader", keys.back(), cache.Generation("getblockheader"), 3600000,
+                     MakeResult(std::string(500, 'x')));
+    }
+    const std::shared_ptr<const std::string> result = MakeResult(std::string(500, 'x'));
+
+    printf("nanoseconds per call, %zu entries\n", nKeys);
+    size_t n = 0;
+    printf("%-24s %8.1f\n", "get hit", BenchTime([&] {
+        BenchKeep(cache.Get(keys[n++ % nKeys]));
+    }));
+    printf("%-24s %8.1f\n", "get miss", BenchTime([&] {
+        BenchKeep(cache.Get("missing"));
+    }));
+    printf("%-24s %8.1f\n", "insert", BenchTime([&] {
+        const std::string& key = keys[n++ % nKeys];
+        cache.Insert("getblockheader", key, cache.Generation("getblockheader"), 3600000, result);
+    }));
+
+    // Hits from several threads at once, across the shards
+    for (size_t nThreads : {2, 4, 8}) {
+        std::atomic<uint64_t> nTotal(0);
+        const int64_t nStart = BenchNow();
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < nThreads; t++) {
+            threads.emplace_back([&cache, &keys, &nTotal, t, nKeys] {
+                uint64_t nCalls = 0;
+                for (size_t i = t; nCalls < 1000000; i += 7, nCalls++)
+                    BenchKeep(cache.Get(keys[i % nKeys]));
+                nTotal += nCalls;
+            });
+        }
+        for (std::thread& thread : threads)
+            thread.join();
+        const std::string label = "get hit, " + std::to_string(nThreads) + " threads";
+        printf("%-24s %8.1f\n", label.c_str(), (double)(BenchNow() - nStart) / nTotal.load());
+    }
+    return 0;
+}
@@ -0,0 +1,164 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// HTTPRouter lookup time on a routing table like the REST and RPC one. With
+// -check, run a table of URIs through the router and check the route each
+// resolves to, the path below it and the parameters captured, and check
+// malformed patterns are rejected.
+
+#include "bench.h"
+
+#include "httprouter.h"
+
+#include <string>
+#include <vector>
+
+/** Result for a URI no route matches */
+static const size_t NO_ROUTE = ~size_t(0);
+
+struct BenchRoute
+{
+    const char* pattern;
+    bool exactMatch;
+};
+
+/** Routes are numbered by their position */
+static const BenchRoute routes[] = {
+    {"/", true},                          // 0
+    {"/wallet/", true},                   // 1
+    {"/wallet/", false},                  // 2
+    {"/rest/", false},                    // 3
+    {"/rest/tx/", false},                 // 4
+    {"/rest/block/{hash}", true},         // 5
+    {"/rest/block/latest", true},         // 6
+    {"/rest/headers/{count}/{hash}", true}, // 7
+    {"/rest/headers/{count}/tip", true},  // 8
+    {"/rest/utxo/{txid}", false},         // 9
+    {"/rest/utxo/mempool", false},        // 10
+    {"/a/{x}/y", true},                   // 11
+    {"/a/b/{z}", true},                   // 12
+    {"/p/{a}/{b}/{c}/{d}/{e}/{f}/{g}/{h}", true}, // 13
+    {"/wallet/", false},                  // 14, same pattern as 2
+};
+
+struct BenchMatchCase
+{
+    const char* uri;
+    size_t route;
+    const char* path;                   //!< URI from pathBegin on
+    std::vector<std::string> params;
+};
+
+static const BenchMatchCase matchCases[] = {
+    // Exact beats prefix on the same pattern
+    {"/", 0, "", {}},
+    {"/wallet/", 1, "", {}},
+    {"/wallet/w1", 2, "w1", {}},
+    {"/walle", NO_ROUTE, "", {}},
+    {"/x", NO_ROUTE, "", {}},
+    // The longest prefix wins
+    {"/rest/", 3, "", {}},
+    {"/rest/chaininfo.json", 3, "chaininfo.json", {}},
+    {"/rest/tx/abcd.json", 4, "abcd.json", {}},
+    {"/rest/tx", 3, "tx", {}},
+    // A literal beats a parameter at the same position
+    {"/rest/block/latest", 6, "", {}},
+    {"/rest/block/00ff", 5, "", {"00ff"}},
+    {"/rest/headers/5/tip", 8, "", {"5"}},
+    {"/rest/headers/5/00ff", 7, "", {"5", "00ff"}},
+    {"/rest/utxo/mempool/checkmempool", 10, "/checkmempool", {}},
+    {"/rest/utxo/00ff/checkmempool", 9, "/checkmempool", {"00ff"}},
+    {"/a/b/y", 12, "", {"y"}},
+    {"/a/c/y", 11, "", {"c"}},
+    {"/a/b/z", 12, "", {"z"}},
+    // A parameter matches one non-empty segment, else a shorter prefix wins
+    {"/rest/block/", 3, "block/", {}},
+    {"/rest/block/a/b", 3, "block/a/b", {}},
+    {"/rest/block/latest/x", 3, "block/latest/x", {}},
+    {"/rest/utxo/", 3, "utxo/", {}},
+    {"/rest/utxo/00ff?count=1", 9, "?count=1", {"00ff"}},
+    // Up to MAX_PARAMS parameters are captured
+    {"/p/1/2/3/4/5/6/7/8", 13, "", {"1", "2", "3", "4", "5", "6", "7", "8"}},
+    {"/p/1/2/3/4/5/6/7", NO_ROUTE, "", {}},
+};
+
+/** Patterns Add must reject */
+static const char* const malformedPatterns[] = {
+    "/rest/{",           // unclosed
+    "/rest/{}",          // no name
+    "/rest/{a{b}",       // brace in the name
+    "/rest/{a/b}",       // slash in the name
+    "/rest/{hash}.json", // not a whole segment
+    "/p/{a}/{b}/{c}/{d}/{e}/{f}/{g}/{h}/{i}", // more than MAX_PARAMS
+};
+
+static void BuildRouter(HTTPRouter& router)
+{
+    for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++)
+        BENCH_CHECK(router.Add(routes[i].pattern, routes[i].exactMatch, i));
+}
+
+static void RunChecks()
+{
+    HTTPRouter router;
+    BuildRouter(router);
+    for (const BenchMatchCase& test : matchCases) {
+        const std::string uri = test.uri;
+        HTTPRouteMatch match;
+        const bool fMatched = router.Match(uri, match);
+        if (test.route == NO_ROUTE) {
+            if (fMatched)
+                fprintf(stderr, "%s: matched route %zu\n", test.uri, match.route);
+            BENCH_CHECK(!fMatched);
+            continue;
+        }
+        if (!fMatched || match.route != test.route)
+            fprintf(stderr, "%s: expected route %zu\n", test.uri, test.route);
+        BENCH_CHECK(fMatched && match.route == test.route);
+        BENCH_CHECK(uri.substr(match.pathBegin) == test.path);
+        BENCH_CHECK(match.nParams == test.params.size());
+        for (size_t i = 0; i < match.nParams; i++)
+            BENCH_CHECK(uri.substr(match.params[i].first, match.params[i].second) == test.params[i]);
+    }
+    BENCH_CHECK(router.ParamNames(7) == std::vector<std::string>({"count", "hash"}));
+    BENCH_CHECK(router.ParamNames(13).size() == HTTPRouteMatch::MAX_PARAMS);
+    BENCH_CHECK(router.ParamNames(0).empty());
+
+    // A rejected pattern leaves the router as it was
+    for (const char* pattern : malformedPatterns) {
+        for (bool exactMatch : {true, false}) {
+            if (router.Add(pattern, exactMatch, 100))
+                fprintf(stderr, "%s: accepted\n", pattern);
+            BENCH_CHECK(!router.Add(pattern, exactMatch, 100));
+        }
+    }
+    HTTPRouteMatch match;
+    BENCH_CHECK(router.Match("/rest/tx/abcd", match) && match.route == 4);
+    BENCH_CHECK(router.Match("/rest/abcd.json", match) && match.route == 3);
+    BENCH_CHECK(router.ParamNames(100).empty());
+    printf("ok\n");
+}
+
+int main(int argc, char** argv)
+{
+    if (BenchCheckMode(argc, argv)) {
+        RunChecks();
+        return 0;
+    }
+
+    HTTPRouter router;
+    BuildRouter(router);
+    printf("nanoseconds per match, %zu routes\n", sizeof(routes) / sizeof(routes[0]));
+    for (const char* uri : {"/", "/wallet/w1", "/rest/tx/abcd.json", "/rest/headers/5/00ff", "/rest/utxo/00ff/checkmempool",
+                            "/p/1/2/3/4/5/6/7/8", "/nothing/here"}) {
+        const std::string strURI = uri;
+        const double nNanos = BenchTime([&router, &strURI] {
+            HTTPRouteMatch match;
+            BenchKeep(router.Match(strURI, match));
+            BenchKeep(match);
+        });
+        printf("%-32s %8.1f\n", uri, nNanos);
+    }
+    return 0;
+}
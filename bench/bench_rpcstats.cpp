@@ -0,0 +1,126 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Cost of recording a call in the per-method RPC counters, alone and from
+// several threads at once. With -check, check the counters of calls
+// recorded by several threads add up.
+
+#include "bench.h"
+
+#include "protocol.h"
+#include "rpcstats.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+static RPCMethodStats FindStats(const std::string& method)
+{
+    for (const RPCMethodStats& stats : GetRPCStats()) {
+        if (stats.method == method)
+            return stats;
+    }
+    BENCH_CHECK(false);
+    return RPCMethodStats();
+}
+
+static void RunChecks()
+{
+    // Buckets grow with the value and hold it to within an eighth
+    for (uint64_t nValue = 0; nValue < 1000000; nValue += 1 + nValue / 64) {
+        const size_t nBucket = RPCLatencyHistogram::Bucket(nValue);
+        BENCH_CHECK(nBucket <= RPCLatencyHistogram::Bucket(nValue + 1));
+        BENCH_CHECK(RPCLatencyHistogram::BucketMax(nBucket) >= nValue);
+        BENCH_CHECK(RPCLatencyHistogram::BucketMax(nBucket) - nValue <= nValue / RPCLatencyHistogram::SUB_BUCKETS);
+    }
+
+    // Every tenth call fails; the others get a reply
+    const size_t nThreads = 4, nCalls = 10000;
+    const size_t nMethod = RPCStatsRegisterMethod("check");
+    BENCH_CHECK(RPCStatsRegisterMethod("check") == nMethod);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < nThreads; t++) {
+        threads.emplace_back([nMethod] {
+            // A reply without a call is not counted
+            RPCStatsRecordReply(1, true);
+            for (size_t i = 0; i < nCalls; i++) {
+                const int64_t nStart = 1000000;
+                RPCStatsRecordCall(nMethod, nStart - 500, nStart, nStart + 1000 + (i % 100) * 10, 100,
+                                   i % 10 == 0 ? RPC_INVALID_PARAMETER : 0);
+                RPCStatsRecordReply(200, true);
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+
+    const RPCMethodStats stats = FindStats("check");
+    const uint64_t nTotal = nThreads * nCalls, nFailed = nTotal / 10;
+    BENCH_CHECK(stats.nCalls == nTotal);
+    BENCH_CHECK(stats.nErrors == nFailed);
+    BENCH_CHECK(stats.errors.size() == 1 && stats.errors.at(RPC_INVALID_PARAMETER) == nFailed);
+    BENCH_CHECK(stats.nBytesIn == nTotal * 100);
+    BENCH_CHECK(stats.nBytesOut == (nTotal - nFailed) * 200);
+    BENCH_CHECK(stats.latency[RPC_PHASE_QUEUE].nCount == nTotal);
+    BENCH_CHECK(stats.latency[RPC_PHASE_QUEUE].nMax == 500);
+    BENCH_CHECK(stats.latency[RPC_PHASE_DISPATCH].nCount == nTotal - nFailed);
+
+    const RPCLatencyHistogram& exec = stats.latency[RPC_PHASE_EXEC];
+    BENCH_CHECK(exec.nCount == nTotal);
+    BENCH_CHECK(exec.nSum == nTotal * 1495);
+    BENCH_CHECK(exec.nMax == 1990);
+    BENCH_CHECK(exec.Percentile(1.0) == 1990);
+    const uint64_t nMedian = exec.Percentile(0.5);
+    BENCH_CHECK(nMedian >= 1490 && nMedian <= 1490 + 1490 / RPCLatencyHistogram::SUB_BUCKETS);
+    printf("ok\n");
+}
+
+/** Nanoseconds per call of record, each of nThreads calling it at once */
+template <typename F>
+static double TimeThreads(size_t nThreads, F record)
+{
+    const uint64_t nCalls = 10000000;
+    std::vector<std::thread> threads;
+    const int64_t nStart = BenchNow();
+    for (size_t t = 0; t < nThreads; t++) {
+        threads.emplace_back([&record, nCalls] {
+            for (uint64_t i = 0; i < nCalls; i++)
+                record(i);
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+    return (double)(BenchNow() - nStart) / nCalls;
+}
+
+int main(int argc, char** argv)
+{
+    if (BenchCheckMode(argc, argv)) {
+        RunChecks();
+        return 0;
+    }
+
+    const size_t nMethod = RPCStatsRegisterMethod("bench");
+    printf("nanoseconds per call\n");
+    printf("%-40s %8.1f\n", "RPCStatsNow", BenchTime([] { BenchKeep(RPCStatsNow()); }));
+    int64_t nEnd = 3000;
+    printf("%-40s %8.1f\n", "RPCStatsRecordCall", BenchTime([nMethod, &nEnd] {
+        RPCStatsRecordCall(nMethod, 1000, 2000, nEnd++, 100, 0);
+    }));
+    printf("%-40s %8.1f\n", "RecordCall and RecordReply, with clock", BenchTime([nMethod] {
+        const int64_t nStart = RPCStatsNow();
+        RPCStatsRecordCall(nMethod, nStart - 1000, nStart, RPCStatsNow(), 100, 0);
+        RPCStatsRecordReply(200, true);
+    }));
+    // Each thread writes its own counters, so the time per call should stay
+    // flat as long as there are cores for the threads
+    for (size_t nThreads = 1; nThreads <= 8; nThreads *= 2) {
+        const double nNanos = TimeThreads(nThreads, [nMethod](uint64_t i) {
+            RPCStatsRecordCall(nMethod, 1000, 2000, 3000 + i, 100, 0);
+        });
+        const std::string label = "RPCStatsRecordCall, " + std::to_string(nThreads) + " threads";
+        printf("%-40s %8.1f\n", label.c_str(), nNanos);
+    }
+    return 0;
+}
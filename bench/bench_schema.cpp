@@ -0,0 +1,176 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Type checks of wide objects: a compiled RPCObjSchema against
+// RPCTypeCheckObj, which compiles one per call, and against looking up
+// every expected key in the object as RPCTypeCheckObj used to. With -check,
+// check the errors RPCObjSchema reports.
+
+#include "bench.h"
+
+#include "protocol.h"
+#include "server.h"
+
+#include <map>
+#include <string>
+
+static const json::value_t fieldTypes[] = {json::value_t::string, json::value_t::number_float,
+                                           json::value_t::boolean, json::value_t::array};
+
+static std::string FieldName(size_t i)
+{
+    return "field_" + std::to_string(i);
+}
+
+/** Schema of nFields keys of rotating types */
+static std::map<std::string, jsonType> MakeTypes(size_t nFields)
+{
+    std::map<std::string, jsonType> types;
+    for (size_t i = 0; i < nFields; i++)
+        types[FieldName(i)] = jsonType(fieldTypes[i % 4]);
+    return types;
+}
+
+/** Object that passes the schema of MakeTypes(nFields) */
+static json MakeObject(size_t nFields)
+{
+    json o = json::object();
+    for (size_t i = 0; i < nFields; i++) {
+        const std::string name = FieldName(i);
+        switch (i % 4) {
+        case 0: o[name] = "value"; break;
+        case 1: o[name] = 1.5; break;
+        case 2: o[name] = true; break;
+        case 3: o[name] = json::array({1, 2}); break;
+        }
+    }
+    return o;
+}
+
+/** One lookup in the object per expected key, then one in the map per key
+ * of the object when strict
+ */
+static void CheckPerKey(const json& o, const std::map<std::string, jsonType>& typesExpected, bool fAllowNull, bool fStrict)
+{
+    for (const auto& t : typesExpected) {
+        json::const_iterator it = o.find(t.first);
+        if (it == o.end() || it->is_null()) {
+            if (fAllowNull)
+                continue;
+            throw JSONRPCError(RPC_TYPE_ERROR, "Missing " + t.first);
+        }
+        if (!t.second.typeAny && it->type() != t.second.type)
+            throw JSONRPCError(RPC_TYPE_ERROR, "Expected type " + RPCTypeName(t.second.type) + " for " + t.first);
+    }
+    if (fStrict) {
+        for (json::const_iterator it = o.begin(); it != o.end(); ++it) {
+            if (typesExpected.count(it.key()) == 0)
+                throw JSONRPCError(RPC_TYPE_ERROR, "Unexpected key " + it.key());
+        }
+    }
+}
+
+/** Message of the error a check throws, or "" if it passes */
+template <typename F>
+static std::string CheckError(F check)
+{
+    try {
+        check();
+    } catch (const json& e) {
+        BENCH_CHECK(e["code"] == RPC_TYPE_ERROR);
+        return e["message"];
+    }
+    return "";
+}
+
+static std::string SchemaError(const RPCObjSchema& schema, const json& o)
+{
+    return CheckError([&schema, &o] { schema.Check(o); });
+}
+
+static void RunChecks()
+{
+    const std::map<std::string, jsonType> types = {
+        {"txid", jsonType(json::value_t::string)},
+        {"vout", jsonType(json::value_t::number_float)},
+        {"data", jsonType()},
+    };
+    const json valid = {{"txid", "00ff"}, {"vout", 1}, {"data", {1, 2}}};
+    const RPCObjSchema schema(types);
+    const RPCObjSchema strict(types, false, true);
+    const RPCObjSchema allowNull(types, true);
+    BENCH_CHECK(SchemaError(schema, valid) == "");
+    BENCH_CHECK(SchemaError(strict, valid) == "");
+    BENCH_CHECK(SchemaError(allowNull, valid) == "");
+
+    // Keys that are not expected only matter when strict
+    json extra = valid;
+    extra["extra"] = 1;
+    BENCH_CHECK(SchemaError(schema, extra) == "");
+    BENCH_CHECK(SchemaError(strict, extra) == "Unexpected key extra");
+    BENCH_CHECK(CheckError([&extra, &types] { RPCTypeCheckObj(extra, types, false, true); }) == "Unexpected key extra");
+
+    // Null and missing keys are the same thing: errors, unless fAllowNull
+    json nullKey = valid;
+    nullKey["vout"] = nullptr;
+    json missingKey = valid;
+    missingKey.erase("vout");
+    BENCH_CHECK(SchemaError(schema, nullKey) == "Missing vout");
+    BENCH_CHECK(SchemaError(schema, missingKey) == "Missing vout");
+    BENCH_CHECK(SchemaError(allowNull, nullKey) == "");
+    BENCH_CHECK(SchemaError(allowNull, missingKey) == "");
+    BENCH_CHECK(SchemaError(allowNull, json::object()) == "");
+    BENCH_CHECK(SchemaError(schema, json::object()) == "Missing data");
+    BENCH_CHECK(SchemaError(schema, json::array()) == "Missing data");
+
+    // Types are checked even when nulls are allowed; numbers of any kind match
+    json wrongType = valid;
+    wrongType["vout"] = "1";
+    BENCH_CHECK(SchemaError(schema, wrongType) == "Expected type number for vout, got string");
+    BENCH_CHECK(SchemaError(allowNull, wrongType) == "Expected type number for vout, got string");
+    json unsignedVout = valid;
+    unsignedVout["vout"] = 1u;
+    BENCH_CHECK(SchemaError(schema, unsignedVout) == "");
+    json anyData = valid;
+    anyData["data"] = "anything";
+    BENCH_CHECK(SchemaError(schema, anyData) == "");
+
+    // More fields than fit in one word of the required bitset, and more than
+    // fit on the stack
+    for (size_t nFields : {65, 130, 300}) {
+        const RPCObjSchema wide(MakeTypes(nFields));
+        const json o = MakeObject(nFields);
+        BENCH_CHECK(SchemaError(wide, o) == "");
+        for (size_t i : {(size_t)0, (size_t)63, (size_t)64, nFields - 1}) {
+            json missing = o;
+            missing.erase(FieldName(i));
+            BENCH_CHECK(SchemaError(wide, missing) == "Missing " + FieldName(i));
+        }
+        json wrong = o;
+        wrong[FieldName(nFields - 1)] = nullptr;
+        BENCH_CHECK(SchemaError(wide, wrong) == "Missing " + FieldName(nFields - 1));
+    }
+    printf("ok\n");
+}
+
+int main(int argc, char** argv)
+{
+    if (BenchCheckMode(argc, argv)) {
+        RunChecks();
+        return 0;
+    }
+
+    printf("nanoseconds per check of a valid object\n");
+    printf("%8s %12s %16s %12s\n", "fields", "per key", "RPCTypeCheckObj", "schema");
+    for (size_t nFields : {8, 50, 64, 100, 300}) {
+        const std::map<std::string, jsonType> types = MakeTypes(nFields);
+        const json o = MakeObject(nFields);
+        const RPCObjSchema schema(types, false, true);
+        const double nPerKey = BenchTime([&o, &types] { CheckPerKey(o, types, false, true); });
+        const double nCompile = BenchTime([&o, &types] { RPCTypeCheckObj(o, types, false, true); });
+        const double nSchema = BenchTime([&o, &schema] { schema.Check(o); });
+        printf("%8zu %12.0f %16.0f %12.0f\n", nFields, nPerKey, nCompile, nSchema);
+    }
+    return 0;
+}
@@ -0,0 +1,311 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// WorkQueue throughput as the number of workers grows: the mutex-protected
+// deque it used to be against the MPMC ring that replaced it. With -check,
+// stress the ring and its EventCount and check every item runs exactly once.
+
+#include "bench.h"
+
+#include "lockfreequeue.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/** Threads enqueueing, like the HTTP event loops do */
+static const size_t BENCH_PRODUCERS = 4;
+static const size_t BENCH_QUEUE_DEPTH = 4096;
+static const size_t BENCH_MAX_WORKERS = 64;
+
+/** WorkQueue as it was: a std::deque under one mutex */
+template <typename WorkItem>
+class LockedWorkQueue
+{
+private:
+    std::mutex cs;
+    std::condition_variable cond;
+    std::deque<std::unique_ptr<WorkItem>> queue;
+    bool running;
+    size_t maxDepth;
+
+public:
+    explicit LockedWorkQueue(size_t _maxDepth) : running(true),
+                                                 maxDepth(_maxDepth)
+    {
+    }
+    bool Enqueue(WorkItem* item)
+    {
+        std::unique_lock<std::mutex> lock(cs);
+        if (queue.size() >= maxDepth) {
+            return false;
+        }
+        queue.emplace_back(std::unique_ptr<WorkItem>(item));
+        cond.notify_one();
+        return true;
+    }
+    void Run()
+    {
+        while (true) {
+            std::unique_ptr<WorkItem> i;
+            {
+                std::unique_lock<std::mutex> lock(cs);
+                while (running && queue.empty())
+                    cond.wait(lock);
+                if (!running)
+                    break;
+                i = std::move(queue.front());
+                queue.pop_front();
+            }
+            (*i)();
+        }
+    }
+    void Interrupt()
+    {
+        std::unique_lock<std::mutex> lock(cs);
+        running = false;
+        cond.notify_all();
+    }
+};
+
+/** WorkQueue on the MPMC ring, idle workers sleeping on an EventCount */
+template <typename WorkItem>
+class RingWorkQueue
+{
+private:
+    MPMCQueue<WorkItem*> queue;
+    EventCount idle;
+    std::atomic<bool> running;
+
+public:
+    explicit RingWorkQueue(size_t _maxDepth) : queue(_maxDepth),
+                                               running(true)
+    {
+    }
+    ~RingWorkQueue()
+    {
+        WorkItem* i;
+        while (queue.TryPop(i))
+            delete i;
+    }
+    bool Enqueue(WorkItem* item)
+    {
+        if (!queue.TryPush(item)) {
+            return false;
+        }
+        idle.NotifyOne();
+        return true;
+    }
+    void Run()
+    {
+        while (running.load(std::memory_order_relaxed)) {
+            WorkItem* i;
+            if (!queue.TryPop(i)) {
+                uint32_t key = idle.PrepareWait();
+                if (!running.load() || !queue.TryPop(i)) {
+                    if (running.load())
+                        idle.Wait(key);
+                    else
+                        idle.CancelWait();
+                    continue;
+                }
+                idle.CancelWait();
+            }
+            std::unique_ptr<WorkItem> item(i);
+            (*item)();
+        }
+    }
+    void Interrupt()
+    {
+        running = false;
+        idle.NotifyAll();
+    }
+};
+
+/** Items run by one worker, on a cache line of its own */
+struct alignas(64) WorkerCount
+{
+    std::atomic<uint64_t> n;
+};
+static WorkerCount workerCounts[BENCH_MAX_WORKERS];
+static thread_local WorkerCount* workerCount = nullptr;
+
+struct BenchItem
+{
+    size_t n;
+    std::atomic<uint32_t>* runs; //!< times each item ran, or nullptr when only timing
+    void operator()()
+    {
+        if (runs)
+            runs[n].fetch_add(1, std::memory_order_relaxed);
+        workerCount->n.store(workerCount->n.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+};
+
+static uint64_t ItemsRun(size_t nWorkers)
+{
+    uint64_t nTotal = 0;
+    for (size_t i = 0; i < nWorkers; i++)
+        nTotal += workerCounts[i].n.load(std::memory_order_relaxed);
+    return nTotal;
+}
+
+/** Push nItems through a queue with nWorkers workers.
+ * @param[in] fBursts  pause the producers every few items, so workers keep
+ *                     going to sleep and being woken
+ * @returns items per second
+ */
+template <typename Queue>
+static double RunQueue(size_t nWorkers, size_t nItems, std::atomic<uint32_t>* runs, bool fBursts)
+{
+    Queue queue(BENCH_QUEUE_DEPTH);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < nWorkers; i++) {
+        workerCounts[i].n = 0;
+        workers.emplace_back([&queue, i] {
+            workerCount = &workerCounts[i];
+            queue.Run();
+        });
+    }
+
+    const int64_t nStart = BenchNow();
+    std::vector<std::thread> producers;
+    for (size_t p = 0; p < BENCH_PRODUCERS; p++) {
+        producers.emplace_back([&queue, p, nItems, runs, fBursts] {
+            for (size_t n = p; n < nItems; n += BENCH_PRODUCERS) {
+                BenchItem* item = new BenchItem{n, runs};
+                while (!queue.Enqueue(item))
+                    std::this_thread::yield();
+                if (fBursts && n % 64 < BENCH_PRODUCERS)
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        });
+    }
+    for (std::thread& producer : producers)
+        producer.join();
+    while (ItemsRun(nWorkers) < nItems)
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    const int64_t nElapsed = BenchNow() - nStart;
+
+    // Workers are asleep by now; all of them have to wake up to exit
+    queue.Interrupt();
+    for (std::thread& worker : workers)
+        worker.join();
+    BENCH_CHECK(ItemsRun(nWorkers) == nItems);
+    return nItems * 1e9 / nElapsed;
+}
+
+/** Producers and consumers hammering a ring small enough to be full and
+ * empty all the time, the consumers sleeping on an EventCount when empty
+ */
+static void CheckRingExactlyOnce(size_t nCapacity, size_t nProducers, size_t nConsumers, size_t nItems)
+{
+    MPMCQueue<size_t> queue(nCapacity);
+    EventCount nonEmpty;
+    std::unique_ptr<std::atomic<uint32_t>[]> runs(new std::atomic<uint32_t>[nItems]);
+    for (size_t n = 0; n < nItems; n++)
+        runs[n] = 0;
+    std::atomic<size_t> nPopped(0);
+    std::atomic<bool> fDone(false);
+
+    std::vector<std::thread> consumers;
+    for (size_t c = 0; c < nConsumers; c++) {
+        consumers.emplace_back([&] {
+            size_t n;
+            while (true) {
+                if (!queue.TryPop(n)) {
+                    uint32_t key = nonEmpty.PrepareWait();
+                    if (!queue.TryPop(n)) {
+                        if (fDone.load()) {
+                            nonEmpty.CancelWait();
+                            return;
+                        }
+                        nonEmpty.Wait(key);
+                        continue;
+                    }
+                    nonEmpty.CancelWait();
+                }
+                runs[n].fetch_add(1, std::memory_order_relaxed);
+                nPopped.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    }
+    std::vector<std::thread> producers;
+    for (size_t p = 0; p < nProducers; p++) {
+        producers.emplace_back([&, p] {
+            for (size_t n = p; n < nItems; n += nProducers) {
+                while (!queue.TryPush(n))
+                    std::this_thread::yield();
+                nonEmpty.NotifyOne();
+            }
+        });
+    }
+    for (std::thread& producer : producers)
+        producer.join();
+    while (nPopped.load() < nItems)
+        std::this_thread::yield();
+    fDone = true;
+    nonEmpty.NotifyAll();
+    for (std::thread& consumer : consumers)
+        consumer.join();
+
+    BENCH_CHECK(nPopped.load() == nItems);
+    for (size_t n = 0; n < nItems; n++)
+        BENCH_CHECK(runs[n].load() == 1);
+}
+
+static void RunChecks()
+{
+    // Capacity rounds up to a power of two, and the ring reports full and empty
+    MPMCQueue<int> queue(5);
+    BENCH_CHECK(queue.Capacity() == 8);
+    int n;
+    BENCH_CHECK(!queue.TryPop(n));
+    for (int i = 0; i < 8; i++)
+        BENCH_CHECK(queue.TryPush(i));
+    BENCH_CHECK(!queue.TryPush(8));
+    BENCH_CHECK(queue.Size() == 8);
+    for (int i = 0; i < 8; i++)
+        BENCH_CHECK(queue.TryPop(n) && n == i);
+    BENCH_CHECK(!queue.TryPop(n));
+
+    CheckRingExactlyOnce(2, 4, 4, 200000);
+    CheckRingExactlyOnce(64, 8, 2, 200000);
+    CheckRingExactlyOnce(64, 1, 16, 200000);
+
+    // The work queue, with workers going to sleep between bursts
+    const size_t nItems = 100000;
+    std::unique_ptr<std::atomic<uint32_t>[]> runs(new std::atomic<uint32_t>[nItems]);
+    for (size_t nWorkers : {1, 3, 16, 64}) {
+        for (size_t i = 0; i < nItems; i++)
+            runs[i] = 0;
+        RunQueue<RingWorkQueue<BenchItem>>(nWorkers, nItems, runs.get(), true);
+        for (size_t i = 0; i < nItems; i++)
+            BENCH_CHECK(runs[i].load() == 1);
+    }
+    printf("ok\n");
+}
+
+int main(int argc, char** argv)
+{
+    if (BenchCheckMode(argc, argv)) {
+        RunChecks();
+        return 0;
+    }
+
+    const size_t nItems = 1000000;
+    printf("%zu items from %zu producers, queue depth %zu, items per second\n",
+           nItems, BENCH_PRODUCERS, BENCH_QUEUE_DEPTH);
+    printf("%8s %14s %14s\n", "workers", "locked deque", "mpmc ring");
+    for (size_t nWorkers = 1; nWorkers <= BENCH_MAX_WORKERS; nWorkers *= 2) {
+        const double nLocked = RunQueue<LockedWorkQueue<BenchItem>>(nWorkers, nItems, nullptr, false);
+        const double nRing = RunQueue<RingWorkQueue<BenchItem>>(nWorkers, nItems, nullptr, false);
+        printf("%8zu %14.0f %14.0f\n", nWorkers, nLocked, nRing);
+    }
+    return 0;
+}
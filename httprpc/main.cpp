@@ -1,9 +1,11 @@
 #include "libhttp/httpserver.h"
+#include "libhttp/httpmetrics.h"
 #include <unistd.h>
 
 int main(int argc,char*argv[])
 {
 	InitHTTPServer();
+	StartHTTPMetrics();
 	StartHTTPServer();
 	while(true)
 	{
@@ -0,0 +1,253 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <httpcompress.h>
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/** Compression levels: cheap enough to run for every large reply, while
+ * still getting most of what JSON has to give
+ */
+static const int GZIP_LEVEL = 5;
+#ifdef HAVE_ZSTD
+static const int ZSTD_LEVEL = 3;
+#endif
+/** Step by which the output of a decompression is grown */
+static const size_t DECOMPRESS_STEP = 64 * 1024;
+
+const char* HTTPCodingName(HTTPContentCoding coding)
+{
+    switch (coding) {
+    case HTTP_CODING_GZIP:
+        return "gzip";
+    case HTTP_CODING_ZSTD:
+        return "zstd";
+    case HTTP_CODING_IDENTITY:
+    case HTTP_CODING_UNSUPPORTED:
+        break;
+    }
+    return "identity";
+}
+
+/** Lower-cased token between begin and end, without parameters and blanks */
+static std::string HTTPBareToken(const std::string& header, size_t begin, size_t end)
+{
+    end = std::min(end, header.find(';', begin));
+    while (begin < end && (header[begin] == ' ' || header[begin] == '\t'))
+        begin++;
+    while (end > begin && (header[end - 1] == ' ' || header[end - 1] == '\t'))
+        end--;
+    std::string token = header.substr(begin, end - begin);
+    for (char& c : token) {
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+    }
+    return token;
+}
+
+/** Coding named by a token, or HTTP_CODING_UNSUPPORTED */
+static HTTPContentCoding HTTPCodingFromToken(const std::string& token)
+{
+    if (token.empty() || token == "identity")
+        return HTTP_CODING_IDENTITY;
+    if (token == "gzip" || token == "x-gzip")
+        return HTTP_CODING_GZIP;
+#ifdef HAVE_ZSTD
+    if (token == "zstd")
+        return HTTP_CODING_ZSTD;
+#endif
+    return HTTP_CODING_UNSUPPORTED;
+}
+
+HTTPContentCoding HTTPCodingFromContentEncoding(const std::string& header)
+{
+    if (header.find(',') != std::string::npos)
+        return HTTP_CODING_UNSUPPORTED;
+    return HTTPCodingFromToken(HTTPBareToken(header, 0, header.size()));
+}
+
+HTTPContentCoding HTTPCodingFromAcceptEncoding(const std::string& header)
+{
+    HTTPContentCoding best = HTTP_CODING_IDENTITY;
+    double bestQ = 0;
+    for (size_t begin = 0; begin < header.size();) {
+        size_t end = header.find(',', begin);
+        if (end == std::string::npos)
+            end = header.size();
+        HTTPContentCoding coding = HTTPCodingFromToken(HTTPBareToken(header, begin, end));
+        if (coding == HTTP_CODING_GZIP || coding == HTTP_CODING_ZSTD) {
+            double q = 1;
+            size_t pos = header.find("q=", begin);
+            if (pos < end)
+                q = atof(header.c_str() + pos + 2);
+            if (q > bestQ || (q == bestQ && q > 0 && coding == HTTP_CODING_ZSTD)) {
+                best = coding;
+                bestQ = q;
+            }
+        }
+        begin = end + 1;
+    }
+    return best;
+}
+
+static bool GzipCompress(const std::vector<std::pair<const char*, size_t>>& segs, std::string& out)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 16 added to the window bits selects the gzip wrapper
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    uLong total = 0;
+    for (const auto& seg : segs)
+        total += seg.second;
+    // Reserve the worst case, so that a single pass suffices
+    out.resize(deflateBound(&zs, total));
+    zs.next_out = (Bytef*)&out[0];
+    zs.avail_out = out.size();
+    int ret = Z_OK;
+    for (size_t i = 0; i < segs.size() && ret == Z_OK; i++) {
+        zs.next_in = (Bytef*)segs[i].first;
+        zs.avail_in = segs[i].second;
+        ret = deflate(&zs, Z_NO_FLUSH);
+    }
+    if (ret == Z_OK)
+        ret = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+static bool GzipDecompress(const std::vector<std::pair<const char*, size_t>>& segs, std::string& out, size_t nMaxSize)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 32 added to the window bits detects the gzip or zlib wrapper
+    if (inflateInit2(&zs, 15 + 32) != Z_OK)
+        return false;
+    out.clear();
+    int ret = Z_OK;
+    size_t i = 0;
+    for (; i < segs.size() && ret == Z_OK; i++) {
+        zs.next_in = (Bytef*)segs[i].first;
+        zs.avail_in = segs[i].second;
+        // Also go on while the output is full, inflate may hold back more
+        while (ret == Z_OK && (zs.avail_in > 0 || zs.avail_out == 0)) {
+            if (zs.total_out >= nMaxSize + 1) {
+                ret = Z_BUF_ERROR;
+                break;
+            }
+            size_t step = std::min(DECOMPRESS_STEP, nMaxSize + 1 - zs.total_out);
+            out.resize(zs.total_out + step);
+            zs.next_out = (Bytef*)&out[zs.total_out];
+            zs.avail_out = step;
+            ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret == Z_BUF_ERROR && zs.avail_out > 0)
+                ret = Z_OK; // consumed all input without producing output
+        }
+    }
+    out.resize(zs.total_out);
+    inflateEnd(&zs);
+    // Stop at the end of the stream; trailing garbage is rejected too
+    return ret == Z_STREAM_END && zs.avail_in == 0 && i == segs.size() && out.size() <= nMaxSize;
+}
+
+#ifdef HAVE_ZSTD
+static bool ZstdCompress(const std::vector<std::pair<const char*, size_t>>& segs, std::string& out)
+{
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    if (!cctx)
+        return false;
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, ZSTD_LEVEL);
+    size_t total = 0;
+    for (const auto& seg : segs)
+        total += seg.second;
+    ZSTD_CCtx_setPledgedSrcSize(cctx, total);
+    out.resize(ZSTD_compressBound(total));
+    ZSTD_outBuffer output = {&out[0], out.size(), 0};
+    bool fOk = true;
+    for (size_t i = 0; i < segs.size() && fOk; i++) {
+        ZSTD_inBuffer input = {segs[i].first, segs[i].second, 0};
+        while (fOk && input.pos < input.size)
+            fOk = !ZSTD_isError(ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_continue));
+    }
+    ZSTD_inBuffer none = {nullptr, 0, 0};
+    size_t remaining = 1;
+    while (fOk && remaining > 0) {
+        remaining = ZSTD_compressStream2(cctx, &output, &none, ZSTD_e_end);
+        fOk = !ZSTD_isError(remaining) && (remaining == 0 || output.pos < output.size);
+    }
+    out.resize(output.pos);
+    ZSTD_freeCCtx(cctx);
+    return fOk;
+}
+
+static bool ZstdDecompress(const std::vector<std::pair<const char*, size_t>>& segs, std::string& out, size_t nMaxSize)
+{
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    if (!dctx)
+        return false;
+    out.clear();
+    size_t used = 0;
+    size_t ret = 1; // 0 once a frame is complete
+    bool fOk = true;
+    for (size_t i = 0; i < segs.size() && fOk; i++) {
+        ZSTD_inBuffer input = {segs[i].first, segs[i].second, 0};
+        bool fFull;
+        do {
+            if (used > nMaxSize) {
+                fOk = false;
+                break;
+            }
+            size_t step = std::min(DECOMPRESS_STEP, nMaxSize + 1 - used);
+            out.resize(used + step);
+            ZSTD_outBuffer output = {&out[used], step, 0};
+            ret = ZSTD_decompressStream(dctx, &output, &input);
+            used += output.pos;
+            fOk = !ZSTD_isError(ret);
+            // A full output buffer may leave decoded data behind in the context
+            fFull = output.pos == output.size;
+        } while (fOk && (input.pos < input.size || fFull));
+    }
+    out.resize(used);
+    ZSTD_freeDCtx(dctx);
+    return fOk && ret == 0 && used <= nMaxSize;
+}
+#endif
+
+bool HTTPCompress(HTTPContentCoding coding, const std::vector<std::pair<const char*, size_t>>& segs,
+                  std::string& out)
+{
+    switch (coding) {
+    case HTTP_CODING_GZIP:
+        return GzipCompress(segs, out);
+#ifdef HAVE_ZSTD
+    case HTTP_CODING_ZSTD:
+        return ZstdCompress(segs, out);
+#endif
+    default:
+        return false;
+    }
+}
+
+bool HTTPDecompress(HTTPContentCoding coding, const std::vector<std::pair<const char*, size_t>>& segs,
+                    std::string& out, size_t nMaxSize)
+{
+    switch (coding) {
+    case HTTP_CODING_GZIP:
+        return GzipDecompress(segs, out, nMaxSize);
+#ifdef HAVE_ZSTD
+    case HTTP_CODING_ZSTD:
+        return ZstdDecompress(segs, out, nMaxSize);
+#endif
+    default:
+        return false;
+    }
+}
@@ -0,0 +1,51 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_HTTPCOMPRESS_H
+#define BITCOIN_HTTPCOMPRESS_H
+
+#include <stddef.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+/** HTTP content codings we can produce and decode. zstd is only available
+ * when built against libzstd (HAVE_ZSTD).
+ */
+enum HTTPContentCoding
+{
+    HTTP_CODING_IDENTITY,
+    HTTP_CODING_GZIP,
+    HTTP_CODING_ZSTD,
+    HTTP_CODING_UNSUPPORTED
+};
+
+/** Token of a coding as used in Content-Encoding */
+const char* HTTPCodingName(HTTPContentCoding coding);
+
+/** Coding named by a Content-Encoding header. Stacked codings are not
+ * supported; an empty header means identity.
+ */
+HTTPContentCoding HTTPCodingFromContentEncoding(const std::string& header);
+
+/** Best coding for a reply according to an Accept-Encoding header, honouring
+ * q-values. zstd is preferred over gzip when the client accepts both
+ * equally. Returns identity if the header is absent or accepts neither.
+ */
+HTTPContentCoding HTTPCodingFromAcceptEncoding(const std::string& header);
+
+/** Compress the concatenation of segs into out.
+ * @returns false if the coding is not supported or compression failed.
+ */
+bool HTTPCompress(HTTPContentCoding coding, const std::vector<std::pair<const char*, size_t>>& segs,
+                  std::string& out);
+
+/** Decompress the concatenation of segs into out, giving up once more than
+ * nMaxSize bytes would be produced.
+ * @returns false if the input is corrupt, truncated or too large.
+ */
+bool HTTPDecompress(HTTPContentCoding coding, const std::vector<std::pair<const char*, size_t>>& segs,
+                    std::string& out, size_t nMaxSize);
+
+#endif // BITCOIN_HTTPCOMPRESS_H
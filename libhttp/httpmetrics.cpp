@@ -0,0 +1,194 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <httpmetrics.h>
+#include <httpserver.h>
+#include <httptrace.h>
+
+#include <stdio.h>
+
+#include <event2/http.h>
+
+static const char* METRICS_CONTENT_TYPE = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+
+/** Builds an OpenMetrics exposition, one metric family at a time */
+class OpenMetricsWriter
+{
+public:
+    /** Start a family; counter samples must then be named name + "_total" */
+    void Family(const std::string& name, const char* type, const char* help)
+    {
+        out += "# TYPE " + name + " " + type + "\n";
+        out += "# HELP " + name + " " + help + "\n";
+    }
+
+    void Sample(const std::string& name, const std::string& labels, uint64_t value)
+    {
+        Line(name, labels, std::to_string(value));
+    }
+
+    void Sample(const std::string& name, const std::string& labels, double value)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.9g", value);
+        Line(name, labels, buf);
+    }
+
+    /** Samples of a histogram, whose family was started as such */
+    void Histogram(const std::string& name, const std::string& labels, const HTTPLatencyStats& stats)
+    {
+        const std::string sep = labels.empty() ? "" : ",";
+        uint64_t nCumulative = 0;
+        for (size_t i = 0; i < HTTP_LATENCY_BUCKETS; i++) {
+            char bound[32];
+            snprintf(bound, sizeof(bound), "%g", HTTP_LATENCY_BOUNDS[i]);
+            nCumulative += stats.counts[i];
+            Sample(name + "_bucket", labels + sep + "le=\"" + bound + "\"", nCumulative);
+        }
+        Sample(name + "_bucket", labels + sep + "le=\"+Inf\"", stats.nCount);
+        Sample(name + "_count", labels, stats.nCount);
+        Sample(name + "_sum", labels, stats.nSumNanos / 1e9);
+    }
+
+    /** A label, with its value escaped */
+    static std::string Label(const char* name, const std::string& value)
+    {
+        std::string label = std::string(name) + "=\"";
+        for (char c : value) {
+            if (c == '\\' || c == '"')
+                label += '\\';
+            if (c == '\n')
+                label += "\\n";
+            else
+                label += c;
+        }
+        return label + "\"";
+    }
+
+    std::string Finish()
+    {
+        out += "# EOF\n";
+        return std::move(out);
+    }
+
+private:
+    std::string out;
+
+    void Line(const std::string& name, const std::string& labels, const std::string& value)
+    {
+        out += name;
+        if (!labels.empty())
+            out += "{" + labels + "}";
+        out += " " + value + "\n";
+    }
+};
+
+std::string HTTPRenderMetrics()
+{
+    OpenMetricsWriter w;
+
+    const HTTPWorkQueueStats queue = GetHTTPWorkQueueStats();
+    w.Family("http_work_queue_depth", "gauge", "Items waiting in the work queue.");
+    w.Sample("http_work_queue_depth", "", (uint64_t)queue.nQueued);
+    w.Family("http_work_queue_capacity", "gauge", "Items the work queue holds before requests are rejected.");
+    w.Sample("http_work_queue_capacity", "", (uint64_t)queue.nCapacity);
+    w.Family("http_work_queue_rejected", "counter", "Work refused because the queue was full.");
+    w.Sample("http_work_queue_rejected_total", "source=\"request\"", queue.nRejectedRequests);
+    w.Sample("http_work_queue_rejected_total", "source=\"task\"", queue.nRejectedTasks);
+
+    const std::vector<HTTPWorkerStats> workers = GetHTTPWorkerStats();
+    w.Family("http_worker_queued", "gauge", "Items waiting in a worker's queue.");
+    for (const HTTPWorkerStats& s : workers)
+        w.Sample("http_worker_queued", "worker=\"" + std::to_string(s.id) + "\"", (uint64_t)s.nQueued);
+    w.Family("http_worker_executed", "counter", "Items run by a worker.");
+    for (const HTTPWorkerStats& s : workers)
+        w.Sample("http_worker_executed_total", "worker=\"" + std::to_string(s.id) + "\"", s.nExecuted);
+    w.Family("http_worker_stolen", "counter", "Items a worker took from other workers' queues.");
+    for (const HTTPWorkerStats& s : workers)
+        w.Sample("http_worker_stolen_total", "worker=\"" + std::to_string(s.id) + "\"", s.nStolen);
+    w.Family("http_worker_busy_seconds", "counter", "Time a worker spent running items; its rate is the worker's utilization.");
+    for (const HTTPWorkerStats& s : workers)
+        w.Sample("http_worker_busy_seconds_total", "worker=\"" + std::to_string(s.id) + "\"", s.nBusyNanos / 1e9);
+
+    const std::vector<HTTPEventLoopStats> loops = GetHTTPEventLoopStats();
+    w.Family("http_connections_accepted", "counter", "Connections accepted by an event loop.");
+    for (const HTTPEventLoopStats& s : loops)
+        w.Sample("http_connections_accepted_total", "loop=\"" + std::to_string(s.id) + "\"", s.nConnections);
+    w.Family("http_connections_active", "gauge", "Open connections that sent a request.");
+    for (const HTTPEventLoopStats& s : loops)
+        w.Sample("http_connections_active", "loop=\"" + std::to_string(s.id) + "\"", s.nActiveConnections);
+    w.Family("http_requests_received", "counter", "Requests received by an event loop.");
+    for (const HTTPEventLoopStats& s : loops)
+        w.Sample("http_requests_received_total", "loop=\"" + std::to_string(s.id) + "\"", s.nRequests);
+    w.Family("http_event_loop_iterations", "counter", "Passes of an event loop that ran callbacks.");
+    for (const HTTPEventLoopStats& s : loops)
+        w.Sample("http_event_loop_iterations_total", "loop=\"" + std::to_string(s.id) + "\"", s.nIterations);
+    w.Family("http_reply_wakeups", "counter", "Times an event loop woke up to send replies queued by workers.");
+    for (const HTTPEventLoopStats& s : loops)
+        w.Sample("http_reply_wakeups_total", "loop=\"" + std::to_string(s.id) + "\"", s.nReplyWakeups);
+    w.Family("http_replies_batched", "counter", "Replies sent from those wakeups.");
+    for (const HTTPEventLoopStats& s : loops)
+        w.Sample("http_replies_batched_total", "loop=\"" + std::to_string(s.id) + "\"", s.nRepliesBatched);
+    w.Family("http_reply_dispatch_lag_seconds", "histogram", "Time replies queued by workers waited for their event loop.");
+    for (const HTTPEventLoopStats& s : loops)
+        w.Histogram("http_reply_dispatch_lag_seconds", "loop=\"" + std::to_string(s.id) + "\"", s.replyLag);
+
+    const std::vector<HTTPRouteStats> routes = GetHTTPRouteStats();
+    w.Family("http_route_replies", "counter", "Replies sent by a handler, by status class.");
+    for (const HTTPRouteStats& s : routes) {
+        const std::string route = OpenMetricsWriter::Label("route", s.prefix + (s.exactMatch ? "" : "*"));
+        for (size_t i = 0; i < 5; i++)
+            w.Sample("http_route_replies_total", route + ",code=\"" + std::to_string(i + 1) + "xx\"", s.nReplies[i]);
+    }
+    w.Family("http_route_latency_seconds", "histogram", "Time from a request being received to its reply being handed to the event loop.");
+    for (const HTTPRouteStats& s : routes)
+        w.Histogram("http_route_latency_seconds", OpenMetricsWriter::Label("route", s.prefix + (s.exactMatch ? "" : "*")), s.latency);
+
+    const HTTPCompressionStats compression = GetHTTPCompressionStats();
+    w.Family("http_compressed_replies", "counter", "Replies sent compressed.");
+    w.Sample("http_compressed_replies_total", "", compression.nReplies);
+    w.Family("http_compression_reply_bytes", "counter", "Bytes of compressed replies, before and after compression.");
+    w.Sample("http_compression_reply_bytes_total", "stage=\"in\"", compression.nReplyBytesIn);
+    w.Sample("http_compression_reply_bytes_total", "stage=\"out\"", compression.nReplyBytesOut);
+
+    return w.Finish();
+}
+
+static bool HTTPReq_Metrics(HTTPRequest* req, const std::string&)
+{
+    if (req->GetRequestMethod() != HTTPRequest::GET) {
+        req->WriteReply(HTTP_BADMETHOD, "Only GET is supported");
+        return false;
+    }
+    req->WriteHeader("Content-Type", METRICS_CONTENT_TYPE);
+    req->WriteReply(HTTP_OK, HTTPRenderMetrics());
+    return true;
+}
+
+static bool HTTPReq_Trace(HTTPRequest* req, const std::string&)
+{
+    if (req->GetRequestMethod() != HTTPRequest::GET) {
+        req->WriteReply(HTTP_BADMETHOD, "Only GET is supported");
+        return false;
+    }
+    req->WriteHeader("Content-Type", "application/json");
+    req->WriteReply(HTTP_OK, HTTPTraceDumpChrome());
+    return true;
+}
+
+bool StartHTTPMetrics()
+{
+    // Served by the event loop, so saturation of the work queue shows
+    // instead of the scrape being rejected along with everything else
+    if (!RegisterHTTPHandler("/metrics", true, HTTPReq_Metrics, true, true))
+        return false;
+    // A full ring makes a large reply, so it is left to a worker
+    return RegisterHTTPHandler("/trace", true, HTTPReq_Trace);
+}
+
+void StopHTTPMetrics()
+{
+    UnregisterHTTPHandler("/metrics", true);
+    UnregisterHTTPHandler("/trace", true);
+}
@@ -0,0 +1,24 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_HTTPMETRICS_H
+#define BITCOIN_HTTPMETRICS_H
+
+#include <string>
+
+/** Render the HTTP server counters in the OpenMetrics text format.
+ * Everything is read from counters maintained as the server runs; no
+ * connection, queue or request is visited.
+ */
+std::string HTTPRenderMetrics();
+
+/** Start serving HTTPRenderMetrics at /metrics, and the sampled request
+ * traces at /trace as Chrome trace-event JSON (see HTTPTraceDumpChrome).
+ * Precondition; HTTP server has been initialized.
+ */
+bool StartHTTPMetrics();
+/** Stop serving /metrics and /trace */
+void StopHTTPMetrics();
+
+#endif // BITCOIN_HTTPMETRICS_H
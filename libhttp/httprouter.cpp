@@ -0,0 +1,177 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <httprouter.h>
+
+/** Trie node. The label is the literal text on the edge from the parent;
+ * the children's labels start with distinct characters.
+ */
+struct HTTPRouter::Node
+{
+    std::string label;
+    std::vector<std::unique_ptr<Node>> children;
+    std::unique_ptr<Node> param; //!< continues after a {parameter} segment
+
+    bool fExact = false;
+    bool fPrefix = false;
+    size_t exact = 0;
+    size_t prefix = 0;
+};
+
+HTTPRouter::HTTPRouter() : root(new Node())
+{
+}
+
+HTTPRouter::~HTTPRouter()
+{
+}
+
+/** Walk down, and extend, the trie along a literal, splitting edges where
+ * the literal leaves them. Returns the node at the end of the literal.
+ */
+HTTPRouter::Node* HTTPRouter::InsertLiteral(Node* node, const char* s, size_t len)
+{
+    while (len > 0) {
+        std::unique_ptr<Node>* edge = nullptr;
+        for (auto& child : node->children) {
+            if (child->label[0] == s[0]) {
+                edge = &child;
+                break;
+            }
+        }
+        if (!edge) {
+            node->children.emplace_back(new Node());
+            node->children.back()->label.assign(s, len);
+            return node->children.back().get();
+        }
+        const std::string& label = (*edge)->label;
+        size_t common = 1;
+        while (common < len && common < label.size() && label[common] == s[common])
+            common++;
+        if (common < label.size()) {
+            // Split the edge where the literal leaves it
+            std::unique_ptr<Node> mid(new Node());
+            mid->label = label.substr(0, common);
+            (*edge)->label.erase(0, common);
+            mid->children.push_back(std::move(*edge));
+            *edge = std::move(mid);
+        }
+        node = edge->get();
+        s += common;
+        len -= common;
+    }
+    return node;
+}
+
+bool HTTPRouter::Add(const std::string& pattern, bool exactMatch, size_t route)
+{
+    // Split into literals and parameter names first, so that a malformed
+    // pattern leaves the router untouched
+    std::vector<std::string> literals(1);
+    std::vector<std::string> names;
+    for (size_t pos = 0; pos < pattern.size();) {
+        if (pattern[pos] != '{') {
+            literals.back() += pattern[pos++];
+            continue;
+        }
+        size_t end = pattern.find('}', pos);
+        if (end == std::string::npos || end == pos + 1)
+            return false;
+        std::string name = pattern.substr(pos + 1, end - pos - 1);
+        if (name.find_first_of("{/") != std::string::npos)
+            return false;
+        // A parameter spans a whole segment
+        if (end + 1 < pattern.size() && pattern[end + 1] != '/')
+            return false;
+        names.push_back(name);
+        literals.emplace_back();
+        pos = end + 1;
+    }
+    if (names.size() > HTTPRouteMatch::MAX_PARAMS)
+        return false;
+
+    if (exactMatch && names.empty()) {
+        exactRoutes.emplace(pattern, route);
+        return true;
+    }
+    Node* node = root.get();
+    for (size_t i = 0; i < literals.size(); i++) {
+        if (i > 0) {
+            if (!node->param)
+                node->param.reset(new Node());
+            node = node->param.get();
+        }
+        node = InsertLiteral(node, literals[i].data(), literals[i].size());
+    }
+    if (exactMatch && !node->fExact) {
+        node->fExact = true;
+        node->exact = route;
+    } else if (!exactMatch && !node->fPrefix) {
+        node->fPrefix = true;
+        node->prefix = route;
+    }
+    if (!names.empty())
+        paramNames[route] = std::move(names);
+    return true;
+}
+
+bool HTTPRouter::Match(const std::string& uri, HTTPRouteMatch& match) const
+{
+    auto it = exactRoutes.find(uri);
+    if (it != exactRoutes.end()) {
+        match = HTTPRouteMatch();
+        match.route = it->second;
+        match.pathBegin = uri.size();
+        return true;
+    }
+    HTTPRouteMatch current;
+    bool fFound = false;
+    return Match(root.get(), uri, 0, current, match, fFound) || fFound;
+}
+
+bool HTTPRouter::Match(const Node* node, const std::string& uri, size_t pos, HTTPRouteMatch& current,
+                       HTTPRouteMatch& best, bool& fFound) const
+{
+    if (pos == uri.size() && node->fExact) {
+        best = current;
+        best.route = node->exact;
+        best.pathBegin = pos;
+        return true;
+    }
+    if (node->fPrefix && (!fFound || pos > best.pathBegin)) {
+        best = current;
+        best.route = node->prefix;
+        best.pathBegin = pos;
+        fFound = true;
+    }
+    if (pos == uri.size())
+        return false;
+    for (const auto& child : node->children) {
+        if (child->label[0] != uri[pos])
+            continue;
+        if (uri.compare(pos, child->label.size(), child->label) == 0 &&
+            Match(child.get(), uri, pos + child->label.size(), current, best, fFound))
+            return true;
+        break;
+    }
+    if (node->param) {
+        size_t end = uri.find_first_of("/?", pos);
+        if (end == std::string::npos)
+            end = uri.size();
+        if (end > pos && current.nParams < HTTPRouteMatch::MAX_PARAMS) {
+            current.params[current.nParams++] = std::make_pair(pos, end - pos);
+            if (Match(node->param.get(), uri, end, current, best, fFound))
+                return true;
+            current.nParams--;
+        }
+    }
+    return false;
+}
+
+const std::vector<std::string>& HTTPRouter::ParamNames(size_t route) const
+{
+    static const std::vector<std::string> none;
+    auto it = paramNames.find(route);
+    return it == paramNames.end() ? none : it->second;
+}
@@ -0,0 +1,72 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_HTTPROUTER_H
+#define BITCOIN_HTTPROUTER_H
+
+#include <memory>
+#include <stddef.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/** Result of matching a URI against a HTTPRouter.
+ * Captured parameters are offsets into the matched URI, so matching never
+ * allocates.
+ */
+struct HTTPRouteMatch
+{
+    static const size_t MAX_PARAMS = 8;
+
+    size_t route;       //!< route number passed to HTTPRouter::Add
+    size_t pathBegin;   //!< offset of the path below a prefix route
+    size_t nParams;
+    std::pair<size_t, size_t> params[MAX_PARAMS]; //!< offset and length of each parameter
+
+    HTTPRouteMatch() : route(0), pathBegin(0), nParams(0) {}
+};
+
+/** Compiled URI router.
+ * Routes are patterns that either match a whole URI (exact) or any URI they
+ * are a prefix of. A pattern may contain parameters such as
+ * "/rest/tx/{hash}", each matching one non-empty path segment.
+ *
+ * Exact routes without parameters live in a hash table; everything else in
+ * a radix trie. A lookup therefore costs one hash plus one walk down the
+ * trie, however many routes are registered. An exact match wins over a
+ * prefix match, and the longest matching prefix wins over shorter ones.
+ * Literal characters take precedence over a parameter at the same place.
+ */
+class HTTPRouter
+{
+public:
+    HTTPRouter();
+    ~HTTPRouter();
+
+    /** Add a route. If the same pattern is added twice, the first route is
+     * kept. Returns false if the pattern is malformed or has more than
+     * HTTPRouteMatch::MAX_PARAMS parameters.
+     */
+    bool Add(const std::string& pattern, bool exactMatch, size_t route);
+
+    /** Find the route for uri, returns false if none matches */
+    bool Match(const std::string& uri, HTTPRouteMatch& match) const;
+
+    /** Names of the parameters of a route, in the order they are captured */
+    const std::vector<std::string>& ParamNames(size_t route) const;
+
+private:
+    struct Node;
+
+    std::unordered_map<std::string, size_t> exactRoutes;
+    std::unique_ptr<Node> root;
+    std::unordered_map<size_t, std::vector<std::string>> paramNames;
+
+    static Node* InsertLiteral(Node* node, const char* s, size_t len);
+    bool Match(const Node* node, const std::string& uri, size_t pos, HTTPRouteMatch& current,
+               HTTPRouteMatch& best, bool& fFound) const;
+};
+
+#endif // BITCOIN_HTTPROUTER_H
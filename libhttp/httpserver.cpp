@@ -4,27 +4,38 @@
 
 #include <httpserver.h>
 //#include <sync.h>
+#include <algorithm>
+#include <chrono>
 #include <deque>
 #include <memory>
+#include <unordered_map>
+#include <unordered_set>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <signal.h>
+#include <unistd.h>
+#include <condition_variable>
 #include <future>
+#include <mutex>
 
 #include <event2/thread.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <event2/util.h>
 #include <event2/keyvalq_struct.h>
+#include <event2/listener.h>
 #include <sys/queue.h>
 #include "raii/events.h"
+#include "lockfreequeue.h"
 #include <vector>
+#include <atomic>
 #include <cassert>
-#include <iostream>
 
 #ifdef EVENT__HAVE_NETINET_IN_H
 #include <netinet/in.h>
@@ -36,17 +47,93 @@
 /** Maximum size of http request (request line + headers) */
 static const size_t MAX_HEADERS_SIZE = 8192;
 static const unsigned int MAX_SIZE = 0x02000000;
+/** Capacity of each event loop's queue of finished replies */
+static const size_t REPLY_QUEUE_SIZE = 1024;
+/** How often a worker blocked on a slow client checks its drain rate, in nanoseconds */
+static const int64_t REPLY_DRAIN_CHECK_INTERVAL = 5000000000;
+/** Accept times kept before the first pruning of those of closed connections */
+static const size_t ACCEPT_PRUNE_MIN_SIZE = 256;
+/** Status for a request body in a Content-Encoding we cannot decode; libevent has no name for it */
+static const int HTTP_UNSUPPORTED_MEDIA_TYPE = 415;
+
+const double HTTP_LATENCY_BOUNDS[HTTP_LATENCY_BUCKETS] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+    0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+};
+
+/** Steady clock time in nanoseconds, for latencies */
+static int64_t HTTPNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/** Live counters behind a HTTPLatencyStats */
+struct HTTPLatencyCounters
+{
+    std::atomic<uint64_t> counts[HTTP_LATENCY_BUCKETS];
+    std::atomic<uint64_t> nCount;
+    std::atomic<uint64_t> nSumNanos;
+
+    HTTPLatencyCounters() : nCount(0), nSumNanos(0)
+    {
+        for (auto& count : counts)
+            count = 0;
+    }
+
+    void Record(int64_t nNanos)
+    {
+        const uint64_t n = nNanos > 0 ? nNanos : 0;
+        const double seconds = n / 1e9;
+        size_t i = 0;
+        while (i < HTTP_LATENCY_BUCKETS && seconds > HTTP_LATENCY_BOUNDS[i])
+            i++;
+        if (i < HTTP_LATENCY_BUCKETS)
+            counts[i].fetch_add(1, std::memory_order_relaxed);
+        nCount.fetch_add(1, std::memory_order_relaxed);
+        nSumNanos.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    HTTPLatencyStats Snapshot() const
+    {
+        HTTPLatencyStats stats;
+        for (size_t i = 0; i < HTTP_LATENCY_BUCKETS; i++)
+            stats.counts[i] = counts[i].load(std::memory_order_relaxed);
+        stats.nCount = nCount.load(std::memory_order_relaxed);
+        stats.nSumNanos = nSumNanos.load(std::memory_order_relaxed);
+        return stats;
+    }
+};
+
+/** Counters of a registered handler, see HTTPRouteStats */
+struct HTTPRouteCounters
+{
+    std::atomic<uint64_t> replies[5];
+    HTTPLatencyCounters latency;
+
+    HTTPRouteCounters()
+    {
+        for (auto& n : replies)
+            n = 0;
+    }
+};
 
 /** HTTP request work item */
 class HTTPWorkItem final : public HTTPClosure
 {
 public:
+    /** The request keeps the routing table, and with it func, alive */
     HTTPWorkItem(std::unique_ptr<HTTPRequest> _req, const std::string &_path, const HTTPRequestHandler& _func):
         req(std::move(_req)), path(_path), func(_func)
     {
     }
     void operator()() override
     {
+        req->TraceMark(HTTP_TRACE_DEQUEUED);
+        if (!req->DecodeBody()) {
+            req->WriteReply(HTTP_BADREQUEST, "Malformed request body encoding");
+            return;
+        }
         func(req.get(), path);
     }
 
@@ -54,94 +141,356 @@ public:
 
 private:
     std::string path;
-    HTTPRequestHandler func;
+    const HTTPRequestHandler& func;
+};
+
+/** Work item running a task handed over through HTTPSubmitWork */
+class HTTPTaskItem final : public HTTPClosure
+{
+public:
+    explicit HTTPTaskItem(std::function<void()> _task) : task(std::move(_task))
+    {
+    }
+    void operator()() override
+    {
+        task();
+    }
+
+private:
+    std::function<void()> task;
 };
 
 /** Simple work queue for distributing work over multiple threads.
  * Work items are simply callable objects.
+ * Every worker owns a bounded lock-free ring. New items are handed to one
+ * worker's ring (round-robin or least loaded), and workers that run out of
+ * their own work steal from the rings of busy ones, so a slow call does not
+ * hold up the items queued behind it. Idle workers sleep on an event count.
  */
 template <typename WorkItem>
 class WorkQueue
 {
 private:
-    /** Mutex protects entire object */
-    std::mutex cs;
-    std::condition_variable cond;
-    std::deque<std::unique_ptr<WorkItem>> queue;
-    bool running;
-    size_t maxDepth;
+    struct Worker
+    {
+        explicit Worker(size_t depth) : queue(depth), nExecuted(0), nStolen(0), nBusyNanos(0)
+        {
+        }
+        MPMCQueue<WorkItem*> queue;
+        //! Items run by this worker, and how many of those it stole
+        std::atomic<uint64_t> nExecuted;
+        std::atomic<uint64_t> nStolen;
+        //! Time spent running items
+        std::atomic<uint64_t> nBusyNanos;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    EventCount idle;
+    std::atomic<bool> running;
+    std::atomic<size_t> nextWorker;
+    HTTPDispatchPolicy policy;
+
+    /** Pick the worker to hand a new item to */
+    size_t Target()
+    {
+        if (policy == HTTP_DISPATCH_LEAST_LOADED) {
+            size_t best = 0;
+            size_t bestSize = workers[0]->queue.Size();
+            for (size_t n = 1; n < workers.size() && bestSize > 0; n++) {
+                size_t size = workers[n]->queue.Size();
+                if (size < bestSize) {
+                    best = n;
+                    bestSize = size;
+                }
+            }
+            return best;
+        }
+        return nextWorker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    }
+
+    /** Take an item from our own ring, or else steal one */
+    bool Take(size_t self, WorkItem*& item)
+    {
+        if (workers[self]->queue.TryPop(item))
+            return true;
+        for (size_t n = 1; n < workers.size(); n++) {
+            if (workers[(self + n) % workers.size()]->queue.TryPop(item)) {
+                workers[self]->nStolen.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
 
 public:
-    explicit WorkQueue(size_t _maxDepth) : running(true),
-                                 maxDepth(_maxDepth)
+    /** maxDepth is spread over the workers' rings, each rounded up to a power of two */
+    WorkQueue(size_t maxDepth, size_t nWorkers, HTTPDispatchPolicy _policy) : running(true),
+                                                                              nextWorker(0),
+                                                                              policy(_policy)
     {
+        nWorkers = std::max<size_t>(nWorkers, 1);
+        for (size_t n = 0; n < nWorkers; n++)
+            workers.emplace_back(new Worker((maxDepth + nWorkers - 1) / nWorkers));
     }
     /** Precondition: worker threads have all stopped (they have been joined).
      */
     ~WorkQueue()
     {
+        WorkItem* i;
+        for (auto& worker : workers) {
+            while (worker->queue.TryPop(i))
+                delete i;
+        }
     }
     /** Enqueue a work item */
     bool Enqueue(WorkItem* item)
     {
-        std::unique_lock<std::mutex> lock(cs);
-        if (queue.size() >= maxDepth) {
-            return false;
+        size_t target = Target();
+        for (size_t n = 0; n < workers.size(); n++) {
+            if (workers[(target + n) % workers.size()]->queue.TryPush(item)) {
+                idle.NotifyOne();
+                return true;
+            }
         }
-        queue.emplace_back(std::unique_ptr<WorkItem>(item));
-        cond.notify_one();
-        return true;
+        return false;
     }
-    /** Thread function */
-    void Run()
+    /** Thread function of worker number self */
+    void Run(size_t self)
     {
-        while (true) {
-            std::unique_ptr<WorkItem> i;
+        assert(self < workers.size());
+        while (running.load(std::memory_order_relaxed)) {
+            WorkItem* i;
+            if (!Take(self, i)) {
+                uint32_t key = idle.PrepareWait();
+                if (!running.load() || !Take(self, i)) {
+                    if (running.load())
+                        idle.Wait(key);
+                    else
+                        idle.CancelWait();
+                    continue;
+                }
+                idle.CancelWait();
+            }
+            const int64_t nStart = HTTPNow();
             {
-                std::unique_lock<std::mutex> lock(cs);
-                while (running && queue.empty())
-                    cond.wait(lock);
-                if (!running)
-                    break;
-                i = std::move(queue.front());
-                queue.pop_front();
+                std::unique_ptr<WorkItem> item(i);
+                (*item)();
             }
-            (*i)();
+            workers[self]->nBusyNanos.fetch_add(HTTPNow() - nStart, std::memory_order_relaxed);
+            workers[self]->nExecuted.fetch_add(1, std::memory_order_relaxed);
         }
     }
     /** Interrupt and exit loops */
     void Interrupt()
     {
-        std::unique_lock<std::mutex> lock(cs);
         running = false;
-        cond.notify_all();
+        idle.NotifyAll();
+    }
+    /** Number of workers the queue was created for */
+    size_t Workers() const
+    {
+        return workers.size();
+    }
+    /** Items the queue holds at most, and items queued */
+    size_t Capacity() const
+    {
+        size_t n = 0;
+        for (const auto& worker : workers)
+            n += worker->queue.Capacity();
+        return n;
+    }
+    size_t Size() const
+    {
+        size_t n = 0;
+        for (const auto& worker : workers)
+            n += worker->queue.Size();
+        return n;
+    }
+    /** Snapshot of the per-worker counters */
+    std::vector<HTTPWorkerStats> Stats() const
+    {
+        std::vector<HTTPWorkerStats> stats;
+        for (size_t n = 0; n < workers.size(); n++) {
+            HTTPWorkerStats s;
+            s.id = n;
+            s.nQueued = workers[n]->queue.Size();
+            s.nExecuted = workers[n]->nExecuted.load(std::memory_order_relaxed);
+            s.nStolen = workers[n]->nStolen.load(std::memory_order_relaxed);
+            s.nBusyNanos = workers[n]->nBusyNanos.load(std::memory_order_relaxed);
+            stats.push_back(s);
+        }
+        return stats;
     }
 };
 
 struct HTTPPathHandler
 {
     HTTPPathHandler() {}
-    HTTPPathHandler(std::string _prefix, bool _exactMatch, HTTPRequestHandler _handler):
-        prefix(_prefix), exactMatch(_exactMatch), handler(_handler)
+    HTTPPathHandler(std::string _prefix, bool _exactMatch, HTTPRequestHandler _handler,
+                    bool _fCompressReplies, bool _fInline):
+        prefix(_prefix), exactMatch(_exactMatch), handler(_handler),
+        fCompressReplies(_fCompressReplies), fInline(_fInline),
+        counters(std::make_shared<HTTPRouteCounters>())
     {
     }
     std::string prefix;
     bool exactMatch;
     HTTPRequestHandler handler;
+    bool fCompressReplies;
+    bool fInline;
+    //! Shared by the copies in every routing table built since registration
+    std::shared_ptr<HTTPRouteCounters> counters;
+};
+
+/** Immutable routing table, replaced as a whole when handlers change */
+struct HTTPRoutes
+{
+    std::vector<HTTPPathHandler> handlers;
+    HTTPRouter router; //!< routes to indexes into handlers
+};
+
+/** Chunked reply being sent while a worker produces it. The worker throttles
+ * itself on the bytes it has queued that have not been written out yet.
+ */
+struct HTTPReplyStream
+{
+    HTTPReplyStream() : conn(nullptr), writtenCb(nullptr), nQueued(0), nIdleNanos(0), nSent(0), nWritten(0),
+                        nFlushed(0), fClosed(false), fAbandoned(false)
+    {
+    }
+    struct evhttp_connection* conn; //!< only touched by the loop thread, nullptr once closed
+    struct evbuffer_cb_entry* writtenCb; //!< counts nWritten, only touched by the loop thread
+    uint64_t nQueued;               //!< bytes queued, only touched by the worker
+    int64_t nIdleNanos;             //!< time the worker waited without the client reading, only touched by the worker
+    uint64_t nSent;                 //!< bytes given to libevent, only touched by the loop thread
+    std::atomic<uint64_t> nWritten; //!< bytes of the connection written to the socket, including framing
+    std::mutex cs;
+    std::condition_variable cond;
+    uint64_t nFlushed;              //!< bytes written to the socket, guarded by cs
+    bool fClosed;                   //!< connection went away or was given up on, guarded by cs
+    bool fAbandoned;                //!< worker gave up on a slow client, guarded by cs
+};
+
+/** Part of a reply handed to the event loop */
+enum HTTPReplyPart
+{
+    HTTP_REPLY_WHOLE,       //!< complete reply, body in the output buffer
+    HTTP_REPLY_START,       //!< start of a chunked reply
+    HTTP_REPLY_CHUNK,       //!< next piece of a chunked reply
+    HTTP_REPLY_END          //!< end of a chunked reply
+};
+
+/** Reply finished by a worker, waiting to be sent by the event loop */
+struct HTTPReplyCompletion
+{
+    struct evhttp_request* req;
+    int nStatus;
+    HTTPReplyPart part;
+    struct evbuffer* chunk; //!< body piece of a HTTP_REPLY_CHUNK, owned
+    std::shared_ptr<HTTPReplyStream>* stream; //!< stream of a HTTP_REPLY_START, owned
+    HTTPTrace* trace;       //!< trace of the request, with the last part of its reply; owned
+    int64_t nQueuedTime;    //!< when it was queued for the loop, see HTTPNow
+};
+
+/** Event loop: an event base with its own evhttp front end, driven by its
+ * own dispatcher thread. Connections stay on the loop that accepted them.
+ */
+struct HTTPEventLoop
+{
+    explicit HTTPEventLoop(int _id) : id(_id), base(nullptr), http(nullptr),
+                                      replies(REPLY_QUEUE_SIZE), replyFd(-1),
+                                      replyEvent(nullptr), replyWakePending(false), fExit(false),
+                                      nAcceptPruneSize(ACCEPT_PRUNE_MIN_SIZE), nTraceCountdown(0),
+                                      nConnections(0), nActiveConnections(0), nRequests(0),
+                                      nIterations(0), nReplyWakeups(0), nRepliesBatched(0)
+    {
+    }
+    /** Precondition: the dispatcher thread has stopped (it has been joined).
+     */
+    ~HTTPEventLoop()
+    {
+        if (replyEvent)
+            event_free(replyEvent);
+        if (replyFd != -1)
+            close(replyFd);
+        if (http)
+            evhttp_free(http);
+        if (base)
+            event_base_free(base);
+    }
+
+    int id;
+    //! libevent event loop
+    struct event_base* base;
+    //! HTTP server
+    struct evhttp* http;
+    //! Bound listening sockets
+    std::vector<evhttp_bound_socket *> boundSockets;
+    //! Dispatcher thread and its result
+    std::thread thread;
+    std::thread::id threadId;
+    std::future<bool> result;
+    //! Replies pushed by workers, drained in batches by the loop when
+    //! replyFd (an eventfd) wakes it up. replyWakePending is set while a
+    //! wakeup is outstanding, so a batch costs a single write.
+    MPMCQueue<HTTPReplyCompletion> replies;
+    int replyFd;
+    struct event* replyEvent;
+    std::atomic<bool> replyWakePending;
+    //! Set by StopHTTPServer before it makes the loop exit
+    std::atomic<bool> fExit;
+    //! Connections that sent a request, only touched by the loop thread
+    std::unordered_set<struct evhttp_connection*> connections;
+    //! When connections that have not sent a request yet were accepted, by
+    //! their bufferevent. Only touched by the loop thread. An entry is taken
+    //! by the first request of its connection; those of connections that
+    //! closed without one are pruned once older than the server timeout, as
+    //! the table grows past nAcceptPruneSize.
+    std::unordered_map<struct bufferevent*, int64_t> acceptTimes;
+    size_t nAcceptPruneSize;
+    //! Requests until the next sampled trace, only touched by the loop thread
+    unsigned int nTraceCountdown;
+    //! Chunked replies between start and end, only touched by the loop thread
+    std::unordered_map<struct evhttp_request*, std::shared_ptr<HTTPReplyStream>> replyStreams;
+    //! Connections accepted and still open, requests received, loop passes
+    std::atomic<uint64_t> nConnections;
+    std::atomic<uint64_t> nActiveConnections;
+    std::atomic<uint64_t> nRequests;
+    std::atomic<uint64_t> nIterations;
+    //! Reply queue wakeups, and replies sent from them
+    std::atomic<uint64_t> nReplyWakeups;
+    std::atomic<uint64_t> nRepliesBatched;
+    //! Time replies waited in the queue
+    HTTPLatencyCounters replyLag;
 };
 
 /** HTTP module state */
 
-//! libevent event loop
-static struct event_base* eventBase = nullptr;
-//! HTTP server
-struct evhttp* eventHTTP = nullptr;
+//! Options passed to InitHTTPServer
+static HTTPServerOptions httpOptions;
+//! Event loops, the first one also serves EventBase()
+static std::vector<std::unique_ptr<HTTPEventLoop>> eventLoops;
 //! Work queue for handling longer requests off the event loop thread
 static WorkQueue<HTTPClosure>* workQueue = nullptr;
-//! Handlers for (sub)paths
-std::vector<HTTPPathHandler> pathHandlers;
-//! Bound listening sockets
-std::vector<evhttp_bound_socket *> boundSockets;
+//! Handlers for (sub)paths, in registration order
+static std::mutex cs_pathHandlers;
+static std::vector<HTTPPathHandler> pathHandlers;
+//! Routing table compiled from pathHandlers, only accessed with std::atomic_load/store
+static std::shared_ptr<const HTTPRoutes> httpRoutes;
+//! Work queue rejections, see HTTPWorkQueueStats
+static std::atomic<uint64_t> nRejectedRequests(0);
+static std::atomic<uint64_t> nRejectedTasks(0);
+//! Compression counters, see HTTPCompressionStats
+static std::atomic<uint64_t> nCompressedReplies(0);
+static std::atomic<uint64_t> nIncompressibleReplies(0);
+static std::atomic<uint64_t> nCompressReplyBytesIn(0);
+static std::atomic<uint64_t> nCompressReplyBytesOut(0);
+static std::atomic<uint64_t> nCompressReplyCpuMicros(0);
+static std::atomic<uint64_t> nDecodedRequests(0);
+static std::atomic<uint64_t> nDecodeRejectedRequests(0);
+static std::atomic<uint64_t> nDecodeRequestBytesIn(0);
+static std::atomic<uint64_t> nDecodeRequestBytesOut(0);
+static std::atomic<uint64_t> nDecodeRequestCpuMicros(0);
 
 /** HTTP request method as string - use for logging only */
 static std::string RequestMethodString(HTTPRequest::RequestMethod m)
@@ -164,9 +513,74 @@ static std::string RequestMethodString(HTTPRequest::RequestMethod m)
     }
 }
 
+/** Compile pathHandlers into a new routing table and publish it */
+static void RebuildHTTPRoutes()
+{
+    std::shared_ptr<HTTPRoutes> routes = std::make_shared<HTTPRoutes>();
+    routes->handlers = pathHandlers;
+    for (size_t i = 0; i < routes->handlers.size(); i++)
+        routes->router.Add(routes->handlers[i].prefix, routes->handlers[i].exactMatch, i);
+    std::atomic_store(&httpRoutes, std::shared_ptr<const HTTPRoutes>(std::move(routes)));
+}
+
+/** Find the registered handler for a URI in the current routing table,
+ * which is returned in routes and keeps the handler alive.
+ */
+static const HTTPPathHandler* FindHTTPHandler(const std::string& strURI, std::shared_ptr<const HTTPRoutes>& routes,
+                                              HTTPRouteMatch& match)
+{
+    routes = std::atomic_load(&httpRoutes);
+    if (!routes || !routes->router.Match(strURI, match))
+        return nullptr;
+    return &routes->handlers[match.route];
+}
+
+/** Connection close callback: stop the workers streaming replies to it */
+static void http_conn_close_cb(struct evhttp_connection* conn, void* arg)
+{
+    HTTPEventLoop* loop = static_cast<HTTPEventLoop*>(arg);
+    if (loop->connections.erase(conn))
+        loop->nActiveConnections.fetch_sub(1, std::memory_order_relaxed);
+    for (auto& entry : loop->replyStreams) {
+        HTTPReplyStream& stream = *entry.second;
+        if (stream.conn != conn)
+            continue;
+        // The output buffer goes away with the connection
+        if (stream.writtenCb)
+            evbuffer_remove_cb_entry(bufferevent_get_output(evhttp_connection_get_bufferevent(conn)), stream.writtenCb);
+        stream.writtenCb = nullptr;
+        stream.conn = nullptr;
+        std::lock_guard<std::mutex> lock(stream.cs);
+        stream.fClosed = true;
+        stream.cond.notify_all();
+    }
+}
+
+/** Count a connection as active from its first request until it closes.
+ * libevent has no callback for new connections, and a connection's close
+ * callback is only set once it has a request.
+ * @returns when the connection was accepted if this is its first request, otherwise 0
+ */
+static int64_t HTTPTrackConnection(HTTPEventLoop* loop, struct evhttp_connection* conn)
+{
+    if (!conn || !loop->connections.insert(conn).second)
+        return 0;
+    evhttp_connection_set_closecb(conn, http_conn_close_cb, loop);
+    loop->nActiveConnections.fetch_add(1, std::memory_order_relaxed);
+    auto it = loop->acceptTimes.find(evhttp_connection_get_bufferevent(conn));
+    if (it == loop->acceptTimes.end())
+        return 0;
+    const int64_t nAcceptTime = it->second;
+    loop->acceptTimes.erase(it);
+    return nAcceptTime;
+}
+
 /** HTTP request callback */
 static void http_request_cb(struct evhttp_request* req, void* arg)
 {
+    HTTPEventLoop* loop = static_cast<HTTPEventLoop*>(arg);
+    loop->nRequests.fetch_add(1, std::memory_order_relaxed);
+
     // Disable reading to work around a libevent bug, fixed in 2.2.0.
     if (event_get_version_number() >= 0x02010600 && event_get_version_number() < 0x02020001) {
         evhttp_connection* conn = evhttp_request_get_connection(req);
@@ -177,37 +591,45 @@ static void http_request_cb(struct evhttp_request* req, void* arg)
             }
         }
     }
-    std::unique_ptr<HTTPRequest> hreq(new HTTPRequest(req));
-        
+    const int64_t nAcceptTime = HTTPTrackConnection(loop, evhttp_request_get_connection(req));
+    std::unique_ptr<HTTPRequest> hreq(new HTTPRequest(req, loop));
+
     // Early reject unknown HTTP methods
     if (hreq->GetRequestMethod() == HTTPRequest::UNKNOWN) {
         hreq->WriteReply(HTTP_BADMETHOD);
         return;
     }
+    hreq->StartTrace(nAcceptTime);
     // Find registered handler for prefix
     std::string strURI = hreq->GetURI();
-    std::string path;
-    std::vector<HTTPPathHandler>::const_iterator i = pathHandlers.begin();
-    std::vector<HTTPPathHandler>::const_iterator iend = pathHandlers.end();
-    for (; i != iend; ++i) {
-        bool match = false;
-        if (i->exactMatch)
-            match = (strURI == i->prefix);
-        else
-            match = (strURI.substr(0, i->prefix.size()) == i->prefix);
-        if (match) {
-            path = strURI.substr(i->prefix.size());
-            break;
-        }
-    }
+    std::shared_ptr<const HTTPRoutes> routes;
+    HTTPRouteMatch match;
+    const HTTPPathHandler* i = FindHTTPHandler(strURI, routes, match);
 
     // Dispatch to worker thread
-    if (i != iend) {
+    if (i) {
+        // Only the header is looked at here, the body is decoded by the worker
+        const char* encoding = evhttp_find_header(evhttp_request_get_input_headers(req), "Content-Encoding");
+        HTTPContentCoding coding = encoding ? HTTPCodingFromContentEncoding(encoding) : HTTP_CODING_IDENTITY;
+        if (coding == HTTP_CODING_UNSUPPORTED) {
+            hreq->WriteReply(HTTP_UNSUPPORTED_MEDIA_TYPE, "Unsupported Content-Encoding");
+            return;
+        }
+        hreq->SetBodyCoding(coding);
+        hreq->SetReplyCompression(i->fCompressReplies);
+        std::string path = strURI.substr(match.pathBegin);
+        hreq->SetRoute(std::move(routes), match);
+        if (i->fInline) {
+            i->handler(hreq.get(), path);
+            return;
+        }
+        hreq->TraceMark(HTTP_TRACE_ENQUEUED);
         std::unique_ptr<HTTPWorkItem> item(new HTTPWorkItem(std::move(hreq), path, i->handler));
         assert(workQueue);
         if (workQueue->Enqueue(item.get()))
             item.release(); /* if true, queue took ownership */
         else {
+            nRejectedRequests.fetch_add(1, std::memory_order_relaxed);
             item->req->WriteReply(HTTP_INTERNAL, "Work queue depth exceeded");
         }
     } else {
@@ -222,17 +644,212 @@ static void http_reject_request_cb(struct evhttp_request* req, void*)
     evhttp_send_error(req, HTTP_SERVUNAVAIL, nullptr);
 }
 
+/** Connection callback: counts the connection and creates its bufferevent,
+ * the same one evhttp creates by default, to note when it was accepted.
+ */
+static struct bufferevent* http_bev_cb(struct event_base* base, void* arg)
+{
+    HTTPEventLoop* loop = static_cast<HTTPEventLoop*>(arg);
+    loop->nConnections.fetch_add(1, std::memory_order_relaxed);
+    struct bufferevent* bev = bufferevent_socket_new(base, -1, 0);
+    if (!bev)
+        return nullptr;
+    const int64_t nNow = HTTPNow();
+    if (loop->acceptTimes.size() >= loop->nAcceptPruneSize) {
+        // A connection without a request by the server timeout was closed
+        // by libevent, e.g. a port probe or a client that sent bad headers
+        const int64_t nOldest = nNow - (int64_t)DEFAULT_HTTP_SERVER_TIMEOUT * 1000000000;
+        for (auto it = loop->acceptTimes.begin(); it != loop->acceptTimes.end();) {
+            if (it->second < nOldest)
+                it = loop->acceptTimes.erase(it);
+            else
+                ++it;
+        }
+        // Sweep again only once the table doubled, so pruning stays amortized O(1)
+        loop->nAcceptPruneSize = std::max(ACCEPT_PRUNE_MIN_SIZE, 2 * loop->acceptTimes.size());
+    }
+    loop->acceptTimes[bev] = nNow;
+    return bev;
+}
+
+/** Write callback of a chunked reply: everything given to libevent so far
+ * has gone out, wake up the worker if it is waiting for that
+ */
+static void http_reply_flushed_cb(struct evhttp_connection*, void* arg)
+{
+    HTTPReplyStream* stream = static_cast<HTTPReplyStream*>(arg);
+    std::lock_guard<std::mutex> lock(stream->cs);
+    stream->nFlushed = stream->nSent;
+    stream->cond.notify_all();
+}
+
+/** Output buffer callback of a connection sending a chunked reply: counts
+ * the bytes written to the socket, so the worker can tell a client that
+ * reads slowly from one that reads nothing
+ */
+static void http_reply_written_cb(struct evbuffer*, const struct evbuffer_cb_info* info, void* arg)
+{
+    if (info->n_deleted > 0)
+        static_cast<HTTPReplyStream*>(arg)->nWritten.fetch_add(info->n_deleted, std::memory_order_relaxed);
+}
+
+/** Send (part of) a reply; must run on the event loop owning the request */
+static void HTTPSendReply(HTTPEventLoop* loop, const HTTPReplyCompletion& c)
+{
+    struct evhttp_request* req = c.req;
+    switch (c.part) {
+    case HTTP_REPLY_WHOLE:
+        evhttp_send_reply(req, c.nStatus, nullptr, nullptr);
+        break;
+    case HTTP_REPLY_START: {
+        std::shared_ptr<HTTPReplyStream> stream = std::move(*c.stream);
+        delete c.stream;
+        stream->conn = evhttp_request_get_connection(req);
+        if (stream->conn) {
+            HTTPTrackConnection(loop, stream->conn);
+            struct evbuffer* output = bufferevent_get_output(evhttp_connection_get_bufferevent(stream->conn));
+            stream->writtenCb = evbuffer_add_cb(output, http_reply_written_cb, stream.get());
+        } else {
+            std::lock_guard<std::mutex> lock(stream->cs);
+            stream->fClosed = true;
+            stream->cond.notify_all();
+        }
+        loop->replyStreams[req] = std::move(stream);
+        evhttp_send_reply_start(req, c.nStatus, nullptr);
+        return;
+    }
+    case HTTP_REPLY_CHUNK: {
+        // libevent ignores chunks once the client went away; the request
+        // lives on until the end of the reply
+        auto it = loop->replyStreams.find(req);
+        assert(it != loop->replyStreams.end());
+        it->second->nSent += evbuffer_get_length(c.chunk);
+        evhttp_send_reply_chunk_with_cb(req, c.chunk, http_reply_flushed_cb, it->second.get());
+        evbuffer_free(c.chunk);
+        return;
+    }
+    case HTTP_REPLY_END: {
+        auto it = loop->replyStreams.find(req);
+        assert(it != loop->replyStreams.end());
+        HTTPReplyStream& stream = *it->second;
+        if (stream.conn) {
+            struct bufferevent* bev = evhttp_connection_get_bufferevent(stream.conn);
+            if (stream.writtenCb)
+                evbuffer_remove_cb_entry(bufferevent_get_output(bev), stream.writtenCb);
+            std::lock_guard<std::mutex> lock(stream.cs);
+            if (stream.fAbandoned) {
+                // Make libevent drop the connection once the reply ended,
+                // freeing the request with the output still pending
+                bufferevent_trigger_event(bev, BEV_EVENT_WRITING | BEV_EVENT_ERROR, BEV_TRIG_DEFER_CALLBACKS);
+            }
+        }
+        // Ending the reply replaces the write callback, so the stream is no
+        // longer referred to by libevent
+        loop->replyStreams.erase(it);
+        evhttp_send_reply_end(req);
+        break;
+    }
+    }
+    if (c.trace) {
+        c.trace->stamps[HTTP_TRACE_FLUSHED] = HTTPNow();
+        if (HTTPTraceSampled(*c.trace))
+            HTTPTraceCommit(*c.trace);
+        delete c.trace;
+    }
+    // Re-enable reading from the socket. This is the second part of the libevent
+    // workaround above.
+    if (event_get_version_number() >= 0x02010600 && event_get_version_number() < 0x02020001) {
+        evhttp_connection* conn = evhttp_request_get_connection(req);
+        if (conn) {
+            bufferevent* bev = evhttp_connection_get_bufferevent(conn);
+            if (bev) {
+                bufferevent_enable(bev, EV_READ | EV_WRITE);
+            }
+        }
+    }
+}
+
+/** Wake the event loop to drain its reply queue, unless a wakeup is already pending */
+static void HTTPWakeReplies(HTTPEventLoop* loop)
+{
+    if (!loop->replyWakePending.exchange(true)) {
+        uint64_t one = 1;
+        if (write(loop->replyFd, &one, sizeof(one)) != sizeof(one)) {
+            // Counter overflow is the only failure mode, and implies a wakeup is queued anyway
+        }
+    }
+}
+
+/** Send the replies queued by the workers. At most one queue's worth is sent
+ * per wakeup so the loop keeps serving its connections under a steady stream.
+ */
+static void HTTPDrainReplies(HTTPEventLoop* loop)
+{
+    loop->replyWakePending.exchange(false, std::memory_order_acq_rel);
+    HTTPReplyCompletion c;
+    uint64_t nBatch = 0;
+    const int64_t nNow = HTTPNow();
+    while (nBatch < REPLY_QUEUE_SIZE && loop->replies.TryPop(c)) {
+        loop->replyLag.Record(nNow - c.nQueuedTime);
+        HTTPSendReply(loop, c);
+        nBatch++;
+    }
+    if (nBatch == REPLY_QUEUE_SIZE)
+        HTTPWakeReplies(loop);
+    loop->nReplyWakeups.fetch_add(1, std::memory_order_relaxed);
+    loop->nRepliesBatched.fetch_add(nBatch, std::memory_order_relaxed);
+}
+
+/** Reply queue wakeup callback */
+static void http_reply_cb(evutil_socket_t fd, short, void* arg)
+{
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        // Spurious wakeup, the queue is drained anyway
+    }
+    HTTPDrainReplies(static_cast<HTTPEventLoop*>(arg));
+}
+
 /** Event dispatcher thread */
-static bool ThreadHTTP(struct event_base* base, struct evhttp* http)
+static bool ThreadHTTP(HTTPEventLoop* loop)
 {
     //RenameThread("bitcoin-http");
-    event_base_dispatch(base);
+    loop->threadId = std::this_thread::get_id();
+    // Run the loop a pass at a time to count the passes. An exit or break
+    // only ends the current pass, so fExit tells whether to go on.
+    while (!loop->fExit.load()) {
+        if (event_base_loop(loop->base, EVLOOP_ONCE) != 0)
+            break;
+        loop->nIterations.fetch_add(1, std::memory_order_relaxed);
+    }
     // Event loop will be interrupted by InterruptHTTPServer()
-    return event_base_got_break(base) == 0;
+    return event_base_got_break(loop->base) == 0;
+}
+
+/** Bind a listening socket with SO_REUSEPORT set, so that every event loop
+ * can listen on the same address and port.
+ */
+static evhttp_bound_socket* HTTPBindReusePort(HTTPEventLoop* loop, const std::string& addr, uint16_t port)
+{
+    struct sockaddr_storage ss;
+    int sslen = sizeof(ss);
+    std::string endpoint = addr.find(':') != std::string::npos ? "[" + addr + "]" : addr;
+    endpoint += ":" + std::to_string(port);
+    if (evutil_parse_sockaddr_port(endpoint.c_str(), (struct sockaddr*)&ss, &sslen) != 0)
+        return nullptr;
+    const unsigned flags = LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT | LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC;
+    struct evconnlistener* listener = evconnlistener_new_bind(loop->base, nullptr, nullptr, flags, -1,
+                                                              (struct sockaddr*)&ss, sslen);
+    if (!listener)
+        return nullptr;
+    evhttp_bound_socket* bind_handle = evhttp_bind_listener(loop->http, listener);
+    if (!bind_handle)
+        evconnlistener_free(listener);
+    return bind_handle;
 }
 
 /** Bind HTTP server to specified addresses */
-static bool HTTPBindAddresses(struct evhttp* http)
+static bool HTTPBindAddresses(HTTPEventLoop* loop, bool reusePort)
 {
     int defaultPort = 6666;//gArgs.GetArg("-rpcport", BaseParams().RPCPort());
     std::vector<std::pair<std::string, uint16_t> > endpoints;
@@ -241,20 +858,24 @@ static bool HTTPBindAddresses(struct evhttp* http)
 	endpoints.push_back(std::make_pair("0.0.0.0", defaultPort));
     // Bind addresses
     for (std::vector<std::pair<std::string, uint16_t> >::iterator i = endpoints.begin(); i != endpoints.end(); ++i) {
-        evhttp_bound_socket *bind_handle = evhttp_bind_socket_with_handle(http, i->first.empty() ? nullptr : i->first.c_str(), i->second);
+        evhttp_bound_socket *bind_handle;
+        if (reusePort)
+            bind_handle = HTTPBindReusePort(loop, i->first, i->second);
+        else
+            bind_handle = evhttp_bind_socket_with_handle(loop->http, i->first.empty() ? nullptr : i->first.c_str(), i->second);
         if (bind_handle) {
-            boundSockets.push_back(bind_handle);
+            loop->boundSockets.push_back(bind_handle);
         } else {
         }
     }
-    return !boundSockets.empty();
+    return !loop->boundSockets.empty();
 }
 
 /** Simple wrapper to set thread name and run work queue */
-static void HTTPWorkQueueRun(WorkQueue<HTTPClosure>* queue)
+static void HTTPWorkQueueRun(WorkQueue<HTTPClosure>* queue, size_t worker)
 {
     //RenameThread("bitcoin-httpworker");
-    queue->Run();
+    queue->Run(worker);
 }
 
 /** libevent event log callback */
@@ -270,7 +891,7 @@ static void libevent_log_cb(int severity, const char *msg)
         //LogPrint(BCLog::LIBEVENT, "libevent: %s\n", msg);
 }
 
-bool InitHTTPServer()
+bool InitHTTPServer(const HTTPServerOptions& options)
 {
     // Redirect libevent's logging to our own log
     event_set_log_callback(&libevent_log_cb);
@@ -287,30 +908,50 @@ bool InitHTTPServer()
     evthread_use_pthreads();
 #endif
 
-    raii_event_base base_ctr = obtain_event_base();
+    httpOptions = options;
+    int nEventLoops = std::max(httpOptions.nEventLoops, 1);
+    std::vector<std::unique_ptr<HTTPEventLoop>> loops;
+    for (int n = 0; n < nEventLoops; n++) {
+        std::unique_ptr<HTTPEventLoop> loop(new HTTPEventLoop(n));
 
-    /* Create a new evhttp object to handle requests. */
-    raii_evhttp http_ctr = obtain_evhttp(base_ctr.get());
-    struct evhttp* http = http_ctr.get();
-    if (!http) {
-        return false;
-    }
+        raii_event_base base_ctr = obtain_event_base();
 
-    evhttp_set_timeout(http,  DEFAULT_HTTP_SERVER_TIMEOUT);
-    evhttp_set_max_headers_size(http, MAX_HEADERS_SIZE);
-    evhttp_set_max_body_size(http, MAX_SIZE);
-    evhttp_set_gencb(http, http_request_cb, nullptr);
+        /* Create a new evhttp object to handle requests. */
+        raii_evhttp http_ctr = obtain_evhttp(base_ctr.get());
+        struct evhttp* http = http_ctr.get();
+        if (!http) {
+            return false;
+        }
+        // transfer ownership to the loop via .release()
+        loop->base = base_ctr.release();
+        loop->http = http_ctr.release();
 
-    if (!HTTPBindAddresses(http)) {
-        return false;
+        evhttp_set_timeout(http,  DEFAULT_HTTP_SERVER_TIMEOUT);
+        evhttp_set_max_headers_size(http, MAX_HEADERS_SIZE);
+        evhttp_set_max_body_size(http, MAX_SIZE);
+        evhttp_set_gencb(http, http_request_cb, loop.get());
+        evhttp_set_bevcb(http, http_bev_cb, loop.get());
+
+        loop->replyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->replyFd == -1) {
+            return false;
+        }
+        loop->replyEvent = event_new(loop->base, loop->replyFd, EV_READ | EV_PERSIST, http_reply_cb, loop.get());
+        if (!loop->replyEvent || event_add(loop->replyEvent, nullptr) != 0) {
+            return false;
+        }
+
+        if (!HTTPBindAddresses(loop.get(), nEventLoops > 1)) {
+            return false;
+        }
+        loops.push_back(std::move(loop));
     }
 
-    int workQueueDepth = DEFAULT_HTTP_WORKQUEUE;
+    int workQueueDepth = std::max(httpOptions.nWorkQueueDepth, 1);
+    int rpcThreads = std::max(httpOptions.nThreads, 1);
 
-    workQueue = new WorkQueue<HTTPClosure>(workQueueDepth);
-    // transfer ownership to eventBase/HTTP via .release()
-    eventBase = base_ctr.release();
-    eventHTTP = http_ctr.release();
+    workQueue = new WorkQueue<HTTPClosure>(workQueueDepth, rpcThreads, httpOptions.dispatchPolicy);
+    eventLoops = std::move(loops);
     return true;
 }
 
@@ -328,32 +969,32 @@ bool UpdateHTTPServerLogging(bool enable) {
 #endif
 }
 
-std::thread threadHTTP;
-std::future<bool> threadResult;
 static std::vector<std::thread> g_thread_http_workers;
 
 bool StartHTTPServer()
 {
-    int rpcThreads =  DEFAULT_HTTP_THREADS;
-    std::packaged_task<bool(event_base*, evhttp*)> task(ThreadHTTP);
-    threadResult = task.get_future();
-    threadHTTP = std::thread(std::move(task), eventBase, eventHTTP);
+    for (auto& loop : eventLoops) {
+        std::packaged_task<bool(HTTPEventLoop*)> task(ThreadHTTP);
+        loop->result = task.get_future();
+        loop->thread = std::thread(std::move(task), loop.get());
+    }
 
-    for (int i = 0; i < rpcThreads; i++) {
-        g_thread_http_workers.emplace_back(HTTPWorkQueueRun, workQueue);
+    for (size_t i = 0; i < workQueue->Workers(); i++) {
+        g_thread_http_workers.emplace_back(HTTPWorkQueueRun, workQueue, i);
     }
     return true;
 }
 
 void InterruptHTTPServer()
 {
-    if (eventHTTP) {
+    for (auto& loop : eventLoops) {
         // Unlisten sockets
-        for (evhttp_bound_socket *socket : boundSockets) {
-            evhttp_del_accept_socket(eventHTTP, socket);
+        for (evhttp_bound_socket *socket : loop->boundSockets) {
+            evhttp_del_accept_socket(loop->http, socket);
         }
+        loop->boundSockets.clear();
         // Reject requests on current connections
-        evhttp_set_gencb(eventHTTP, http_reject_request_cb, nullptr);
+        evhttp_set_gencb(loop->http, http_reject_request_cb, nullptr);
     }
     if (workQueue)
         workQueue->Interrupt();
@@ -369,33 +1010,114 @@ void StopHTTPServer()
         delete workQueue;
         workQueue = nullptr;
     }
-    if (eventBase) {
+    for (auto& loop : eventLoops) {
         // Exit the event loop as soon as there are no active events.
-        event_base_loopexit(eventBase, nullptr);
+        loop->fExit = true;
+        event_base_loopexit(loop->base, nullptr);
+    }
+    for (auto& loop : eventLoops) {
         // Give event loop a few seconds to exit (to send back last RPC responses), then break it
         // Before this was solved with event_base_loopexit, but that didn't work as expected in
         // at least libevent 2.0.21 and always introduced a delay. In libevent
         // master that appears to be solved, so in the future that solution
         // could be used again (if desirable).
         // (see discussion in https://github.com/bitcoin/bitcoin/pull/6990)
-        if (threadResult.valid() && threadResult.wait_for(std::chrono::milliseconds(2000)) == std::future_status::timeout) {
-            event_base_loopbreak(eventBase);
+        if (loop->result.valid() && loop->result.wait_for(std::chrono::milliseconds(2000)) == std::future_status::timeout) {
+            event_base_loopbreak(loop->base);
         }
-        threadHTTP.join();
+        if (loop->thread.joinable())
+            loop->thread.join();
+        // Flush replies that arrived after the loop exited
+        HTTPDrainReplies(loop.get());
     }
-    if (eventHTTP) {
-        evhttp_free(eventHTTP);
-        eventHTTP = nullptr;
+    eventLoops.clear();
+}
+
+struct event_base* EventBase()
+{
+    return eventLoops.empty() ? nullptr : eventLoops.front()->base;
+}
+
+std::vector<HTTPWorkerStats> GetHTTPWorkerStats()
+{
+    if (!workQueue)
+        return std::vector<HTTPWorkerStats>();
+    return workQueue->Stats();
+}
+
+bool HTTPSubmitWork(std::function<void()> task)
+{
+    if (!workQueue)
+        return false;
+    std::unique_ptr<HTTPTaskItem> item(new HTTPTaskItem(std::move(task)));
+    if (!workQueue->Enqueue(item.get())) {
+        nRejectedTasks.fetch_add(1, std::memory_order_relaxed);
+        return false;
     }
-    if (eventBase) {
-        event_base_free(eventBase);
-        eventBase = nullptr;
+    item.release(); /* queue took ownership */
+    return true;
+}
+
+HTTPCompressionStats GetHTTPCompressionStats()
+{
+    HTTPCompressionStats stats;
+    stats.nReplies = nCompressedReplies.load(std::memory_order_relaxed);
+    stats.nRepliesIncompressible = nIncompressibleReplies.load(std::memory_order_relaxed);
+    stats.nReplyBytesIn = nCompressReplyBytesIn.load(std::memory_order_relaxed);
+    stats.nReplyBytesOut = nCompressReplyBytesOut.load(std::memory_order_relaxed);
+    stats.nReplyCpuMicros = nCompressReplyCpuMicros.load(std::memory_order_relaxed);
+    stats.nRequests = nDecodedRequests.load(std::memory_order_relaxed);
+    stats.nRequestsRejected = nDecodeRejectedRequests.load(std::memory_order_relaxed);
+    stats.nRequestBytesIn = nDecodeRequestBytesIn.load(std::memory_order_relaxed);
+    stats.nRequestBytesOut = nDecodeRequestBytesOut.load(std::memory_order_relaxed);
+    stats.nRequestCpuMicros = nDecodeRequestCpuMicros.load(std::memory_order_relaxed);
+    return stats;
+}
+
+std::vector<HTTPEventLoopStats> GetHTTPEventLoopStats()
+{
+    std::vector<HTTPEventLoopStats> stats;
+    for (const auto& loop : eventLoops) {
+        HTTPEventLoopStats s;
+        s.id = loop->id;
+        s.nConnections = loop->nConnections.load(std::memory_order_relaxed);
+        s.nActiveConnections = loop->nActiveConnections.load(std::memory_order_relaxed);
+        s.nRequests = loop->nRequests.load(std::memory_order_relaxed);
+        s.nIterations = loop->nIterations.load(std::memory_order_relaxed);
+        s.nReplyWakeups = loop->nReplyWakeups.load(std::memory_order_relaxed);
+        s.nRepliesBatched = loop->nRepliesBatched.load(std::memory_order_relaxed);
+        s.replyLag = loop->replyLag.Snapshot();
+        stats.push_back(s);
     }
+    return stats;
 }
 
-struct event_base* EventBase()
+HTTPWorkQueueStats GetHTTPWorkQueueStats()
+{
+    HTTPWorkQueueStats stats;
+    stats.nCapacity = workQueue ? workQueue->Capacity() : 0;
+    stats.nQueued = workQueue ? workQueue->Size() : 0;
+    stats.nRejectedRequests = nRejectedRequests.load(std::memory_order_relaxed);
+    stats.nRejectedTasks = nRejectedTasks.load(std::memory_order_relaxed);
+    return stats;
+}
+
+std::vector<HTTPRouteStats> GetHTTPRouteStats()
 {
-    return eventBase;
+    std::vector<HTTPRouteStats> stats;
+    std::shared_ptr<const HTTPRoutes> routes = std::atomic_load(&httpRoutes);
+    if (!routes)
+        return stats;
+    for (const HTTPPathHandler& handler : routes->handlers) {
+        HTTPRouteStats s;
+        s.prefix = handler.prefix;
+        s.exactMatch = handler.exactMatch;
+        for (size_t i = 0; i < 5; i++)
+            s.nReplies[i] = handler.counters->replies[i].load(std::memory_order_relaxed);
+        s.latency = handler.counters->latency.Snapshot();
+        stats.push_back(s);
+    }
+    return stats;
 }
 
 static void httpevent_callback_fn(evutil_socket_t, short, void* data)
@@ -424,13 +1146,25 @@ void HTTPEvent::trigger(struct timeval* tv)
     else
         evtimer_add(ev, tv); // trigger after timeval passed
 }
-HTTPRequest::HTTPRequest(struct evhttp_request* _req) : req(_req),
-                                                       replySent(false)
+HTTPRequest::HTTPRequest(struct evhttp_request* _req, HTTPEventLoop* _loop) : req(_req),
+                                                                            loop(_loop),
+                                                                            replySent(false),
+                                                                            bodyCoding(HTTP_CODING_IDENTITY),
+                                                                            fCompressReply(false),
+                                                                            nReplyStatus(0)
 {
+    nReceivedTime = HTTPNow();
+    if (!loop) {
+        assert(!eventLoops.empty());
+        loop = eventLoops.front().get();
+    }
 }
 HTTPRequest::~HTTPRequest()
 {
-    if (!replySent) {
+    if (replyStream && !replySent) {
+        // Finish a chunked reply the handler left open
+        EndReply();
+    } else if (!replySent) {
         // Keep track of whether reply was sent to avoid request leaks
         WriteReply(HTTP_INTERNAL, "Unhandled request");
     }
@@ -442,14 +1176,6 @@ std::pair<bool, std::string> HTTPRequest::GetHeader(const std::string& hdr)
     const struct evkeyvalq* headers = evhttp_request_get_input_headers(req);
     assert(headers);
     const char* val = evhttp_find_header(headers, hdr.c_str());
-    struct evkeyval *header;
-
-    TAILQ_FOREACH(header, headers, next) {
-       std::cout <<  "key: "  << header->key << std::endl;
-       std::cout <<  "value: "  << header->value << std::endl;
-       std::cout << std::endl;
-    }
-
     if (val)
         return std::make_pair(true, val);
     else
@@ -458,24 +1184,176 @@ std::pair<bool, std::string> HTTPRequest::GetHeader(const std::string& hdr)
 
 std::string HTTPRequest::ReadBody()
 {
-    struct evbuffer* buf = evhttp_request_get_input_buffer(req);
-    if (!buf)
-        return "";
-    size_t size = evbuffer_get_length(buf);
-    /** Trivial implementation: if this is ever a performance bottleneck,
-     * internal copying can be avoided in multi-segment buffers by using
-     * evbuffer_peek and an awkward loop. Though in that case, it'd be even
-     * better to not copy into an intermediate string but use a stream
-     * abstraction to consume the evbuffer on the fly in the parsing algorithm.
+    /** Copies the segments straight into the string, without linearizing the
+     * evbuffer first. Parsers should rather use HTTPBodyStream and consume the
+     * segments in place.
      */
-    const char* data = (const char*)evbuffer_pullup(buf, size);
-    if (!data) // returns nullptr in case of empty buffer
-        return "";
-    std::string rv(data, size);
-    evbuffer_drain(buf, size);
+    HTTPBodyStream body(*this);
+    std::string rv;
+    rv.reserve(body.size());
+    for (const auto& seg : body.segments())
+        rv.append(seg.first, seg.second);
     return rv;
 }
 
+const size_t HTTPReplyWriter::RESERVE_SIZE;
+const size_t HTTPReplyWriter::STREAM_CHUNK_SIZE;
+
+HTTPReplyWriter::HTTPReplyWriter(HTTPRequest& _req) : req(_req), base(nullptr), used(0), avail(0),
+                                                     nStreamThreshold(0), nStreamStatus(0), fStreaming(false)
+{
+    assert(!req.replySent && req.req);
+    buf = evhttp_request_get_output_buffer(req.req);
+    assert(buf);
+}
+
+HTTPReplyWriter::~HTTPReplyWriter()
+{
+    try {
+        Flush();
+    } catch (const std::exception&) {
+        // Out of memory, or the client is gone; the reply is cut short
+    }
+    if (fStreaming)
+        evbuffer_free(buf);
+}
+
+void HTTPReplyWriter::StreamFrom(size_t nThreshold, int nStatus)
+{
+    nStreamThreshold = nThreshold;
+    nStreamStatus = nStatus;
+}
+
+void HTTPReplyWriter::Commit()
+{
+    if (!base)
+        return;
+    evbuffer_iovec vec;
+    vec.iov_base = base;
+    vec.iov_len = used;
+    evbuffer_commit_space(buf, &vec, 1);
+    base = nullptr;
+    used = avail = 0;
+}
+
+void HTTPReplyWriter::Flush()
+{
+    Commit();
+    if (fStreaming)
+        SendChunk();
+}
+
+void HTTPReplyWriter::SendChunk()
+{
+    if (!fStreaming) {
+        // StartReply takes the body written so far along as the first
+        // chunk; go on in a buffer of our own, libevent owns the other now
+        struct evbuffer* own = evbuffer_new();
+        if (!own)
+            throw std::bad_alloc();
+        req.StartReply(nStreamStatus);
+        buf = own;
+        fStreaming = true;
+        return;
+    }
+    struct evbuffer* chunk = evbuffer_new();
+    if (!chunk)
+        throw std::bad_alloc();
+    evbuffer_add_buffer(chunk, buf);
+    if (!req.SendReplyChunk(chunk))
+        throw std::runtime_error("Client disconnected");
+}
+
+void HTTPReplyWriter::Reserve(size_t len)
+{
+    Commit();
+    if (nStreamThreshold > 0 &&
+        evbuffer_get_length(buf) >= (fStreaming ? STREAM_CHUNK_SIZE : nStreamThreshold))
+        SendChunk();
+    evbuffer_iovec vec;
+    if (evbuffer_reserve_space(buf, len > RESERVE_SIZE ? len : RESERVE_SIZE, &vec, 1) != 1)
+        throw std::bad_alloc();
+    base = static_cast<char*>(vec.iov_base);
+    avail = vec.iov_len;
+}
+
+void HTTPReplyWriter::Write(const char* data, size_t len)
+{
+    while (len > 0) {
+        if (used == avail)
+            Reserve(len);
+        size_t n = std::min(len, avail - used);
+        memcpy(base + used, data, n);
+        used += n;
+        data += n;
+        len -= n;
+    }
+}
+
+/** The non-empty segments of an evbuffer, in place */
+static std::vector<std::pair<const char*, size_t>> EvbufferSegments(struct evbuffer* buf)
+{
+    std::vector<std::pair<const char*, size_t>> segs;
+    int n = evbuffer_peek(buf, -1, nullptr, nullptr, 0);
+    std::vector<evbuffer_iovec> iov(std::max(n, 0));
+    n = evbuffer_peek(buf, -1, nullptr, iov.data(), iov.size());
+    for (int i = 0; i < n; i++) {
+        if (iov[i].iov_len > 0)
+            segs.emplace_back((const char*)iov[i].iov_base, iov[i].iov_len);
+    }
+    return segs;
+}
+
+HTTPBodyStream::HTTPBodyStream(HTTPRequest& req) : buf(nullptr), current(0), total(0)
+{
+    assert(req.req);
+    buf = evhttp_request_get_input_buffer(req.req);
+    if (buf) {
+        segs = EvbufferSegments(buf);
+        for (const auto& seg : segs)
+            total += seg.second;
+    }
+    if (segs.empty())
+        setg(nullptr, nullptr, nullptr);
+    else
+        SetSegment(0, 0);
+}
+
+HTTPBodyStream::~HTTPBodyStream()
+{
+    if (buf)
+        evbuffer_drain(buf, total);
+}
+
+void HTTPBodyStream::SetSegment(size_t n, size_t offset)
+{
+    char* begin = const_cast<char*>(segs[n].first);
+    current = n;
+    setg(begin, begin + offset, begin + segs[n].second);
+}
+
+HTTPBodyStream::int_type HTTPBodyStream::underflow()
+{
+    if (gptr() < egptr())
+        return traits_type::to_int_type(*gptr());
+    if (current + 1 >= segs.size())
+        return traits_type::eof();
+    SetSegment(current + 1, 0);
+    return traits_type::to_int_type(*gptr());
+}
+
+HTTPBodyStream::int_type HTTPBodyStream::pbackfail(int_type c)
+{
+    // Putting back across a segment boundary: step back into the previous segment
+    if (gptr() != eback() || current == 0)
+        return traits_type::eof();
+    const char last = segs[current - 1].first[segs[current - 1].second - 1];
+    if (!traits_type::eq_int_type(c, traits_type::eof()) && !traits_type::eq(traits_type::to_char_type(c), last))
+        return traits_type::eof();
+    SetSegment(current - 1, segs[current - 1].second - 1);
+    return traits_type::not_eof(c);
+}
+
 void HTTPRequest::WriteHeader(const std::string& hdr, const std::string& value)
 {
     struct evkeyvalq* headers = evhttp_request_get_output_headers(req);
@@ -483,36 +1361,345 @@ void HTTPRequest::WriteHeader(const std::string& hdr, const std::string& value)
     evhttp_add_header(headers, hdr.c_str(), value.c_str());
 }
 
-/** Closure sent to main thread to request a reply to be sent to
- * a HTTP request.
- * Replies must be sent in the main loop in the main http thread,
+/** Queue the reply on the reply queue of the event loop owning the request.
+ * Replies must be sent in the event loop thread,
  * this cannot be done from worker threads.
  */
 void HTTPRequest::WriteReply(int nStatus, const std::string& strReply)
 {
     assert(!replySent && req);
-    // Send event to main http thread to send reply message
     struct evbuffer* evb = evhttp_request_get_output_buffer(req);
     assert(evb);
     evbuffer_add(evb, strReply.data(), strReply.size());
-    auto req_copy = req;
-    HTTPEvent* ev = new HTTPEvent(eventBase, true, [req_copy, nStatus]{
-        evhttp_send_reply(req_copy, nStatus, nullptr, nullptr);
-        // Re-enable reading from the socket. This is the second part of the libevent
-        // workaround above.
-        if (event_get_version_number() >= 0x02010600 && event_get_version_number() < 0x02020001) {
-            evhttp_connection* conn = evhttp_request_get_connection(req_copy);
-            if (conn) {
-                bufferevent* bev = evhttp_connection_get_bufferevent(conn);
-                if (bev) {
-                    bufferevent_enable(bev, EV_READ | EV_WRITE);
-                }
+    SendReply(nStatus);
+}
+
+/** Release a reply body attached with evbuffer_add_reference */
+template <typename T>
+static void http_reference_cleanup_cb(const void*, size_t, void* arg)
+{
+    delete static_cast<T*>(arg);
+}
+
+void HTTPRequest::WriteReply(int nStatus, std::string&& strReply)
+{
+    if (strReply.size() < httpOptions.nReferenceThreshold) {
+        WriteReply(nStatus, static_cast<const std::string&>(strReply));
+        return;
+    }
+    assert(!replySent && req);
+    struct evbuffer* evb = evhttp_request_get_output_buffer(req);
+    assert(evb);
+    std::string* body = new std::string(std::move(strReply));
+    if (evbuffer_add_reference(evb, body->data(), body->size(), http_reference_cleanup_cb<std::string>, body) != 0) {
+        delete body;
+        throw std::bad_alloc();
+    }
+    SendReply(nStatus);
+}
+
+void HTTPRequest::WriteReply(int nStatus, std::shared_ptr<const std::string> reply)
+{
+    assert(!replySent && req && reply);
+    struct evbuffer* evb = evhttp_request_get_output_buffer(req);
+    assert(evb);
+    typedef std::shared_ptr<const std::string> Body;
+    Body* body = new Body(std::move(reply));
+    if (evbuffer_add_reference(evb, (*body)->data(), (*body)->size(), http_reference_cleanup_cb<Body>, body) != 0) {
+        delete body;
+        throw std::bad_alloc();
+    }
+    SendReply(nStatus);
+}
+
+/** Hand (part of) a reply to the event loop owning the request. The queue
+ * keeps the parts of one reply in the order they were queued.
+ */
+static void HTTPQueueReply(HTTPEventLoop* loop, HTTPReplyCompletion c)
+{
+    if (std::this_thread::get_id() == loop->threadId) {
+        // Already on the event loop thread, e.g. for early rejections
+        HTTPSendReply(loop, c);
+        return;
+    }
+    c.nQueuedTime = HTTPNow();
+    while (!loop->replies.TryPush(c)) {
+        // Queue full: make sure the loop is draining it, and retry
+        HTTPWakeReplies(loop);
+        std::this_thread::yield();
+    }
+    HTTPWakeReplies(loop);
+}
+
+/** CPU time used by the calling thread, in microseconds */
+static int64_t ThreadCpuMicros()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void HTTPRequest::CompressReply()
+{
+    // Replies written on the event loop itself are small rejections; keep
+    // compression work off the loop
+    if (std::this_thread::get_id() == loop->threadId)
+        return;
+    struct evbuffer* evb = evhttp_request_get_output_buffer(req);
+    const size_t len = evbuffer_get_length(evb);
+    if (len == 0 || len < httpOptions.nCompressMinSize)
+        return;
+    struct evkeyvalq* headers = evhttp_request_get_output_headers(req);
+    if (evhttp_find_header(headers, "Content-Encoding"))
+        return; // encoded by the handler itself
+    // The body depends on Accept-Encoding from here on, whatever we choose
+    evhttp_add_header(headers, "Vary", "Accept-Encoding");
+    const char* accept = evhttp_find_header(evhttp_request_get_input_headers(req), "Accept-Encoding");
+    HTTPContentCoding coding = accept ? HTTPCodingFromAcceptEncoding(accept) : HTTP_CODING_IDENTITY;
+    if (coding == HTTP_CODING_IDENTITY)
+        return;
+
+    const int64_t nStart = ThreadCpuMicros();
+    std::unique_ptr<std::string> body(new std::string());
+    const bool fOk = HTTPCompress(coding, EvbufferSegments(evb), *body);
+    nCompressReplyCpuMicros.fetch_add(ThreadCpuMicros() - nStart, std::memory_order_relaxed);
+    if (!fOk || body->size() >= len) {
+        nIncompressibleReplies.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    nCompressedReplies.fetch_add(1, std::memory_order_relaxed);
+    nCompressReplyBytesIn.fetch_add(len, std::memory_order_relaxed);
+    nCompressReplyBytesOut.fetch_add(body->size(), std::memory_order_relaxed);
+
+    evbuffer_drain(evb, len);
+    if (evbuffer_add_reference(evb, body->data(), body->size(), http_reference_cleanup_cb<std::string>, body.get()) != 0)
+        throw std::bad_alloc();
+    body.release();
+    evhttp_add_header(headers, "Content-Encoding", HTTPCodingName(coding));
+}
+
+bool HTTPRequest::DecodeBody()
+{
+    if (bodyCoding == HTTP_CODING_IDENTITY)
+        return true;
+    assert(!replySent && req);
+    struct evbuffer* evb = evhttp_request_get_input_buffer(req);
+    const size_t len = evbuffer_get_length(evb);
+    const int64_t nStart = ThreadCpuMicros();
+    std::unique_ptr<std::string> body(new std::string());
+    const bool fOk = HTTPDecompress(bodyCoding, EvbufferSegments(evb), *body, MAX_SIZE);
+    nDecodeRequestCpuMicros.fetch_add(ThreadCpuMicros() - nStart, std::memory_order_relaxed);
+    bodyCoding = HTTP_CODING_IDENTITY;
+    evbuffer_drain(evb, len);
+    if (!fOk) {
+        nDecodeRejectedRequests.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    nDecodedRequests.fetch_add(1, std::memory_order_relaxed);
+    nDecodeRequestBytesIn.fetch_add(len, std::memory_order_relaxed);
+    nDecodeRequestBytesOut.fetch_add(body->size(), std::memory_order_relaxed);
+
+    if (evbuffer_add_reference(evb, body->data(), body->size(), http_reference_cleanup_cb<std::string>, body.get()) != 0)
+        throw std::bad_alloc();
+    body.release();
+    // Handlers see the body as if it had been sent plain
+    evhttp_remove_header(evhttp_request_get_input_headers(req), "Content-Encoding");
+    return true;
+}
+
+void HTTPRequest::RecordReply(int nStatus)
+{
+    if (!routes || route.route >= routes->handlers.size())
+        return;
+    HTTPRouteCounters& counters = *routes->handlers[route.route].counters;
+    if (nStatus >= 100 && nStatus < 600)
+        counters.replies[nStatus / 100 - 1].fetch_add(1, std::memory_order_relaxed);
+    counters.latency.Record(HTTPNow() - nReceivedTime);
+}
+
+void HTTPRequest::SendReply(int nStatus)
+{
+    if (!replyStream)
+        TraceReply(nStatus);
+    if (!replyStream && fCompressReply && httpOptions.fCompressReplies)
+        CompressReply();
+    RecordReply(replyStream ? nReplyStatus : nStatus);
+    HTTPReplyCompletion c;
+    c.req = req;
+    c.nStatus = nStatus;
+    c.part = replyStream ? HTTP_REPLY_END : HTTP_REPLY_WHOLE;
+    c.chunk = nullptr;
+    c.stream = nullptr;
+    c.trace = trace.release();
+    HTTPQueueReply(loop, c);
+    replyStream.reset();
+    replySent = true;
+    req = nullptr; // transferred back to the event loop thread
+}
+
+void HTTPRequest::StartTrace(int64_t nAcceptTime)
+{
+    const struct evkeyvalq* headers = evhttp_request_get_input_headers(req);
+    const char* traceparent = evhttp_find_header(headers, "traceparent");
+    const bool fServerTiming = evhttp_find_header(headers, "X-Server-Timing") != nullptr;
+    bool fSample = false;
+    if (httpOptions.nTraceSampleInterval > 0 && loop->nTraceCountdown-- == 0) {
+        loop->nTraceCountdown = httpOptions.nTraceSampleInterval - 1;
+        fSample = true;
+    }
+    if (!fSample && !fServerTiming && !traceparent)
+        return;
+    trace.reset(new HTTPTrace());
+    HTTPTraceInit(*trace, RequestMethodString(GetRequestMethod()).c_str(), evhttp_request_get_uri(req), traceparent, fSample);
+    trace->fServerTiming = fServerTiming;
+    trace->stamps[HTTP_TRACE_ACCEPT] = nAcceptTime;
+    trace->stamps[HTTP_TRACE_RECEIVED] = nReceivedTime;
+}
+
+void HTTPRequest::TraceMark(HTTPTracePoint point)
+{
+    if (trace)
+        trace->stamps[point] = HTTPNow();
+}
+
+void HTTPRequest::TraceReply(int nStatus)
+{
+    if (!trace)
+        return;
+    trace->stamps[HTTP_TRACE_REPLY] = HTTPNow();
+    trace->nStatus = nStatus;
+    struct evkeyvalq* headers = evhttp_request_get_output_headers(req);
+    if (trace->fServerTiming)
+        evhttp_add_header(headers, "Server-Timing", HTTPServerTimingHeader(*trace).c_str());
+    if (trace->fServerTiming || trace->parentId != 0)
+        evhttp_add_header(headers, "traceresponse", HTTPTraceResponseHeader(*trace).c_str());
+}
+
+void HTTPRequest::DiscardReplyBody()
+{
+    assert(!replySent && !replyStream && req);
+    struct evbuffer* evb = evhttp_request_get_output_buffer(req);
+    evbuffer_drain(evb, evbuffer_get_length(evb));
+}
+
+void HTTPRequest::StartReply(int nStatus)
+{
+    assert(!replySent && !replyStream && req);
+    // Take out what was written to the output buffer so far: libevent would
+    // send it unframed along with the headers
+    struct evbuffer* evb = evhttp_request_get_output_buffer(req);
+    struct evbuffer* first = nullptr;
+    if (evbuffer_get_length(evb) > 0) {
+        first = evbuffer_new();
+        if (!first)
+            throw std::bad_alloc();
+        evbuffer_add_buffer(first, evb);
+    }
+
+    TraceReply(nStatus);
+    replyStream = std::make_shared<HTTPReplyStream>();
+    nReplyStatus = nStatus;
+    HTTPReplyCompletion c;
+    c.req = req;
+    c.nStatus = nStatus;
+    c.part = HTTP_REPLY_START;
+    c.chunk = nullptr;
+    c.stream = new std::shared_ptr<HTTPReplyStream>(replyStream);
+    c.trace = nullptr;
+    HTTPQueueReply(loop, c);
+    if (first)
+        SendReplyChunk(first);
+}
+
+bool HTTPRequest::WriteReplyChunk(const char* data, size_t len)
+{
+    struct evbuffer* chunk = evbuffer_new();
+    if (!chunk || evbuffer_add(chunk, data, len) != 0) {
+        if (chunk)
+            evbuffer_free(chunk);
+        throw std::bad_alloc();
+    }
+    return SendReplyChunk(chunk);
+}
+
+bool HTTPRequest::SendReplyChunk(struct evbuffer* chunk)
+{
+    assert(replyStream && !replySent);
+    const size_t len = evbuffer_get_length(chunk);
+    if (len == 0) {
+        // An empty chunk would end the reply
+        evbuffer_free(chunk);
+    } else {
+        HTTPReplyCompletion c;
+        c.req = req;
+        c.nStatus = 0;
+        c.part = HTTP_REPLY_CHUNK;
+        c.chunk = chunk;
+        c.stream = nullptr;
+        c.trace = nullptr;
+        HTTPQueueReply(loop, c);
+        replyStream->nQueued += len;
+    }
+
+    // Wait for the client to catch up once too much is outstanding, but
+    // not forever: give up on a client that stops reading, or that reads a
+    // few bytes now and then and would hold on to this worker as long as
+    // it likes
+    HTTPReplyStream& stream = *replyStream;
+    std::unique_lock<std::mutex> lock(stream.cs);
+    const auto drained = [&stream] {
+        return stream.fClosed || stream.nQueued - stream.nFlushed <= httpOptions.nReplyHighWatermark;
+    };
+    while (!drained()) {
+        const int64_t nBudget = (int64_t)httpOptions.nReplyStallTimeout * 1000000000 - stream.nIdleNanos;
+        if (nBudget <= 0)
+            return AbandonReply();
+        const int64_t nInterval = std::min(REPLY_DRAIN_CHECK_INTERVAL, nBudget);
+        const uint64_t nWrittenBefore = stream.nWritten.load(std::memory_order_relaxed);
+        const int64_t nStart = HTTPNow();
+        const bool fDrained = stream.cond.wait_for(lock, std::chrono::nanoseconds(nInterval), drained);
+        const int64_t nWaited = HTTPNow() - nStart;
+        const uint64_t nWritten = stream.nWritten.load(std::memory_order_relaxed) - nWrittenBefore;
+        // Only time without any progress counts towards the stall timeout
+        if (nWritten > 0)
+            stream.nIdleNanos = 0;
+        else
+            stream.nIdleNanos += nWaited;
+        if (fDrained)
+            break;
+        if (nWaited >= REPLY_DRAIN_CHECK_INTERVAL && (double)nWritten * 1e9 < (double)httpOptions.nReplyMinDrainRate * nWaited)
+            return AbandonReply();
+    }
+    return !stream.fClosed;
+}
+
+bool HTTPRequest::AbandonReply()
+{
+    // Precondition: replyStream->cs is held by the caller
+    replyStream->fClosed = true;
+    replyStream->fAbandoned = true;
+    return false;
+}
+
+void HTTPRequest::EndReply()
+{
+    assert(replyStream && !replySent);
+    SendReply(0);
+}
+
+std::pair<bool, std::string> HTTPRequest::GetRouteParam(const std::string& name)
+{
+    if (routes) {
+        const std::vector<std::string>& names = routes->router.ParamNames(route.route);
+        for (size_t i = 0; i < route.nParams && i < names.size(); i++) {
+            if (names[i] == name) {
+                const char* uri = evhttp_request_get_uri(req);
+                return std::make_pair(true, std::string(uri + route.params[i].first, route.params[i].second));
             }
         }
-    });
-    ev->trigger(nullptr);
-    replySent = true;
-    req = nullptr; // transferred back to main thread
+    }
+    return std::make_pair(false, std::string());
 }
 
 std::string HTTPRequest::GetURI()
@@ -541,13 +1728,21 @@ HTTPRequest::RequestMethod HTTPRequest::GetRequestMethod()
     }
 }
 
-void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler)
+bool RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler,
+                         bool fCompressReplies, bool fInline)
 {
-    pathHandlers.push_back(HTTPPathHandler(prefix, exactMatch, handler));
+    HTTPRouter check;
+    if (!check.Add(prefix, exactMatch, 0))
+        return false;
+    std::lock_guard<std::mutex> lock(cs_pathHandlers);
+    pathHandlers.push_back(HTTPPathHandler(prefix, exactMatch, handler, fCompressReplies, fInline));
+    RebuildHTTPRoutes();
+    return true;
 }
 
 void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch)
 {
+    std::lock_guard<std::mutex> lock(cs_pathHandlers);
     std::vector<HTTPPathHandler>::iterator i = pathHandlers.begin();
     std::vector<HTTPPathHandler>::iterator iend = pathHandlers.end();
     for (; i != iend; ++i)
@@ -556,6 +1751,7 @@ void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch)
     if (i != iend)
     {
         pathHandlers.erase(i);
+        RebuildHTTPRoutes();
     }
 }
 
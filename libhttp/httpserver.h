@@ -8,19 +8,93 @@
 #include <string>
 #include <stdint.h>
 #include <functional>
+#include <memory>
+#include <streambuf>
+#include <vector>
+
+#include "httpcompress.h"
+#include "httprouter.h"
+#include "httptrace.h"
 
 static const int DEFAULT_HTTP_THREADS=4;
 static const int DEFAULT_HTTP_WORKQUEUE=16;
 static const int DEFAULT_HTTP_SERVER_TIMEOUT=30;
+static const int DEFAULT_HTTP_EVENT_LOOPS=1;
+static const size_t DEFAULT_HTTP_REFERENCE_THRESHOLD=256*1024;
+static const size_t DEFAULT_HTTP_REPLY_HIGH_WATERMARK=1024*1024;
+static const size_t DEFAULT_HTTP_COMPRESS_MIN_SIZE=1024;
+static const unsigned int DEFAULT_HTTP_TRACE_SAMPLE_INTERVAL=1000;
+static const int DEFAULT_HTTP_REPLY_STALL_TIMEOUT=60;
+static const size_t DEFAULT_HTTP_REPLY_MIN_DRAIN_RATE=4096;
 
 struct evhttp_request;
 struct event_base;
+struct HTTPEventLoop;
+struct HTTPReplyStream;
+struct HTTPRoutes;
 class HTTPRequest;
 
+/** How new requests are assigned to the workers' queues */
+enum HTTPDispatchPolicy
+{
+    HTTP_DISPATCH_ROUND_ROBIN,
+    HTTP_DISPATCH_LEAST_LOADED
+};
+
+/** HTTP server tunables, passed to InitHTTPServer(). */
+struct HTTPServerOptions
+{
+    /** Number of worker threads executing requests */
+    int nThreads = DEFAULT_HTTP_THREADS;
+    /** Maximum number of queued requests, spread over the workers */
+    int nWorkQueueDepth = DEFAULT_HTTP_WORKQUEUE;
+    /** Which worker new requests are queued on. Idle workers steal from
+     * busy ones whatever the policy.
+     */
+    HTTPDispatchPolicy dispatchPolicy = HTTP_DISPATCH_ROUND_ROBIN;
+    /** Number of event loops accepting and parsing requests. With more than
+     * one, every loop binds its own listening sockets with SO_REUSEPORT and
+     * the kernel spreads incoming connections across them.
+     */
+    int nEventLoops = DEFAULT_HTTP_EVENT_LOOPS;
+    /** Reply bodies handed over by ownership from this size on are attached
+     * to the output buffer by reference instead of being copied into it.
+     * Below it a copy is cheaper than tracking the reference.
+     */
+    size_t nReferenceThreshold = DEFAULT_HTTP_REFERENCE_THRESHOLD;
+    /** A worker sending a chunked reply waits while more than this many
+     * bytes of it are queued but not yet written to the socket, so a slow
+     * client holds up the producer instead of the reply piling up in memory.
+     */
+    size_t nReplyHighWatermark = DEFAULT_HTTP_REPLY_HIGH_WATERMARK;
+    /** A worker gives up on a chunked reply, and the connection is closed,
+     * once it has waited this many seconds for the client to catch up
+     * without the client reading anything, or once the client reads less
+     * than nReplyMinDrainRate bytes per second while it waits. A client that
+     * keeps reading at least that fast gets the whole reply, however long
+     * it takes. The producer sees WriteReplyChunk fail once the reply is
+     * given up on.
+     */
+    int nReplyStallTimeout = DEFAULT_HTTP_REPLY_STALL_TIMEOUT;
+    size_t nReplyMinDrainRate = DEFAULT_HTTP_REPLY_MIN_DRAIN_RATE;
+    /** Compress replies with gzip or zstd when the client accepts it. This
+     * runs on the worker thread writing the reply, never on an event loop.
+     * Chunked replies are sent as they are.
+     */
+    bool fCompressReplies = true;
+    /** Replies smaller than this are not worth compressing */
+    size_t nCompressMinSize = DEFAULT_HTTP_COMPRESS_MIN_SIZE;
+    /** Trace one in this many requests of every event loop into the trace
+     * ring, see HTTPTraceDumpChrome; 0 for none. Requests whose traceparent
+     * header has the sampled flag are traced regardless.
+     */
+    unsigned int nTraceSampleInterval = DEFAULT_HTTP_TRACE_SAMPLE_INTERVAL;
+};
+
 /** Initialize HTTP server.
  * Call this before RegisterHTTPHandler or EventBase().
  */
-bool InitHTTPServer();
+bool InitHTTPServer(const HTTPServerOptions& options = HTTPServerOptions());
 /** Start HTTP server.
  * This is separate from InitHTTPServer to give users race-condition-free time
  * to register their handlers between InitHTTPServer and StartHTTPServer.
@@ -38,29 +112,156 @@ bool UpdateHTTPServerLogging(bool enable);
 /** Handler for requests to a certain HTTP path */
 typedef std::function<bool(HTTPRequest* req, const std::string &)> HTTPRequestHandler;
 /** Register handler for prefix.
- * If multiple handlers match a prefix, the first-registered one will
- * be invoked.
+ * The prefix may contain parameters that match one path segment each, such
+ * as "/rest/tx/{hash}"; see HTTPRequest::GetRouteParam. If multiple
+ * handlers match a URI, an exact match is preferred, then the longest
+ * matching prefix. If the same prefix is registered twice, the
+ * first-registered handler is invoked.
+ * fCompressReplies=false opts the handler's replies out of compression,
+ * e.g. for content that is already compressed.
+ * fInline=true runs the handler on the event loop thread rather than queuing
+ * it for a worker, so it is answered even while the work queue is full. Only
+ * for handlers that are cheap and never block; their replies are not
+ * compressed and encoded bodies are not decoded.
+ * Returns false if the prefix is malformed.
  */
-void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler);
+bool RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler,
+                         bool fCompressReplies = true, bool fInline = false);
 /** Unregister handler for prefix */
 void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch);
 
 /** Return evhttp event base. This can be used by submodules to
  * queue timers or custom events.
+ * When running several event loops, this is the base of the first one.
  */
 struct event_base* EventBase();
 
+/** Run task on one of the worker threads, next to the request handlers.
+ * Returns false if the server is not running or the work queue is full.
+ * A task that was accepted may still never run when the server is
+ * interrupted, so never wait on one without being able to do its work
+ * yourself.
+ */
+bool HTTPSubmitWork(std::function<void()> task);
+
+/** Number of buckets of a HTTPLatencyStats */
+static const size_t HTTP_LATENCY_BUCKETS = 16;
+/** Upper bounds of the latency buckets, in seconds */
+extern const double HTTP_LATENCY_BOUNDS[HTTP_LATENCY_BUCKETS];
+
+/** Latency histogram with fixed buckets, as exported by /metrics */
+struct HTTPLatencyStats
+{
+    uint64_t counts[HTTP_LATENCY_BUCKETS]; //!< values within each bucket, not cumulative
+    uint64_t nCount;                       //!< all values, also those beyond the last bound
+    uint64_t nSumNanos;
+};
+
+/** Per event loop counters, to see how evenly connections are spread.
+ * Replies finished by workers are handed to the loop in batches; the
+ * average batch size is nRepliesBatched / nReplyWakeups.
+ */
+struct HTTPEventLoopStats
+{
+    int id;
+    uint64_t nConnections;       //!< connections accepted by this loop
+    uint64_t nActiveConnections; //!< connections that sent a request and are still open
+    uint64_t nRequests;          //!< requests received by this loop
+    uint64_t nIterations;        //!< passes of the loop that ran callbacks
+    uint64_t nReplyWakeups;      //!< times the loop woke up to send queued replies
+    uint64_t nRepliesBatched;    //!< replies sent from those wakeups
+    HTTPLatencyStats replyLag;   //!< time replies queued by workers waited for the loop
+};
+
+/** Return a snapshot of the counters of every event loop */
+std::vector<HTTPEventLoopStats> GetHTTPEventLoopStats();
+
+/** Per worker thread counters */
+struct HTTPWorkerStats
+{
+    int id;
+    size_t nQueued;     //!< items waiting in this worker's queue
+    uint64_t nExecuted; //!< items run by this worker
+    uint64_t nStolen;   //!< items this worker took from other workers' queues
+    uint64_t nBusyNanos; //!< time spent running items; utilization is its rate
+};
+
+/** Return a snapshot of the counters of every worker */
+std::vector<HTTPWorkerStats> GetHTTPWorkerStats();
+
+/** Work queue saturation. Requests are rejected with a 500 once the queue
+ * is full, so nQueued approaching nCapacity is the warning sign.
+ */
+struct HTTPWorkQueueStats
+{
+    size_t nCapacity;           //!< items the queue holds, over all workers
+    size_t nQueued;             //!< items waiting
+    uint64_t nRejectedRequests; //!< requests answered with "Work queue depth exceeded"
+    uint64_t nRejectedTasks;    //!< tasks refused by HTTPSubmitWork
+};
+
+/** Return a snapshot of the work queue counters */
+HTTPWorkQueueStats GetHTTPWorkQueueStats();
+
+/** Counters of a registered handler. Latency runs from a request being
+ * received in full to its reply, or the end of it, being handed to the
+ * event loop.
+ */
+struct HTTPRouteStats
+{
+    std::string prefix;
+    bool exactMatch;
+    uint64_t nReplies[5]; //!< replies by status class, 1xx to 5xx
+    HTTPLatencyStats latency;
+};
+
+/** Return a snapshot of the counters of every registered handler */
+std::vector<HTTPRouteStats> GetHTTPRouteStats();
+
+/** Compression counters. The ratio achieved on replies is
+ * nReplyBytesIn / nReplyBytesOut; CPU time is that of the compressing
+ * thread, in microseconds.
+ */
+struct HTTPCompressionStats
+{
+    uint64_t nReplies;              //!< replies compressed
+    uint64_t nRepliesIncompressible; //!< replies sent as they were, compression did not pay off
+    uint64_t nReplyBytesIn;         //!< reply bytes before compression
+    uint64_t nReplyBytesOut;        //!< reply bytes after compression
+    uint64_t nReplyCpuMicros;       //!< time spent compressing replies
+    uint64_t nRequests;             //!< request bodies decoded
+    uint64_t nRequestsRejected;     //!< request bodies that could not be decoded
+    uint64_t nRequestBytesIn;       //!< request body bytes as received
+    uint64_t nRequestBytesOut;      //!< request body bytes after decoding
+    uint64_t nRequestCpuMicros;     //!< time spent decoding request bodies
+};
+
+/** Return a snapshot of the compression counters */
+HTTPCompressionStats GetHTTPCompressionStats();
+
 /** In-flight HTTP request.
  * Thin C++ wrapper around evhttp_request.
  */
 class HTTPRequest
 {
 private:
+    friend class HTTPBodyStream;
+    friend class HTTPReplyWriter;
+
     struct evhttp_request* req;
+    struct HTTPEventLoop* loop; //!< event loop owning the connection
     bool replySent;
+    std::shared_ptr<HTTPReplyStream> replyStream; //!< set once a chunked reply was started
+    std::shared_ptr<const HTTPRoutes> routes; //!< routing table the request was dispatched with
+    HTTPRouteMatch route;
+    HTTPContentCoding bodyCoding; //!< Content-Encoding of the body until it is decoded
+    bool fCompressReply;
+    int64_t nReceivedTime;
+    int nReplyStatus; //!< status of a chunked reply, sent at its start
+    std::unique_ptr<HTTPTrace> trace; //!< set if the request is traced
 
 public:
-    explicit HTTPRequest(struct evhttp_request* req);
+    explicit HTTPRequest(struct evhttp_request* req, struct HTTPEventLoop* loop = nullptr);
     ~HTTPRequest();
 
     enum RequestMethod {
@@ -75,6 +276,24 @@ public:
      */
     std::string GetURI();
 
+    /** Time the request was received in full, in nanoseconds of
+     * std::chrono::steady_clock
+     */
+    int64_t GetReceivedTime() const { return nReceivedTime; }
+
+    /**
+     * Start tracing the request if it is sampled, carries a traceparent or
+     * asks for a Server-Timing header with "X-Server-Timing". Called by the
+     * event loop, with the time the connection was accepted if this is its
+     * first request, otherwise 0.
+     */
+    void StartTrace(int64_t nAcceptTime);
+    /** Timestamp a point of the request's trace, if it is traced. Handlers
+     * mark HTTP_TRACE_EXEC_START and HTTP_TRACE_EXEC_END around their
+     * actual work.
+     */
+    void TraceMark(HTTPTracePoint point);
+
     /** Get CService (address:ip) for the origin of the http request.
      */
 //    CService GetPeer();
@@ -94,9 +313,39 @@ public:
      *
      * @note As this consumes the underlying buffer, call this only once.
      * Repeated calls will return an empty string.
+     * @see HTTPBodyStream to read the body without copying it.
      */
     std::string ReadBody();
 
+    /**
+     * Decode a body sent with a Content-Encoding, in place. The server does
+     * this on the worker thread before the handler runs, so ReadBody and
+     * HTTPBodyStream always see the plain body.
+     * @returns false if the body is corrupt or decodes to more than the
+     * maximum body size.
+     */
+    bool DecodeBody();
+    void SetBodyCoding(HTTPContentCoding coding) { bodyCoding = coding; }
+
+    /**
+     * Allow or forbid compressing the reply, see
+     * HTTPServerOptions::fCompressReplies. Defaults to the setting of the
+     * handler's route.
+     */
+    void SetReplyCompression(bool fCompress) { fCompressReply = fCompress; }
+
+    /**
+     * Get a parameter captured by the route the request was dispatched to,
+     * e.g. "hash" for "/rest/tx/{hash}".
+     * @returns whether the parameter exists, and its value
+     */
+    std::pair<bool, std::string> GetRouteParam(const std::string& name);
+    void SetRoute(std::shared_ptr<const HTTPRoutes> _routes, const HTTPRouteMatch& match)
+    {
+        routes = std::move(_routes);
+        route = match;
+    }
+
     /**
      * Write output header.
      *
@@ -113,6 +362,150 @@ public:
      * main thread, do not call any other HTTPRequest methods after calling this.
      */
     void WriteReply(int nStatus, const std::string& strReply = "");
+    /**
+     * Write HTTP reply, taking over the body. A large body is sent from the
+     * string itself rather than from a copy, see
+     * HTTPServerOptions::nReferenceThreshold.
+     */
+    void WriteReply(int nStatus, std::string&& strReply);
+    /**
+     * Write HTTP reply with a shared body, e.g. one kept in a cache. The body
+     * is always sent by reference and must not be changed until the last
+     * reference to it is dropped.
+     */
+    void WriteReply(int nStatus, std::shared_ptr<const std::string> reply);
+
+    /**
+     * Start a reply whose body is sent piece by piece, with chunked transfer
+     * encoding for HTTP/1.1 clients. Write the headers first, then send the
+     * body with WriteReplyChunk and finish it with EndReply. The pieces are
+     * sent by the event loop in the order they were written. Anything
+     * already written to the body goes out as the first piece.
+     */
+    void StartReply(int nStatus);
+    /**
+     * Send the next piece of a reply begun with StartReply. Blocks while
+     * more than HTTPServerOptions::nReplyHighWatermark bytes are waiting to
+     * be written to the client, until it catches up or is given up on as
+     * HTTPServerOptions::nReplyStallTimeout describes.
+     * @returns false once the client has gone away or was given up on; the
+     * rest of the reply can then be skipped.
+     */
+    bool WriteReplyChunk(const char* data, size_t len);
+    /**
+     * Finish a reply begun with StartReply. Like WriteReply, this gives the
+     * request back to the event loop.
+     */
+    void EndReply();
+    /** Drop what was written to the reply body so far, e.g. by a
+     * HTTPReplyWriter whose producer failed half way
+     */
+    void DiscardReplyBody();
+    /** Whether a chunked reply was started */
+    bool ReplyStarted() const { return replyStream != nullptr; }
+
+private:
+    /** Hand the request with its output buffer back to the event loop */
+    void SendReply(int nStatus);
+    /** Count the reply in the counters of the request's route */
+    void RecordReply(int nStatus);
+    /** Compress the output buffer if the client and the size allow it */
+    void CompressReply();
+    /** Queue a piece of a chunked reply, taking ownership; see WriteReplyChunk */
+    bool SendReplyChunk(struct evbuffer* chunk);
+    /** Give up on a chunked reply whose client reads too slowly; the event
+     * loop closes the connection once the reply is ended. Returns false.
+     */
+    bool AbandonReply();
+    /** Mark the reply in the trace and add the trace headers the client asked for */
+    void TraceReply(int nStatus);
+};
+
+/** Zero-copy view of a request body.
+ * Exposes the segments of the underlying evbuffer in place, and is a
+ * std::streambuf over them, so a parser can consume a multi-megabyte body
+ * through std::istream without the body ever being linearized or copied.
+ *
+ * @note Like HTTPRequest::ReadBody, this consumes the body: it is drained
+ * when the view is destroyed.
+ */
+class HTTPBodyStream : public std::streambuf
+{
+public:
+    explicit HTTPBodyStream(HTTPRequest& req);
+    ~HTTPBodyStream();
+
+    /** Total body size in bytes */
+    size_t size() const { return total; }
+    /** Body segments, in order */
+    const std::vector<std::pair<const char*, size_t>>& segments() const { return segs; }
+
+protected:
+    int_type underflow() override;
+    int_type pbackfail(int_type c) override;
+
+private:
+    struct evbuffer* buf;
+    std::vector<std::pair<const char*, size_t>> segs;
+    size_t current;
+    size_t total;
+
+    void SetSegment(size_t n, size_t offset);
+};
+
+/** Writer that serializes a reply body in place.
+ * Bytes go straight into space reserved at the end of the request's output
+ * buffer, so a body produced piecewise is neither staged in a temporary
+ * string nor copied a second time by WriteReply. Destroy (or Flush) the
+ * writer before calling HTTPRequest::WriteReply, with an empty body.
+ *
+ * A body of unbounded size can be streamed instead, see StreamFrom. Once it
+ * is, finish the request with HTTPRequest::EndReply.
+ */
+class HTTPReplyWriter
+{
+public:
+    explicit HTTPReplyWriter(HTTPRequest& req);
+    ~HTTPReplyWriter();
+
+    /**
+     * Start a chunked reply with status nStatus as soon as more than
+     * nThreshold bytes have been written, and from then on send the body in
+     * pieces while it is being written. Writes block while the client lags
+     * behind, and throw std::runtime_error once it has gone away.
+     */
+    void StreamFrom(size_t nThreshold, int nStatus);
+
+    void Write(const char* data, size_t len);
+    void Write(char c)
+    {
+        if (used == avail)
+            Reserve(1);
+        base[used++] = c;
+    }
+    /** Commit what was written so far to the output buffer, or send it if
+     * the reply is being streamed
+     */
+    void Flush();
+
+private:
+    //! Reservation size; more is reserved at once when libevent has it at hand
+    static const size_t RESERVE_SIZE = 4096;
+    //! Size of the pieces of a streamed reply
+    static const size_t STREAM_CHUNK_SIZE = 64 * 1024;
+
+    HTTPRequest& req;
+    struct evbuffer* buf; //!< the request's output buffer, or our own once streaming
+    char* base;  //!< current reservation
+    size_t used;
+    size_t avail;
+    size_t nStreamThreshold;
+    int nStreamStatus;
+    bool fStreaming; //!< the reply was started, buf is our own
+
+    void Reserve(size_t len);
+    void Commit();
+    void SendChunk();
 };
 
 /** Event handler closure.
@@ -0,0 +1,259 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <httptrace.h>
+
+#include <atomic>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+#include <type_traits>
+
+static_assert(std::is_trivially_copyable<HTTPTrace>::value, "traces are copied word by word");
+
+/** A trace as stored in the ring */
+static const size_t HTTP_TRACE_WORDS = (sizeof(HTTPTrace) + 7) / 8;
+
+/**
+ * Slot of the trace ring, guarded by a sequence lock: writer n of the slot
+ * marks it 2n+1 while it writes and 2n+2 once done. Readers copy the words
+ * and keep the copy only if the mark was the same before and after.
+ */
+struct HTTPTraceSlot
+{
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> words[HTTP_TRACE_WORDS];
+};
+
+//! Zero-initialized as static storage, and never freed so exiting threads can still write
+static HTTPTraceSlot traceRing[HTTP_TRACE_RING_SIZE];
+//! Traces committed so far; trace n lives in slot n % HTTP_TRACE_RING_SIZE
+static std::atomic<uint64_t> nTracesCommitted(0);
+
+static uint64_t TraceRandom()
+{
+    static thread_local std::mt19937_64 rng([] {
+        std::random_device rd;
+        return ((uint64_t)rd() << 32) ^ rd();
+    }());
+    uint64_t n;
+    do {
+        n = rng();
+    } while (n == 0); // all-zero ids are invalid
+    return n;
+}
+
+/** Parse exactly 2 * sizeof(n) lowercase hex digits, as trace context requires */
+static bool ParseTraceHex(const char* p, size_t nDigits, uint64_t& n)
+{
+    n = 0;
+    for (size_t i = 0; i < nDigits; i++) {
+        const char c = p[i];
+        if (c >= '0' && c <= '9')
+            n = (n << 4) | (c - '0');
+        else if (c >= 'a' && c <= 'f')
+            n = (n << 4) | (c - 'a' + 10);
+        else
+            return false;
+    }
+    return true;
+}
+
+/** Parse a traceparent header: version-traceid-parentid-flags */
+static bool ParseTraceparent(const char* header, HTTPTrace& trace)
+{
+    const size_t len = strlen(header);
+    uint64_t nVersion, nFlags;
+    if (len < 55 || header[2] != '-' || header[35] != '-' || header[52] != '-')
+        return false;
+    if (!ParseTraceHex(header, 2, nVersion) || nVersion == 0xff)
+        return false;
+    // Later versions may append fields, version 00 may not
+    if (nVersion == 0 ? len != 55 : len > 55 && header[55] != '-')
+        return false;
+    uint64_t nHigh, nLow, nParent;
+    if (!ParseTraceHex(header + 3, 16, nHigh) || !ParseTraceHex(header + 19, 16, nLow) ||
+        !ParseTraceHex(header + 36, 16, nParent) || !ParseTraceHex(header + 53, 2, nFlags))
+        return false;
+    if ((nHigh == 0 && nLow == 0) || nParent == 0)
+        return false;
+    trace.traceIdHigh = nHigh;
+    trace.traceIdLow = nLow;
+    trace.parentId = nParent;
+    trace.flags = nFlags;
+    return true;
+}
+
+void HTTPTraceInit(HTTPTrace& trace, const char* method, const char* uri, const char* traceparent, bool fSample)
+{
+    memset(&trace, 0, sizeof(trace));
+    if (!traceparent || !ParseTraceparent(traceparent, trace)) {
+        trace.traceIdHigh = TraceRandom();
+        trace.traceIdLow = TraceRandom();
+        trace.flags = fSample ? 1 : 0;
+    }
+    trace.spanId = TraceRandom();
+    strncpy(trace.method, method, sizeof(trace.method) - 1);
+    strncpy(trace.uri, uri, sizeof(trace.uri) - 1);
+}
+
+/** Time between two points in nanoseconds, or -1 unless both were passed */
+static int64_t TraceSpan(const HTTPTrace& trace, int from, int to)
+{
+    if (trace.stamps[from] == 0 || trace.stamps[to] == 0)
+        return -1;
+    return trace.stamps[to] - trace.stamps[from];
+}
+
+/** Point the handler took over the request: dequeued, or received when it ran on the event loop */
+static int TraceHandlerStart(const HTTPTrace& trace)
+{
+    return trace.stamps[HTTP_TRACE_DEQUEUED] ? HTTP_TRACE_DEQUEUED : HTTP_TRACE_RECEIVED;
+}
+
+std::string HTTPServerTimingHeader(const HTTPTrace& trace)
+{
+    const struct {
+        const char* name;
+        int from;
+        int to;
+    } metrics[] = {
+        {"read", HTTP_TRACE_HEADERS, HTTP_TRACE_RECEIVED},
+        {"queue", HTTP_TRACE_ENQUEUED, HTTP_TRACE_DEQUEUED},
+        {"handler", TraceHandlerStart(trace), HTTP_TRACE_REPLY},
+        {"exec", HTTP_TRACE_EXEC_START, HTTP_TRACE_EXEC_END},
+        {"total", HTTP_TRACE_RECEIVED, HTTP_TRACE_REPLY},
+    };
+    std::string header;
+    for (const auto& metric : metrics) {
+        const int64_t nNanos = TraceSpan(trace, metric.from, metric.to);
+        if (nNanos < 0)
+            continue;
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%s%s;dur=%.3f", header.empty() ? "" : ", ", metric.name, nNanos / 1e6);
+        header += buf;
+    }
+    return header;
+}
+
+std::string HTTPTraceResponseHeader(const HTTPTrace& trace)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "00-%016llx%016llx-%016llx-%02x", (unsigned long long)trace.traceIdHigh,
+             (unsigned long long)trace.traceIdLow, (unsigned long long)trace.spanId, trace.flags);
+    return buf;
+}
+
+void HTTPTraceCommit(const HTTPTrace& trace)
+{
+    uint64_t words[HTTP_TRACE_WORDS] = {};
+    memcpy(words, &trace, sizeof(trace));
+    const uint64_t n = nTracesCommitted.fetch_add(1, std::memory_order_relaxed);
+    HTTPTraceSlot& slot = traceRing[n % HTTP_TRACE_RING_SIZE];
+    slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < HTTP_TRACE_WORDS; i++)
+        slot.words[i].store(words[i], std::memory_order_relaxed);
+    slot.seq.store(2 * n + 2, std::memory_order_release);
+}
+
+/** Copy trace n out of the ring; false if it was overwritten or is still being written */
+static bool ReadTrace(uint64_t n, HTTPTrace& trace)
+{
+    const HTTPTraceSlot& slot = traceRing[n % HTTP_TRACE_RING_SIZE];
+    const uint64_t nSeq = slot.seq.load(std::memory_order_acquire);
+    if (nSeq != 2 * n + 2)
+        return false;
+    uint64_t words[HTTP_TRACE_WORDS];
+    for (size_t i = 0; i < HTTP_TRACE_WORDS; i++)
+        words[i] = slot.words[i].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) != nSeq)
+        return false;
+    memcpy(&trace, words, sizeof(trace));
+    return true;
+}
+
+static void JSONEscape(std::string& out, const char* s)
+{
+    for (; *s; s++) {
+        const unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+}
+
+/** Append a complete ("X") event to a Chrome trace */
+static void ChromeEvent(std::string& out, const char* name, uint64_t nRow, int64_t nStart, int64_t nDuration,
+                        const std::string& args = "")
+{
+    char buf[128];
+    if (out.back() != '[')
+        out += ",\n";
+    out += "{\"name\":\"";
+    JSONEscape(out, name);
+    snprintf(buf, sizeof(buf), "\",\"cat\":\"http\",\"ph\":\"X\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f",
+             (unsigned long long)nRow, nStart / 1e3, nDuration / 1e3);
+    out += buf;
+    if (!args.empty())
+        out += ",\"args\":{" + args + "}";
+    out += "}";
+}
+
+std::string HTTPTraceDumpChrome()
+{
+    // Phases shown under each request, in the order they happen
+    static const struct {
+        const char* name;
+        int from;
+        int to;
+    } phases[] = {
+        {"accept", HTTP_TRACE_ACCEPT, HTTP_TRACE_RECEIVED},
+        {"read", HTTP_TRACE_HEADERS, HTTP_TRACE_RECEIVED},
+        {"route", HTTP_TRACE_RECEIVED, HTTP_TRACE_ENQUEUED},
+        {"queue", HTTP_TRACE_ENQUEUED, HTTP_TRACE_DEQUEUED},
+        {"handler", HTTP_TRACE_DEQUEUED, HTTP_TRACE_REPLY},
+        {"exec", HTTP_TRACE_EXEC_START, HTTP_TRACE_EXEC_END},
+        {"send", HTTP_TRACE_REPLY, HTTP_TRACE_FLUSHED},
+    };
+
+    std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    const uint64_t nEnd = nTracesCommitted.load(std::memory_order_acquire);
+    const uint64_t nBegin = nEnd > HTTP_TRACE_RING_SIZE ? nEnd - HTTP_TRACE_RING_SIZE : 0;
+    for (uint64_t n = nBegin; n < nEnd; n++) {
+        HTTPTrace trace;
+        if (!ReadTrace(n, trace))
+            continue;
+        int first = 0, last = HTTP_TRACE_POINTS - 1;
+        while (first < last && trace.stamps[first] == 0)
+            first++;
+        while (last > first && trace.stamps[last] == 0)
+            last--;
+        if (trace.stamps[first] == 0)
+            continue;
+
+        char args[192];
+        snprintf(args, sizeof(args),
+                 "\"trace_id\":\"%016llx%016llx\",\"span_id\":\"%016llx\",\"parent_id\":\"%016llx\",\"status\":%d",
+                 (unsigned long long)trace.traceIdHigh, (unsigned long long)trace.traceIdLow,
+                 (unsigned long long)trace.spanId, (unsigned long long)trace.parentId, trace.nStatus);
+        const std::string name = std::string(trace.method) + " " + trace.uri;
+        ChromeEvent(out, name.c_str(), n, trace.stamps[first], trace.stamps[last] - trace.stamps[first], args);
+        for (const auto& phase : phases) {
+            const int64_t nNanos = TraceSpan(trace, phase.from, phase.to);
+            if (nNanos >= 0)
+                ChromeEvent(out, phase.name, n, trace.stamps[phase.from], nNanos);
+        }
+    }
+    out += "]}\n";
+    return out;
+}
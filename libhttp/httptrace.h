@@ -0,0 +1,73 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_HTTPTRACE_H
+#define BITCOIN_HTTPTRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/** Traces kept for export; older ones are overwritten */
+static const size_t HTTP_TRACE_RING_SIZE = 1024;
+
+/** Points in the life of a request that a trace records */
+enum HTTPTracePoint
+{
+    HTTP_TRACE_ACCEPT,     //!< connection accepted; first request of a connection only
+    HTTP_TRACE_HEADERS,    //!< headers parsed; libevent 2.1 does not tell, so not set yet
+    HTTP_TRACE_RECEIVED,   //!< request read in full
+    HTTP_TRACE_ENQUEUED,   //!< handed to the work queue
+    HTTP_TRACE_DEQUEUED,   //!< taken up by a worker
+    HTTP_TRACE_EXEC_START, //!< handler started the actual work, e.g. a RPC command; optional
+    HTTP_TRACE_EXEC_END,
+    HTTP_TRACE_REPLY,      //!< handler replied
+    HTTP_TRACE_FLUSHED,    //!< reply handed to libevent by the event loop
+    HTTP_TRACE_POINTS
+};
+
+/**
+ * Trace of one request: std::chrono::steady_clock timestamps in
+ * nanoseconds, 0 where a point was not passed, and the W3C trace context it
+ * belongs to. Plain data, so it can be copied in and out of the trace ring
+ * word by word.
+ */
+struct HTTPTrace
+{
+    int64_t stamps[HTTP_TRACE_POINTS];
+    uint64_t traceIdHigh;
+    uint64_t traceIdLow;
+    uint64_t spanId;      //!< our span, reported in traceresponse
+    uint64_t parentId;    //!< the caller's span from traceparent, 0 if none
+    int32_t nStatus;
+    uint8_t flags;        //!< trace flags; bit 0 is "sampled"
+    bool fServerTiming;   //!< client asked for a Server-Timing header
+    char method[8];
+    char uri[64];         //!< truncated
+};
+
+/** Start a trace of a request with the given method and URI. Adopts the
+ * trace id and sampling decision of a valid W3C traceparent header;
+ * otherwise a new trace id is made up and the trace is sampled if fSample.
+ */
+void HTTPTraceInit(HTTPTrace& trace, const char* method, const char* uri, const char* traceparent, bool fSample);
+
+/** Whether a trace goes into the ring once its request is done */
+inline bool HTTPTraceSampled(const HTTPTrace& trace) { return trace.flags & 1; }
+
+/** Value of the Server-Timing header of a trace, from the points passed so far */
+std::string HTTPServerTimingHeader(const HTTPTrace& trace);
+/** Value of the traceresponse header of a trace, for the client to correlate */
+std::string HTTPTraceResponseHeader(const HTTPTrace& trace);
+
+/** Add a finished trace to the ring. Lock-free; a writer never waits */
+void HTTPTraceCommit(const HTTPTrace& trace);
+
+/** The traces in the ring, oldest first, as Chrome trace-event JSON
+ * (chrome://tracing, Perfetto). Every request is a row with its phases
+ * nested below it.
+ */
+std::string HTTPTraceDumpChrome();
+
+#endif // BITCOIN_HTTPTRACE_H
@@ -0,0 +1,203 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_LOCKFREEQUEUE_H
+#define BITCOIN_LOCKFREEQUEUE_H
+
+#include <atomic>
+#include <climits>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif
+
+/** Bounded multi-producer multi-consumer queue (Dmitry Vyukov's ring buffer).
+ * Every cell carries a sequence number that tells producers and consumers
+ * whether it is free for the current lap, so both sides only contend on
+ * their own position counter and never take a lock or allocate.
+ * The capacity is rounded up to a power of two.
+ */
+template <typename T>
+class MPMCQueue
+{
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+    static const size_t CACHE_LINE = 64;
+
+    std::unique_ptr<Cell[]> buffer;
+    size_t mask;
+    char pad0[CACHE_LINE];
+    std::atomic<size_t> enqueuePos;
+    char pad1[CACHE_LINE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> dequeuePos;
+    char pad2[CACHE_LINE - sizeof(std::atomic<size_t>)];
+
+    static size_t RoundUp(size_t n)
+    {
+        size_t r = 2;
+        while (r < n)
+            r <<= 1;
+        return r;
+    }
+
+public:
+    explicit MPMCQueue(size_t capacity) : buffer(new Cell[RoundUp(capacity)]),
+                                          mask(RoundUp(capacity) - 1),
+                                          enqueuePos(0),
+                                          dequeuePos(0)
+    {
+        for (size_t i = 0; i <= mask; i++)
+            buffer[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    MPMCQueue(const MPMCQueue&) = delete;
+    MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+    /** Append an element; returns false if the queue is full */
+    bool TryPush(T data)
+    {
+        Cell* cell;
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &buffer[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(data);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Remove the oldest element; returns false if the queue is empty */
+    bool TryPop(T& data)
+    {
+        Cell* cell;
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &buffer[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        data = std::move(cell->data);
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Approximate number of queued elements */
+    size_t Size() const
+    {
+        size_t head = dequeuePos.load(std::memory_order_relaxed);
+        size_t tail = enqueuePos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    size_t Capacity() const
+    {
+        return mask + 1;
+    }
+};
+
+/** Event count: lets consumers of a lock-free structure sleep when it is
+ * empty without putting a lock on the producer side. A consumer calls
+ * PrepareWait(), re-checks its condition and then either CancelWait()s or
+ * Wait()s with the returned key. Producers call NotifyOne()/NotifyAll()
+ * after publishing; this is a single load when nobody is waiting.
+ * Sleeping is done on a futex on Linux.
+ */
+class EventCount
+{
+private:
+    std::atomic<uint32_t> epoch;
+    std::atomic<int> waiters;
+#ifndef __linux__
+    std::mutex cs;
+    std::condition_variable cond;
+#endif
+
+    void Wake(int count)
+    {
+        epoch.fetch_add(1, std::memory_order_seq_cst);
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+#else
+        std::lock_guard<std::mutex> lock(cs);
+        if (count == 1)
+            cond.notify_one();
+        else
+            cond.notify_all();
+#endif
+    }
+
+public:
+    EventCount() : epoch(0), waiters(0) {}
+
+    uint32_t PrepareWait()
+    {
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return epoch.load(std::memory_order_seq_cst);
+    }
+
+    void CancelWait()
+    {
+        waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    void Wait(uint32_t key)
+    {
+#ifdef __linux__
+        while (epoch.load(std::memory_order_acquire) == key)
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAIT_PRIVATE, key, nullptr, nullptr, 0);
+#else
+        std::unique_lock<std::mutex> lock(cs);
+        while (epoch.load(std::memory_order_acquire) == key)
+            cond.wait(lock);
+#endif
+        waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    void NotifyOne()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) > 0)
+            Wake(1);
+    }
+
+    void NotifyAll()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) > 0)
+            Wake(INT_MAX);
+    }
+};
+
+#endif // BITCOIN_LOCKFREEQUEUE_H
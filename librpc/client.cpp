@@ -66,6 +66,10 @@ void http_request_done(struct evhttp_request *req, void *ctx)
 
     reply->status = evhttp_request_get_response_code(req);
 
+    const char* contentType = evhttp_find_header(evhttp_request_get_input_headers(req), "Content-Type");
+    if (contentType)
+        reply->contentType = contentType;
+
     struct evbuffer *buf = evhttp_request_get_input_buffer(req);
     if (buf) 
     {
@@ -76,7 +80,7 @@ void http_request_done(struct evhttp_request *req, void *ctx)
     }
 }
 
-json CallRPC(const std::string &strMethod, const json &params) 
+json CallRPC(const std::string &strMethod, const json &params, RPCEncoding encoding)
 {
     std::string host = "127.0.0.1";
     // In preference order, we choose the following for the port:
@@ -113,10 +117,15 @@ json CallRPC(const std::string &strMethod, const json &params)
     assert(output_headers);
     evhttp_add_header(output_headers, "Host", host.c_str());
     evhttp_add_header(output_headers, "Connection", "close");
+    evhttp_add_header(output_headers, "Content-Type", RPCEncodingMediaType(encoding));
+    evhttp_add_header(output_headers, "Accept", RPCEncodingMediaType(encoding));
     //evhttp_add_header( output_headers, "Authorization", (std::string("Basic ") + EncodeBase64(strRPCUserColonPass)).c_str());
 
     // Attach request data
-    std::string strRequest = JSONRPCRequestObj(strMethod, params, 1).dump() + "\n";
+    std::string strRequest;
+    RPCEncode(nlohmann::detail::output_adapter<char>(strRequest), JSONRPCRequestObj(strMethod, params, 1), encoding);
+    if (encoding == RPC_ENCODING_JSON)
+        strRequest += "\n";
     struct evbuffer *output_buffer = evhttp_request_get_output_buffer(req.get());
     assert(output_buffer);
     evbuffer_add(output_buffer, strRequest.data(), strRequest.size());
@@ -157,7 +166,8 @@ json CallRPC(const std::string &strMethod, const json &params)
     }
 
     // Parse reply
-    json json_reply = json::parse(response.body);
+    json json_reply = RPCDecode(nlohmann::detail::input_adapter(response.body.data(), response.body.size()),
+                                RPCEncodingFromContentType(response.contentType));
    
     return json_reply;
 }
@@ -7,13 +7,18 @@
 #define BITCOIN_RPCCLIENT_H
 
 #include "json.hpp"
+#include "protocol.h"
 #include <functional>
 
 using json = nlohmann::json;
 // Exit codes are EXIT_SUCCESS, EXIT_FAILURE, CONTINUE_EXECUTION 
 static const int CONTINUE_EXECUTION = -1;  
 
-json CallRPC(const std::string &strMethod, const json &params); 
+/** Call a method on the server. The request is sent, and the reply asked
+ * for, in encoding; a reply in another encoding is decoded according to
+ * its Content-Type.
+ */
+json CallRPC(const std::string &strMethod, const json &params, RPCEncoding encoding = RPC_ENCODING_JSON);
 
 //
 // Exception thrown on connection error.  This error is used to determine when
@@ -31,6 +36,7 @@ struct HTTPReply
 
     int status;
     int error;
+    std::string contentType;
     std::string body;
 };
 
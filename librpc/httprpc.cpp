@@ -4,14 +4,24 @@
 
 #include "httprpc.h"
 #include <libhttp/httpserver.h>
+#include "jsonstream.h"
 #include "protocol.h"
+#include "rpcslowlog.h"
+#include "rpcstats.h"
 #include "server.h"
 #include <stdio.h>
+#include <istream>
 #include <memory>
 #include <boost/algorithm/string.hpp> // boost::trim
 
 /** WWW-Authenticate to present with 401 Unauthorized response */
 static const char* WWW_AUTH_HEADER_DATA = "Basic realm=\"jsonrpc\"";
+/** Replies to a stream are collected up to this size before being sent */
+static const size_t STREAM_REPLY_CHUNK_SIZE = 64 * 1024;
+/** Replies growing past this size are streamed to the client while they are
+ * being serialized, so that their size does not matter
+ */
+static const size_t REPLY_STREAM_THRESHOLD = 1024 * 1024;
 
 /** Simple one-shot callback timer to be used by the RPC mechanism to e.g.
  * re-lock the wallet.
@@ -54,8 +64,79 @@ private:
 static std::string strRPCUserColonPass;
 /* Stored RPC timer interface (for unregistration) */
 static std::unique_ptr<HTTPRPCTimerInterface> httpRPCTimerInterface;
+/* Limits on executing batches, set by StartHTTPRPC */
+static RPCBatchOptions rpcBatchOptions;
+/* Closes slow log windows and dumps them, off the request path */
+static std::unique_ptr<HTTPEvent> slowLogTimer;
 
-static void JSONErrorReply(HTTPRequest* req, const json& objError, const json& id)
+/** Let the slow log close and dump its window, then fire again just after
+ * the next window ends. Runs on the event loop.
+ */
+static void SlowLogTimerFired()
+{
+    const int64_t nMicros = RPCSlowLogTick(RPCStatsNow()) / 1000 + 1000;
+    struct timeval tv;
+    tv.tv_sec = nMicros / 1000000;
+    tv.tv_usec = nMicros % 1000000;
+    slowLogTimer->trigger(&tv);
+}
+
+/** JSON serializer output writing straight into a reply body. With a
+ * stream threshold, a large body is sent as a chunked HTTP_OK reply while
+ * it is written; see HTTPReplyWriter::StreamFrom.
+ */
+class HTTPReplyOutputAdapter : public nlohmann::detail::output_adapter_protocol<char>
+{
+public:
+    explicit HTTPReplyOutputAdapter(HTTPRequest& req, size_t nStreamThreshold = 0) : writer(req), nWritten(0)
+    {
+        if (nStreamThreshold > 0)
+            writer.StreamFrom(nStreamThreshold, HTTP_OK);
+    }
+
+    void write_character(char c) override
+    {
+        writer.Write(c);
+        nWritten++;
+    }
+
+    void write_characters(const char* s, std::size_t length) override
+    {
+        writer.Write(s, length);
+        nWritten += length;
+    }
+
+    /** Bytes written so far */
+    size_t Written() const { return nWritten; }
+
+private:
+    HTTPReplyWriter writer;
+    size_t nWritten;
+};
+
+/** Send a JSON-RPC reply, serialized in place into the reply body in
+ * encoding. The Content-Type header must have been written.
+ */
+static void JSONWriteReply(HTTPRequest* req, int nStatus, const json& result, const json& error, const json& id,
+                           RPCEncoding encoding = RPC_ENCODING_JSON)
+{
+    if (req->ReplyStarted()) {
+        // Too late to report the error: cut the streamed reply short
+        req->EndReply();
+        return;
+    }
+    // Drop a partial result, and serialize in place; the adapter, and with
+    // it the writer, is gone before the reply is sent
+    req->DiscardReplyBody();
+    if (encoding == RPC_ENCODING_JSON)
+        JSONRPCWriteReply(std::make_shared<HTTPReplyOutputAdapter>(*req), result, error, id);
+    else
+        RPCEncode(std::make_shared<HTTPReplyOutputAdapter>(*req), JSONRPCReplyObj(result, error, id), encoding);
+    req->WriteReply(nStatus);
+}
+
+static void JSONErrorReply(HTTPRequest* req, const json& objError, const json& id,
+                           RPCEncoding encoding = RPC_ENCODING_JSON)
 {
     // Send error reply from json-rpc error object
     int nStatus = HTTP_INTERNAL_SERVER_ERROR;
@@ -67,10 +148,7 @@ static void JSONErrorReply(HTTPRequest* req, const json& objError, const json& i
         nStatus = HTTP_NOT_FOUND;
 
     json Nulljson;
-    std::string strReply = JSONRPCReply(Nulljson, objError, id);
-
-    req->WriteHeader("Content-Type", "application/json");
-    req->WriteReply(nStatus, strReply);
+    JSONWriteReply(req, nStatus, Nulljson, objError, id, encoding);
 }
 
 //This function checks username and password against -rpcauth
@@ -163,55 +241,149 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
         return false;
     }
 */
+    // The request is decoded according to its Content-Type, and the reply
+    // encoded as the client Accepts, by default like the request
+    const RPCEncoding encoding = RPCEncodingFromContentType(req->GetHeader("content-type").second);
+    const RPCEncoding replyEncoding = RPCEncodingFromAccept(req->GetHeader("accept").second, encoding);
+    req->WriteHeader("Content-Type", RPCEncodingMediaType(replyEncoding));
     try {
-        // Parse request
-        json valRequest = json::parse(req->ReadBody());
-        //if (!valRequest.read(req->ReadBody()))
-        if(!valRequest.is_object())
-            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+        json valRequest;
+        bool fSingle = false;
+        if (encoding != RPC_ENCODING_JSON) {
+            HTTPBodyStream body(*req);
+            std::istream bodyStream(&body);
+            jreq.nBytesIn = body.size();
+            valRequest = RPCDecode(bodyStream, encoding);
+            if (valRequest.is_object()) {
+                jreq.parse(std::move(valRequest));
+                fSingle = true;
+            }
+        } else {
+            // Decode a single request straight from the body segments
+            HTTPBodyStream body(*req);
+            std::istream bodyStream(&body);
+            jreq.nBytesIn = body.size();
+            fSingle = jreq.parse(bodyStream, valRequest);
+        }
 
         // Set the URI
         jreq.URI = req->GetURI();
+        jreq.nReceivedTime = req->GetReceivedTime();
         json Nulljson;
 
         std::string strReply;
         // singleton request
-        if (valRequest.is_object()) {
-            jreq.parse(valRequest);
-
-            json result = tableRPC.execute(jreq);
+        if (fSingle) {
+            // Execute, serializing the reply in place, and streaming it if it
+            // gets large
+            auto out = std::make_shared<HTTPReplyOutputAdapter>(*req, REPLY_STREAM_THRESHOLD);
+            req->TraceMark(HTTP_TRACE_EXEC_START);
+            if (replyEncoding == RPC_ENCODING_JSON)
+                tableRPC.execute(jreq, out);
+            else
+                RPCEncode(out, JSONRPCReplyObj(tableRPC.execute(jreq), json(), jreq.id), replyEncoding);
+            req->TraceMark(HTTP_TRACE_EXEC_END);
+            const size_t nBytesOut = out->Written();
+            out.reset();
 
             // Send reply
-            strReply = JSONRPCReply(result, Nulljson, jreq.id);
+            if (req->ReplyStarted())
+                req->EndReply();
+            else
+                req->WriteReply(HTTP_OK);
+            RPCStatsRecordReply(nBytesOut, true);
+            return true;
 
         // array of requests
-        } else if (valRequest.is_array())
-            strReply = valRequest;//JSONRPCExecBatch(jreq, valRequest.get_array());
-        else
+        } else if (valRequest.is_array()) {
+            req->TraceMark(HTTP_TRACE_EXEC_START);
+            strReply = JSONRPCExecBatch(jreq, valRequest, rpcBatchOptions, HTTPSubmitWork, replyEncoding);
+            req->TraceMark(HTTP_TRACE_EXEC_END);
+        } else
             throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
 
-        req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strReply);
+        req->WriteReply(HTTP_OK, std::move(strReply));
     } catch (const json& objError) {
-        JSONErrorReply(req, objError, jreq.id);
+        JSONErrorReply(req, objError, jreq.id, replyEncoding);
         return false;
     } catch (const std::exception& e) {
-        JSONErrorReply(req, JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        JSONErrorReply(req, JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id, replyEncoding);
         return false;
     }
     return true;
 }
 
-bool StartHTTPRPC()
+/** Newline-delimited JSON-RPC. The body is a sequence of requests, each
+ * executed in turn as the scanner splits it off. The replies, one per line,
+ * are collected up to STREAM_REPLY_CHUNK_SIZE and sent as the chunks of a
+ * streamed reply, so they never pile up beyond that. The body itself is
+ * received in full before the handler runs, like any other request body,
+ * so a stream is limited to the server's maximum body size of 32 MiB.
+ */
+static bool HTTPReq_JSONRPCStream(HTTPRequest* req, const std::string &)
+{
+    if (req->GetRequestMethod() != HTTPRequest::POST) {
+        req->WriteReply(HTTP_BAD_METHOD, "JSONRPC server handles only POST requests");
+        return false;
+    }
+
+    JSONRPCRequest jreq;
+    jreq.URI = req->GetURI();
+    jreq.nReceivedTime = req->GetReceivedTime();
+    std::string strReply;
+    JSONStreamScanner scanner(true, [&](const char* data, size_t len) {
+        json valRequest;
+        try {
+            valRequest = json::parse(nlohmann::detail::input_adapter(data, len));
+        } catch (const std::exception& e) {
+            strReply += JSONRPCReply(json(), JSONRPCError(RPC_PARSE_ERROR, e.what()), json());
+            return true;
+        }
+        jreq.nBytesIn = len;
+        JSONRPCExecOne(jreq, std::move(valRequest), strReply);
+        if (strReply.size() >= STREAM_REPLY_CHUNK_SIZE) {
+            // Stop once the client has gone away
+            bool fConnected = req->WriteReplyChunk(strReply.data(), strReply.size());
+            strReply.clear();
+            return fConnected;
+        }
+        return true;
+    });
+
+    req->WriteHeader("Content-Type", "application/x-ndjson");
+    req->StartReply(HTTP_OK);
+    {
+        HTTPBodyStream body(*req);
+        for (const auto& segment : body.segments()) {
+            if (!scanner.Feed(segment.first, segment.second))
+                break;
+        }
+    }
+    bool fOk = scanner.Finish();
+    if (!fOk) {
+        // Requests before the error have been answered; the rest is dropped
+        strReply += JSONRPCReply(json(), JSONRPCError(RPC_PARSE_ERROR, scanner.Error()), json());
+    }
+    if (!strReply.empty())
+        req->WriteReplyChunk(strReply.data(), strReply.size());
+    req->EndReply();
+    return fOk;
+}
+
+bool StartHTTPRPC(const RPCBatchOptions& batchOptions)
 {
+    rpcBatchOptions = batchOptions;
 //    LogPrint(BCLog::RPC, "Starting HTTP RPC server\n");
     //if (!InitRPCAuthentication())
     //    return false;
 
     RegisterHTTPHandler("/", true, HTTPReq_JSONRPC);
+    RegisterHTTPHandler("/stream", true, HTTPReq_JSONRPCStream);
     assert(EventBase());
    // httpRPCTimerInterface = MakeUnique<HTTPRPCTimerInterface>(EventBase());
     RPCSetTimerInterface(httpRPCTimerInterface.get());
+    slowLogTimer.reset(new HTTPEvent(EventBase(), false, SlowLogTimerFired));
+    SlowLogTimerFired();
     return true;
 }
 
@@ -224,6 +396,8 @@ void StopHTTPRPC()
 {
     //LogPrint(BCLog::RPC, "Stopping HTTP RPC server\n");
     UnregisterHTTPHandler("/", true);
+    UnregisterHTTPHandler("/stream", true);
+    slowLogTimer.reset();
     if (httpRPCTimerInterface) {
         RPCUnsetTimerInterface(httpRPCTimerInterface.get());
         httpRPCTimerInterface.reset();
@@ -5,12 +5,16 @@
 #ifndef BITCOIN_HTTPRPC_H
 #define BITCOIN_HTTPRPC_H
 
+#include "server.h"
+
 #include <string>
 #include <map>
 
 /** Start HTTP RPC subsystem.
- * Precondition; HTTP and RPC has been started.  */
-bool StartHTTPRPC();
+ * Precondition; HTTP and RPC has been started.
+ * Batches are spread over the HTTP worker threads within batchOptions.
+ */
+bool StartHTTPRPC(const RPCBatchOptions& batchOptions = RPCBatchOptions());
 /** Interrupt HTTP RPC subsystem.
  */
 void InterruptHTTPRPC();
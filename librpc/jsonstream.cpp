@@ -0,0 +1,307 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsonstream.h"
+
+static inline bool IsSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static inline bool IsDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline bool IsHexDigit(char c)
+{
+    return IsDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+JSONStreamScanner::JSONStreamScanner(bool _fSequence, ElementHandler _handler) :
+    fSequence(_fSequence), handler(_handler), state(VALUE), fKey(false), nUnicode(0),
+    literal(nullptr), fStarted(false), topLevel(0), fFailed(false), nElements(0), nOffset(0), fCapturing(false)
+{
+}
+
+bool JSONStreamScanner::Fail(const std::string& what)
+{
+    if (!fFailed) {
+        fFailed = true;
+        strError = "syntax error at offset " + std::to_string(nOffset) + ": " + what;
+    }
+    return false;
+}
+
+bool JSONStreamScanner::IsSplitDepth() const
+{
+    if (fSequence)
+        return stack.empty();
+    return stack.size() == 1 && stack[0] == '[';
+}
+
+bool JSONStreamScanner::BeginValue(char c, size_t pos, size_t& captureFrom)
+{
+    if (!fStarted) {
+        fStarted = true;
+        topLevel = (c == '{' || c == '[') ? c : 0;
+    }
+    if (handler && IsSplitDepth()) {
+        fCapturing = true;
+        captureFrom = pos;
+        element.clear();
+    }
+    switch (c) {
+    case '{':
+    case '[':
+        if (stack.size() >= MAX_DEPTH)
+            return Fail("nesting too deep");
+        stack.push_back(c);
+        state = c == '{' ? KEY_OR_END : VALUE_OR_END;
+        return true;
+    case '"':
+        fKey = false;
+        state = STRING;
+        return true;
+    case '-':
+        state = NUMBER_MINUS;
+        return true;
+    case '0':
+        state = NUMBER_ZERO;
+        return true;
+    case 't':
+        literal = "rue";
+        state = LITERAL;
+        return true;
+    case 'f':
+        literal = "alse";
+        state = LITERAL;
+        return true;
+    case 'n':
+        literal = "ull";
+        state = LITERAL;
+        return true;
+    default:
+        if (IsDigit(c)) {
+            state = NUMBER_INT;
+            return true;
+        }
+        return Fail(std::string("unexpected character '") + c + "'");
+    }
+}
+
+bool JSONStreamScanner::EndValue(const char* data, size_t end, size_t& captureFrom)
+{
+    state = stack.empty() ? DONE : COMMA_OR_END;
+    if (fCapturing && IsSplitDepth()) {
+        element.append(data + captureFrom, end - captureFrom);
+        fCapturing = false;
+        nElements++;
+        if (!handler(element.data(), element.size()))
+            return Fail("value rejected");
+    }
+    return true;
+}
+
+bool JSONStreamScanner::Feed(const char* data, size_t len)
+{
+    if (fFailed)
+        return false;
+    size_t captureFrom = 0;
+    const uint64_t nBase = nOffset;
+    for (size_t i = 0; i < len; i++) {
+        const char c = data[i];
+        nOffset = nBase + i;
+        bool fAgain;
+        do {
+            fAgain = false;
+            bool fOk = true;
+            switch (state) {
+            case DONE:
+                if (IsSpace(c))
+                    break;
+                if (!fSequence) {
+                    fOk = Fail("unexpected data after the value");
+                    break;
+                }
+                state = VALUE;
+                fAgain = true;
+                break;
+            case VALUE:
+            case VALUE_OR_END:
+                if (IsSpace(c))
+                    break;
+                if (c == ']' && state == VALUE_OR_END) {
+                    stack.pop_back();
+                    fOk = EndValue(data, i + 1, captureFrom);
+                    break;
+                }
+                fOk = BeginValue(c, i, captureFrom);
+                break;
+            case KEY_OR_END:
+            case KEY:
+                if (IsSpace(c))
+                    break;
+                if (c == '}' && state == KEY_OR_END) {
+                    stack.pop_back();
+                    fOk = EndValue(data, i + 1, captureFrom);
+                    break;
+                }
+                if (c != '"') {
+                    fOk = Fail("expected an object key");
+                    break;
+                }
+                fKey = true;
+                state = STRING;
+                break;
+            case COLON:
+                if (IsSpace(c))
+                    break;
+                if (c != ':') {
+                    fOk = Fail("expected ':'");
+                    break;
+                }
+                state = VALUE;
+                break;
+            case COMMA_OR_END:
+                if (IsSpace(c))
+                    break;
+                if (c == ',') {
+                    state = stack.back() == '{' ? KEY : VALUE;
+                    break;
+                }
+                if (c == (stack.back() == '{' ? '}' : ']')) {
+                    stack.pop_back();
+                    fOk = EndValue(data, i + 1, captureFrom);
+                    break;
+                }
+                fOk = Fail("expected ',' or the end of the container");
+                break;
+            case STRING:
+                if (c == '"') {
+                    if (fKey) {
+                        fKey = false;
+                        state = COLON;
+                    } else {
+                        fOk = EndValue(data, i + 1, captureFrom);
+                    }
+                } else if (c == '\\') {
+                    state = STRING_ESCAPE;
+                } else if ((unsigned char)c < 0x20) {
+                    fOk = Fail("control character in string");
+                }
+                break;
+            case STRING_ESCAPE:
+                switch (c) {
+                case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+                    state = STRING;
+                    break;
+                case 'u':
+                    nUnicode = 0;
+                    state = STRING_UNICODE;
+                    break;
+                default:
+                    fOk = Fail("invalid escape sequence");
+                }
+                break;
+            case STRING_UNICODE:
+                if (!IsHexDigit(c)) {
+                    fOk = Fail("invalid \\u escape");
+                    break;
+                }
+                if (++nUnicode == 4)
+                    state = STRING;
+                break;
+            case NUMBER_MINUS:
+                if (c == '0')
+                    state = NUMBER_ZERO;
+                else if (IsDigit(c))
+                    state = NUMBER_INT;
+                else
+                    fOk = Fail("invalid number");
+                break;
+            case NUMBER_ZERO:
+            case NUMBER_INT:
+                if (IsDigit(c) && state == NUMBER_INT)
+                    break;
+                if (c == '.') {
+                    state = NUMBER_DOT;
+                } else if (c == 'e' || c == 'E') {
+                    state = NUMBER_EXP;
+                } else {
+                    fOk = EndValue(data, i, captureFrom);
+                    fAgain = true;
+                }
+                break;
+            case NUMBER_DOT:
+                if (IsDigit(c))
+                    state = NUMBER_FRAC;
+                else
+                    fOk = Fail("invalid number");
+                break;
+            case NUMBER_FRAC:
+                if (IsDigit(c))
+                    break;
+                if (c == 'e' || c == 'E') {
+                    state = NUMBER_EXP;
+                } else {
+                    fOk = EndValue(data, i, captureFrom);
+                    fAgain = true;
+                }
+                break;
+            case NUMBER_EXP:
+                if (c == '+' || c == '-')
+                    state = NUMBER_EXP_SIGN;
+                else if (IsDigit(c))
+                    state = NUMBER_EXP_DIGITS;
+                else
+                    fOk = Fail("invalid number");
+                break;
+            case NUMBER_EXP_SIGN:
+                if (IsDigit(c))
+                    state = NUMBER_EXP_DIGITS;
+                else
+                    fOk = Fail("invalid number");
+                break;
+            case NUMBER_EXP_DIGITS:
+                if (IsDigit(c))
+                    break;
+                fOk = EndValue(data, i, captureFrom);
+                fAgain = true;
+                break;
+            case LITERAL:
+                if (c != *literal) {
+                    fOk = Fail("invalid literal");
+                    break;
+                }
+                if (*++literal == 0)
+                    fOk = EndValue(data, i + 1, captureFrom);
+                break;
+            }
+            if (!fOk)
+                return false;
+        } while (fAgain);
+    }
+    if (fCapturing)
+        element.append(data + captureFrom, len - captureFrom);
+    nOffset = nBase + len;
+    return true;
+}
+
+bool JSONStreamScanner::Finish()
+{
+    if (fFailed)
+        return false;
+    if (stack.empty() && (state == NUMBER_ZERO || state == NUMBER_INT ||
+                          state == NUMBER_FRAC || state == NUMBER_EXP_DIGITS)) {
+        size_t captureFrom = 0;
+        if (!EndValue(nullptr, 0, captureFrom))
+            return false;
+    }
+    if (state == DONE)
+        return true;
+    if (fSequence && state == VALUE && stack.empty())
+        return true;
+    return Fail("unexpected end of input");
+}
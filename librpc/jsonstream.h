@@ -0,0 +1,102 @@
+// Copyright (c) 2015-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RPCJSONSTREAM_H
+#define BITCOIN_RPCJSONSTREAM_H
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/** Incremental JSON scanner.
+ * Checks the syntax of a JSON text fed to it in arbitrary pieces, without
+ * building anything, so that malformed input is rejected at the first bad
+ * byte while the rest is still arriving.
+ *
+ * It also splits the input into values that can be parsed on their own:
+ * the elements of a top-level array, or, in sequence mode, every top-level
+ * value of a stream of whitespace-separated values (e.g. newline-delimited
+ * JSON). The text of each such value is passed to the element handler as
+ * soon as it is complete, so only one value has to be buffered at a time.
+ */
+class JSONStreamScanner
+{
+public:
+    /** Handler for a complete value; return false to stop scanning */
+    typedef std::function<bool(const char* data, size_t len)> ElementHandler;
+
+    /** Maximum nesting depth accepted */
+    static const size_t MAX_DEPTH = 512;
+
+    explicit JSONStreamScanner(bool fSequence = false, ElementHandler handler = nullptr);
+
+    /** Scan the next piece of input. Returns false on a syntax error or if
+     * the element handler asked to stop; nothing more is accepted after that.
+     */
+    bool Feed(const char* data, size_t len);
+    /** Signal the end of the input. Returns false if it ends mid-value. */
+    bool Finish();
+
+    bool Failed() const { return fFailed; }
+    const std::string& Error() const { return strError; }
+
+    /** Type of the (first) top-level value: '{', '[', or 0 for a scalar or
+     * when nothing was seen yet.
+     */
+    char TopLevel() const { return topLevel; }
+    /** Number of complete values passed to the element handler */
+    uint64_t Elements() const { return nElements; }
+    /** Number of bytes scanned */
+    uint64_t Offset() const { return nOffset; }
+
+private:
+    enum State {
+        VALUE,              //!< expecting a value
+        VALUE_OR_END,       //!< after '[': a value or ']'
+        KEY_OR_END,         //!< after '{': a key or '}'
+        KEY,                //!< after ',' in an object
+        COLON,              //!< after a key
+        COMMA_OR_END,       //!< after a value in a container
+        STRING,
+        STRING_ESCAPE,
+        STRING_UNICODE,
+        NUMBER_MINUS,
+        NUMBER_ZERO,
+        NUMBER_INT,
+        NUMBER_DOT,
+        NUMBER_FRAC,
+        NUMBER_EXP,
+        NUMBER_EXP_SIGN,
+        NUMBER_EXP_DIGITS,
+        LITERAL,
+        DONE,               //!< top-level value complete
+    };
+
+    bool fSequence;
+    ElementHandler handler;
+    State state;
+    std::vector<char> stack;
+    bool fKey;
+    int nUnicode;
+    const char* literal;
+    bool fStarted;
+    char topLevel;
+    bool fFailed;
+    std::string strError;
+    uint64_t nElements;
+    uint64_t nOffset;
+
+    // Value being captured for the element handler
+    bool fCapturing;
+    std::string element;
+
+    bool Fail(const std::string& what);
+    bool BeginValue(char c, size_t pos, size_t& captureFrom);
+    bool EndValue(const char* data, size_t end, size_t& captureFrom);
+    bool IsSplitDepth() const;
+};
+
+#endif // BITCOIN_RPCJSONSTREAM_H
@@ -6,7 +6,9 @@
 #include "protocol.h"
 #include "fs.h"
 #include "json.hpp"
+#include <assert.h>
 #include <fstream>
+#include <stdlib.h>
 
 /**
  * JSON-RPC protocol.  Bitcoin speaks version 1.0 for maximum compatibility,
@@ -45,8 +47,67 @@ json JSONRPCReplyObj(const json& result, const json& error, const json& id)
 
 std::string JSONRPCReply(const json& result, const json& error, const json& id)
 {
-    json reply = JSONRPCReplyObj(result, error, id);
-    return reply.dump() + "\n";
+    std::string strReply;
+    JSONRPCWriteReply(nlohmann::detail::output_adapter<char>(strReply), result, error, id);
+    return strReply;
+}
+
+void JSONRPCWriteReply(nlohmann::detail::output_adapter_t<char> out, const json& result, const json& error, const json& id)
+{
+    // Same members as JSONRPCReplyObj, in JSON-RPC order rather than sorted
+    nlohmann::detail::serializer<json> s(out, ' ');
+    out->write_characters("{\"result\":", 10);
+    if (!error.is_null())
+        out->write_characters("{}", 2);
+    else
+        s.dump(result, false, false, 0);
+    out->write_characters(",\"error\":", 9);
+    s.dump(error, false, false, 0);
+    out->write_characters(",\"id\":", 6);
+    s.dump(id, false, false, 0);
+    out->write_characters("}\n", 2);
+}
+
+void JSONRPCWriteResultBegin(nlohmann::detail::output_adapter_t<char> out)
+{
+    out->write_characters("{\"result\":", 10);
+}
+
+void JSONRPCWriteResultEnd(nlohmann::detail::output_adapter_t<char> out, const json& id)
+{
+    nlohmann::detail::serializer<json> s(out, ' ');
+    out->write_characters(",\"error\":null,\"id\":", 19);
+    s.dump(id, false, false, 0);
+    out->write_characters("}\n", 2);
+}
+
+void JSONWriteString(nlohmann::detail::output_adapter_t<char> out, const std::string& str)
+{
+    static const char* HEX = "0123456789abcdef";
+    out->write_character('"');
+    size_t begin = 0;
+    for (size_t i = 0; i < str.size(); i++) {
+        const unsigned char c = str[i];
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        out->write_characters(str.data() + begin, i - begin);
+        begin = i + 1;
+        switch (c) {
+        case '"': out->write_characters("\\\"", 2); break;
+        case '\\': out->write_characters("\\\\", 2); break;
+        case '\b': out->write_characters("\\b", 2); break;
+        case '\f': out->write_characters("\\f", 2); break;
+        case '\n': out->write_characters("\\n", 2); break;
+        case '\r': out->write_characters("\\r", 2); break;
+        case '\t': out->write_characters("\\t", 2); break;
+        default: {
+            const char escape[6] = {'\\', 'u', '0', '0', HEX[c >> 4], HEX[c & 0xf]};
+            out->write_characters(escape, 6);
+        }
+        }
+    }
+    out->write_characters(str.data() + begin, str.size() - begin);
+    out->write_character('"');
 }
 
 json JSONRPCError(int code, const std::string& message)
@@ -59,6 +120,152 @@ json JSONRPCError(int code, const std::string& message)
     return error;
 }
 
+const char* RPCEncodingMediaType(RPCEncoding encoding)
+{
+    switch (encoding) {
+    case RPC_ENCODING_CBOR:
+        return "application/cbor";
+    case RPC_ENCODING_MSGPACK:
+        return "application/msgpack";
+    case RPC_ENCODING_JSON:
+        break;
+    }
+    return "application/json";
+}
+
+/** Media type without its parameters, trimmed and lower-cased */
+static std::string RPCBareMediaType(const std::string& str, size_t begin, size_t end)
+{
+    size_t params = str.find(';', begin);
+    if (params < end)
+        end = params;
+    while (begin < end && (str[begin] == ' ' || str[begin] == '\t'))
+        begin++;
+    while (end > begin && (str[end - 1] == ' ' || str[end - 1] == '\t'))
+        end--;
+    std::string type = str.substr(begin, end - begin);
+    for (char& c : type)
+        c = tolower(c);
+    return type;
+}
+
+/** Encoding named by a bare media type */
+static bool RPCEncodingFromMediaType(const std::string& type, RPCEncoding& encoding)
+{
+    if (type == "application/json" || type == "text/plain") {
+        encoding = RPC_ENCODING_JSON;
+    } else if (type == "application/cbor") {
+        encoding = RPC_ENCODING_CBOR;
+    } else if (type == "application/msgpack" || type == "application/x-msgpack") {
+        encoding = RPC_ENCODING_MSGPACK;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+RPCEncoding RPCEncodingFromContentType(const std::string& contentType)
+{
+    RPCEncoding encoding;
+    if (RPCEncodingFromMediaType(RPCBareMediaType(contentType, 0, contentType.size()), encoding))
+        return encoding;
+    return RPC_ENCODING_JSON;
+}
+
+RPCEncoding RPCEncodingFromAccept(const std::string& accept, RPCEncoding fallback)
+{
+    RPCEncoding best = fallback;
+    double bestQ = 0;
+    for (size_t begin = 0; begin < accept.size();) {
+        size_t end = accept.find(',', begin);
+        if (end == std::string::npos)
+            end = accept.size();
+        RPCEncoding encoding;
+        if (RPCEncodingFromMediaType(RPCBareMediaType(accept, begin, end), encoding)) {
+            double q = 1;
+            size_t pos = accept.find("q=", begin);
+            if (pos < end)
+                q = atof(accept.c_str() + pos + 2);
+            if (q > bestQ) {
+                best = encoding;
+                bestQ = q;
+            }
+        }
+        begin = end + 1;
+    }
+    return best;
+}
+
+void RPCEncode(nlohmann::detail::output_adapter_t<char> out, const json& value, RPCEncoding encoding)
+{
+    switch (encoding) {
+    case RPC_ENCODING_CBOR:
+        nlohmann::detail::binary_writer<json, char>(out).write_cbor(value);
+        return;
+    case RPC_ENCODING_MSGPACK:
+        nlohmann::detail::binary_writer<json, char>(out).write_msgpack(value);
+        return;
+    case RPC_ENCODING_JSON:
+        break;
+    }
+    nlohmann::detail::serializer<json> s(out, ' ');
+    s.dump(value, false, false, 0);
+}
+
+json RPCDecode(nlohmann::detail::input_adapter input, RPCEncoding encoding)
+{
+    switch (encoding) {
+    case RPC_ENCODING_CBOR:
+        return json::from_cbor(std::move(input));
+    case RPC_ENCODING_MSGPACK:
+        return json::from_msgpack(std::move(input));
+    case RPC_ENCODING_JSON:
+        break;
+    }
+    return json::parse(std::move(input));
+}
+
+void RPCWriteArrayHeader(std::string& out, uint64_t n, RPCEncoding encoding)
+{
+    int nLengthBytes;
+    if (encoding == RPC_ENCODING_CBOR) {
+        // Major type 4, the length inline or in the 1, 2, 4 or 8 bytes after
+        if (n < 24) {
+            out += char(0x80 + n);
+            return;
+        }
+        if (n <= 0xff) {
+            out += char(0x98);
+            nLengthBytes = 1;
+        } else if (n <= 0xffff) {
+            out += char(0x99);
+            nLengthBytes = 2;
+        } else if (n <= 0xffffffff) {
+            out += char(0x9a);
+            nLengthBytes = 4;
+        } else {
+            out += char(0x9b);
+            nLengthBytes = 8;
+        }
+    } else {
+        assert(encoding == RPC_ENCODING_MSGPACK);
+        // fixarray, array 16 or array 32
+        if (n < 16) {
+            out += char(0x90 + n);
+            return;
+        }
+        if (n <= 0xffff) {
+            out += char(0xdc);
+            nLengthBytes = 2;
+        } else {
+            out += char(0xdd);
+            nLengthBytes = 4;
+        }
+    }
+    for (int i = nLengthBytes; i-- > 0;)
+        out += char((n >> (8 * i)) & 0xff);
+}
+
 /** Username used when cookie authentication is in use (arbitrary, only for
  * recognizability in debugging/logging purposes)
  */
@@ -78,6 +285,11 @@ static fs::path GetAuthCookieFile(bool temp=false)
     return path;
 }
 
+std::string GetAuthCookieSiblingFile(const std::string& name)
+{
+    return (GetAuthCookieFile().parent_path() / name).string();
+}
+
 bool GenerateAuthCookie(std::string *cookie_out)
 {
     const size_t COOKIE_SIZE = 32;
@@ -88,14 +88,58 @@ enum RPCErrorCode
 json JSONRPCRequestObj(const std::string& strMethod, const json& params, const json& id);
 json JSONRPCReplyObj(const json& result, const json& error, const json& id);
 std::string JSONRPCReply(const json& result, const json& error, const json& id);
+/** Serialize the same reply as JSONRPCReply straight into out, without
+ * building the reply object or a temporary string.
+ */
+void JSONRPCWriteReply(nlohmann::detail::output_adapter_t<char> out, const json& result, const json& error, const json& id);
+/** Write a successful reply whose result is serialized in between, by the
+ * caller, straight into out.
+ */
+void JSONRPCWriteResultBegin(nlohmann::detail::output_adapter_t<char> out);
+void JSONRPCWriteResultEnd(nlohmann::detail::output_adapter_t<char> out, const json& id);
+/** Serialize a string as a JSON string, without building a json value */
+void JSONWriteString(nlohmann::detail::output_adapter_t<char> out, const std::string& str);
 json JSONRPCError(int code, const std::string& message);
 
+/** Wire encodings of JSON-RPC requests and replies */
+enum RPCEncoding
+{
+    RPC_ENCODING_JSON,
+    RPC_ENCODING_CBOR,
+    RPC_ENCODING_MSGPACK,
+};
+
+/** Media type of an encoding, e.g. "application/cbor" */
+const char* RPCEncodingMediaType(RPCEncoding encoding);
+/** Encoding of a body with the given Content-Type. Anything that does not
+ * name a binary encoding is taken to be JSON, as clients commonly send no
+ * or a generic type.
+ */
+RPCEncoding RPCEncodingFromContentType(const std::string& contentType);
+/** Encoding to reply in for an Accept header: the supported type with the
+ * highest q-value, the first listed on a tie. fallback is returned if the
+ * header is empty or expresses no preference among the supported types.
+ */
+RPCEncoding RPCEncodingFromAccept(const std::string& accept, RPCEncoding fallback);
+/** Serialize a value into out. JSON is written compactly, without a
+ * trailing newline.
+ */
+void RPCEncode(nlohmann::detail::output_adapter_t<char> out, const json& value, RPCEncoding encoding);
+/** Parse a value, which must take up the whole input */
+json RPCDecode(nlohmann::detail::input_adapter input, RPCEncoding encoding);
+/** Append the header of an array of n elements in a binary encoding. The
+ * encoded elements follow it back to back, without separators.
+ */
+void RPCWriteArrayHeader(std::string& out, uint64_t n, RPCEncoding encoding);
+
 /** Generate a new RPC authentication cookie and write it to disk */
 bool GenerateAuthCookie(std::string *cookie_out);
 /** Read the RPC authentication cookie from disk */
 bool GetAuthCookie(std::string *cookie_out);
 /** Delete RPC authentication cookie from disk */
 void DeleteAuthCookie();
+/** Path of a file kept in the same directory as the authentication cookie */
+std::string GetAuthCookieSiblingFile(const std::string& name);
 /** Parse JSON-RPC batch reply into a vector */
 std::vector<json> JSONRPCProcessBatchReply(const json &in, size_t num);
 
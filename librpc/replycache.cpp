@@ -0,0 +1,219 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "replycache.h"
+#include "server.h"
+
+const size_t RPCReplyCache::SHARDS;
+const size_t RPCReplyCache::GENERATIONS;
+const size_t RPCReplyCache::ENTRY_OVERHEAD;
+const size_t RPCSingleFlight::SHARDS;
+
+RPCReplyCache::RPCReplyCache(size_t nMaxBytes) : nShardMaxBytes(nMaxBytes / SHARDS), nHits(0), nMisses(0),
+                                                 nInsertions(0), nEvictions(0), nExpired(0), nInvalidations(0)
+{
+    for (auto& generation : generations)
+        generation = 0;
+}
+
+std::string RPCReplyCache::Key(const JSONRPCRequest& request)
+{
+    // Object members are kept sorted, so the dump of equal parameters is the same
+    std::string key = request.URI;
+    key += '\0';
+    key += request.strMethod;
+    key += '\0';
+    key += request.params.dump();
+    return key;
+}
+
+size_t RPCReplyCache::GenerationSlot(const std::string& method)
+{
+    return RPCMethodHash(method.data(), method.size()) % GENERATIONS;
+}
+
+uint64_t RPCReplyCache::Generation(const std::string& method) const
+{
+    return generations[GenerationSlot(method)].load(std::memory_order_acquire);
+}
+
+RPCReplyCache::Shard& RPCReplyCache::ShardFor(const std::string& key)
+{
+    return shards[std::hash<std::string>()(key) % SHARDS];
+}
+
+void RPCReplyCache::Erase(Shard& shard, std::list<Entry>::iterator it)
+{
+    shard.nBytes -= it->nSize;
+    shard.index.erase(it->key);
+    shard.lru.erase(it);
+}
+
+void RPCReplyCache::MakeRoom(Shard& shard, size_t nBytes)
+{
+    const size_t nMax = nShardMaxBytes.load(std::memory_order_relaxed);
+    while (!shard.lru.empty() && shard.nBytes + nBytes > nMax) {
+        Erase(shard, std::prev(shard.lru.end()));
+        nEvictions.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+std::shared_ptr<const std::string> RPCReplyCache::Get(const std::string& key)
+{
+    Shard& shard = ShardFor(key);
+    std::lock_guard<std::mutex> lock(shard.cs);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+        nMisses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    std::list<Entry>::iterator entry = it->second;
+    if (entry->expires <= Clock::now() ||
+        entry->nGeneration != generations[entry->nGenerationSlot].load(std::memory_order_acquire)) {
+        Erase(shard, entry);
+        nExpired.fetch_add(1, std::memory_order_relaxed);
+        nMisses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, entry);
+    nHits.fetch_add(1, std::memory_order_relaxed);
+    return entry->result;
+}
+
+void RPCReplyCache::Insert(const std::string& method, const std::string& key, uint64_t nGeneration, int64_t nTTL,
+                           std::shared_ptr<const std::string> result)
+{
+    const size_t nSlot = GenerationSlot(method);
+    const size_t nSize = 2 * key.size() + result->size() + ENTRY_OVERHEAD;
+    Shard& shard = ShardFor(key);
+    // Results taking more than a fraction of a shard would only churn it
+    if (nTTL <= 0 || nSize > nShardMaxBytes.load(std::memory_order_relaxed) / 4)
+        return;
+
+    std::lock_guard<std::mutex> lock(shard.cs);
+    if (nGeneration != generations[nSlot].load(std::memory_order_acquire))
+        return; // invalidated while the result was computed
+    auto it = shard.index.find(key);
+    if (it != shard.index.end())
+        Erase(shard, it->second);
+    MakeRoom(shard, nSize);
+    shard.lru.push_front(Entry{key, std::move(result), nSlot, nGeneration,
+                               Clock::now() + std::chrono::milliseconds(nTTL), nSize});
+    shard.index.emplace(key, shard.lru.begin());
+    shard.nBytes += nSize;
+    nInsertions.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RPCReplyCache::Invalidate(const std::string& method)
+{
+    generations[GenerationSlot(method)].fetch_add(1, std::memory_order_acq_rel);
+    nInvalidations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RPCReplyCache::Clear()
+{
+    for (auto& generation : generations)
+        generation.fetch_add(1, std::memory_order_acq_rel);
+    for (Shard& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.cs);
+        shard.lru.clear();
+        shard.index.clear();
+        shard.nBytes = 0;
+    }
+    nInvalidations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RPCReplyCache::SetMaxSize(size_t nMaxBytes)
+{
+    nShardMaxBytes = nMaxBytes / SHARDS;
+    for (Shard& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.cs);
+        MakeRoom(shard, 0);
+    }
+}
+
+RPCReplyCacheStats RPCReplyCache::Stats() const
+{
+    RPCReplyCacheStats stats;
+    stats.nEntries = 0;
+    stats.nBytes = 0;
+    for (const Shard& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.cs);
+        stats.nEntries += shard.index.size();
+        stats.nBytes += shard.nBytes;
+    }
+    stats.nHits = nHits.load(std::memory_order_relaxed);
+    stats.nMisses = nMisses.load(std::memory_order_relaxed);
+    stats.nInsertions = nInsertions.load(std::memory_order_relaxed);
+    stats.nEvictions = nEvictions.load(std::memory_order_relaxed);
+    stats.nExpired = nExpired.load(std::memory_order_relaxed);
+    stats.nInvalidations = nInvalidations.load(std::memory_order_relaxed);
+    return stats;
+}
+
+std::shared_ptr<const std::string> RPCSingleFlight::Do(const std::string& method, const std::string& key,
+                                                       const Producer& produce)
+{
+    Shard& shard = shards[std::hash<std::string>()(key) % SHARDS];
+    std::shared_ptr<Call> call;
+    bool fLeader = false;
+    {
+        std::lock_guard<std::mutex> lock(shard.cs);
+        RPCCoalesceStats& stats = shard.stats.emplace(method, RPCCoalesceStats{0, 0}).first->second;
+        stats.nCalls++;
+        std::shared_ptr<Call>& running = shard.calls[key];
+        if (!running) {
+            running = std::make_shared<Call>();
+            fLeader = true;
+        } else {
+            stats.nCoalesced++;
+        }
+        call = running;
+    }
+
+    if (!fLeader) {
+        std::unique_lock<std::mutex> lock(call->cs);
+        call->cond.wait(lock, [&call] { return call->fDone; });
+        if (call->error)
+            std::rethrow_exception(call->error);
+        return call->result;
+    }
+
+    std::shared_ptr<const std::string> result;
+    std::exception_ptr error;
+    try {
+        result = produce();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    {
+        // Callers arriving from now on start a new call
+        std::lock_guard<std::mutex> lock(shard.cs);
+        shard.calls.erase(key);
+    }
+    {
+        std::lock_guard<std::mutex> lock(call->cs);
+        call->fDone = true;
+        call->result = result;
+        call->error = error;
+    }
+    call->cond.notify_all();
+    if (error)
+        std::rethrow_exception(error);
+    return result;
+}
+
+std::map<std::string, RPCCoalesceStats> RPCSingleFlight::Stats() const
+{
+    std::map<std::string, RPCCoalesceStats> stats;
+    for (const Shard& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.cs);
+        for (const auto& method : shard.stats) {
+            RPCCoalesceStats& total = stats.emplace(method.first, RPCCoalesceStats{0, 0}).first->second;
+            total.nCalls += method.second.nCalls;
+            total.nCoalesced += method.second.nCoalesced;
+        }
+    }
+    return stats;
+}
@@ -0,0 +1,178 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RPCREPLYCACHE_H
+#define BITCOIN_RPCREPLYCACHE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+static const size_t DEFAULT_RPC_REPLY_CACHE_SIZE = 32 * 1024 * 1024;
+
+class JSONRPCRequest;
+
+/** Reply cache counters */
+struct RPCReplyCacheStats
+{
+    size_t nEntries;
+    size_t nBytes;          //!< memory charged to the entries
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nInsertions;
+    uint64_t nEvictions;    //!< entries dropped to stay under the memory cap
+    uint64_t nExpired;      //!< entries dropped because their TTL passed or they were invalidated
+    uint64_t nInvalidations;
+};
+
+/**
+ * Cache of serialized command results, for read-only commands that are
+ * called over and over with the same parameters.
+ *
+ * Entries hold the result exactly as it appears in a JSON reply, so a hit
+ * costs a copy of those bytes instead of running the command and
+ * serializing its result again. The cache is split in shards, each with its
+ * own lock, LRU list and share of the memory cap.
+ *
+ * Every method has a generation number. Invalidate bumps it, which makes
+ * all entries of the method stale at once; they are dropped when next found
+ * or evicted. A caller takes the generation before executing a command and
+ * inserts the result with it, so a result computed across an invalidation
+ * is never served.
+ */
+class RPCReplyCache
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    explicit RPCReplyCache(size_t nMaxBytes = DEFAULT_RPC_REPLY_CACHE_SIZE);
+
+    /** Cache key of a request: its URI, method and canonical parameters.
+     * Named parameters must have been transformed into positional ones.
+     */
+    static std::string Key(const JSONRPCRequest& request);
+
+    /** Current generation of method, to be passed to Insert */
+    uint64_t Generation(const std::string& method) const;
+
+    /** Look up a fresh entry, nullptr if there is none */
+    std::shared_ptr<const std::string> Get(const std::string& key);
+
+    /** Insert a result that stays fresh for nTTL milliseconds, unless
+     * method was invalidated since nGeneration was taken
+     */
+    void Insert(const std::string& method, const std::string& key, uint64_t nGeneration, int64_t nTTL,
+                std::shared_ptr<const std::string> result);
+
+    /** Make every entry of method stale */
+    void Invalidate(const std::string& method);
+    /** Drop every entry */
+    void Clear();
+
+    /** Change the memory cap, evicting entries if needed */
+    void SetMaxSize(size_t nMaxBytes);
+
+    RPCReplyCacheStats Stats() const;
+
+private:
+    static const size_t SHARDS = 16;
+    //! Generation counters; methods sharing a counter invalidate each other
+    static const size_t GENERATIONS = 64;
+    //! Memory charged for an entry besides its key and result
+    static const size_t ENTRY_OVERHEAD = 128;
+
+    struct Entry
+    {
+        std::string key;
+        std::shared_ptr<const std::string> result;
+        size_t nGenerationSlot;
+        uint64_t nGeneration;
+        Clock::time_point expires;
+        size_t nSize;
+    };
+
+    struct Shard
+    {
+        mutable std::mutex cs;
+        std::list<Entry> lru; //!< most recently used first
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+        size_t nBytes = 0;
+    };
+
+    Shard shards[SHARDS];
+    std::atomic<uint64_t> generations[GENERATIONS];
+    std::atomic<size_t> nShardMaxBytes;
+
+    std::atomic<uint64_t> nHits;
+    std::atomic<uint64_t> nMisses;
+    std::atomic<uint64_t> nInsertions;
+    std::atomic<uint64_t> nEvictions;
+    std::atomic<uint64_t> nExpired;
+    std::atomic<uint64_t> nInvalidations;
+
+    static size_t GenerationSlot(const std::string& method);
+    Shard& ShardFor(const std::string& key);
+    /** Remove an entry; the shard's lock must be held */
+    void Erase(Shard& shard, std::list<Entry>::iterator it);
+    /** Evict from the cold end until nBytes more fit; the shard's lock must be held */
+    void MakeRoom(Shard& shard, size_t nBytes);
+};
+
+/** Coalescing counters of one method; the hit rate is nCoalesced / nCalls */
+struct RPCCoalesceStats
+{
+    uint64_t nCalls;     //!< calls that went through the coalescer
+    uint64_t nCoalesced; //!< calls that shared the result of one already running
+};
+
+/**
+ * Coalesces identical calls running at the same time ("single flight"):
+ * the first caller for a key executes, and callers arriving while it runs
+ * wait for it and share its serialized result, or rethrow its exception.
+ * Keys are those of RPCReplyCache.
+ */
+class RPCSingleFlight
+{
+public:
+    typedef std::function<std::shared_ptr<const std::string>()> Producer;
+
+    /** Run produce for key, or wait for the call already running it */
+    std::shared_ptr<const std::string> Do(const std::string& method, const std::string& key, const Producer& produce);
+
+    /** Counters per method */
+    std::map<std::string, RPCCoalesceStats> Stats() const;
+
+private:
+    static const size_t SHARDS = 16;
+
+    struct Call
+    {
+        std::mutex cs;
+        std::condition_variable cond;
+        bool fDone = false;
+        std::shared_ptr<const std::string> result;
+        std::exception_ptr error;
+    };
+
+    struct Shard
+    {
+        mutable std::mutex cs;
+        std::unordered_map<std::string, std::shared_ptr<Call>> calls;
+        std::unordered_map<std::string, RPCCoalesceStats> stats; //!< by method
+    };
+
+    Shard shards[SHARDS];
+};
+
+#endif // BITCOIN_RPCREPLYCACHE_H
@@ -0,0 +1,265 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcslowlog.h"
+
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <type_traits>
+
+static_assert(std::is_trivially_copyable<RPCSlowRequest>::value, "slow requests are copied word by word");
+
+/** A slow request as stored in a slot */
+static const size_t RPC_SLOW_LOG_WORDS = (sizeof(RPCSlowRequest) + 7) / 8;
+/** Key of a slot while a writer fills it; never the smallest, so never evicted */
+static const uint64_t RPC_SLOW_LOG_CLAIMED = ~uint64_t(0);
+
+/**
+ * Slot of the slow log. A writer takes a slot by swapping its key for
+ * RPC_SLOW_LOG_CLAIMED, fills it, and publishes it by storing its own key.
+ * seq is odd while the request is written, so readers can tell a torn copy.
+ */
+struct RPCSlowLogSlot
+{
+    std::atomic<uint64_t> key; //!< 0 while empty
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> words[RPC_SLOW_LOG_WORDS];
+};
+
+std::atomic<uint64_t> nRPCSlowLogThreshold(0);
+
+//! Zero-initialized as static storage
+static RPCSlowLogSlot slowLog[RPC_SLOW_LOG_SIZE];
+//! Latest window a call was recorded in
+static std::atomic<uint64_t> nSlowLogWindow(0);
+//! Last closed window, whether it still has to be dumped, and where to,
+//! guarded by cs_slowLog. Never held while writing the file.
+static std::mutex cs_slowLog;
+static RPCSlowLogWindow previousWindow = {0, {}};
+static bool fDumpPending = false;
+static std::string strSlowLogFile;
+//! Held while writing the dump file, so that writers do not interleave
+static std::mutex cs_slowLogDump;
+
+/** Wall clock time a window of the steady clock started at, in seconds since the epoch */
+static int64_t WindowStartTime(uint64_t nWindow)
+{
+    const int64_t nSteadyNow = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    const int64_t nNow = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    return nNow - (nSteadyNow - (int64_t)nWindow * RPC_SLOW_LOG_WINDOW * 1000000000) / 1000000000;
+}
+
+/** Copy out the requests of a window still in the slots, slowest first.
+ * Slots being rewritten are skipped.
+ */
+static RPCSlowLogWindow SnapshotWindow(uint64_t nWindow)
+{
+    std::vector<std::pair<uint64_t, RPCSlowRequest>> found;
+    for (const RPCSlowLogSlot& slot : slowLog) {
+        const uint64_t nSeq = slot.seq.load(std::memory_order_acquire);
+        const uint64_t nKey = slot.key.load(std::memory_order_acquire);
+        if ((nSeq & 1) || nKey == 0 || nKey == RPC_SLOW_LOG_CLAIMED || nKey >> RPC_SLOW_LOG_LATENCY_BITS != nWindow)
+            continue;
+        uint64_t words[RPC_SLOW_LOG_WORDS];
+        for (size_t i = 0; i < RPC_SLOW_LOG_WORDS; i++)
+            words[i] = slot.words[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != nSeq || slot.key.load(std::memory_order_relaxed) != nKey)
+            continue;
+        RPCSlowRequest request;
+        memcpy(&request, words, sizeof(request));
+        found.emplace_back(nKey, request);
+    }
+    std::sort(found.begin(), found.end(), [](const std::pair<uint64_t, RPCSlowRequest>& a,
+                                             const std::pair<uint64_t, RPCSlowRequest>& b) {
+        return a.first > b.first;
+    });
+
+    RPCSlowLogWindow window;
+    window.nStartTime = found.empty() ? 0 : WindowStartTime(nWindow);
+    for (const auto& entry : found)
+        window.requests.push_back(entry.second);
+    return window;
+}
+
+/** Replace the dump file with a window. Written to a temporary file first,
+ * so readers never see half of it.
+ */
+static void DumpWindow(const std::string& path, const RPCSlowLogWindow& window)
+{
+    if (path.empty())
+        return;
+    const std::string tmp = path + ".tmp";
+    std::ofstream file(tmp.c_str());
+    if (!file.is_open())
+        return;
+    file << RPCSlowLogToJSON(window).dump(1) << "\n";
+    file.close();
+    if (file.fail() || rename(tmp.c_str(), path.c_str()) != 0)
+        remove(tmp.c_str());
+}
+
+/** Keep the requests of a window that ended, for the timer to dump. A
+ * window without requests leaves the previous one in place.
+ */
+static void CloseWindow(uint64_t nWindow)
+{
+    RPCSlowLogWindow window = SnapshotWindow(nWindow);
+    if (window.requests.empty())
+        return;
+    std::lock_guard<std::mutex> lock(cs_slowLog);
+    previousWindow = std::move(window);
+    fDumpPending = true;
+}
+
+/** Make nWindow the current window, closing the one before if it is older */
+static void AdvanceWindow(uint64_t nWindow)
+{
+    uint64_t nSeen = nSlowLogWindow.load(std::memory_order_relaxed);
+    if (nWindow > nSeen && nSlowLogWindow.compare_exchange_strong(nSeen, nWindow) && nSeen != 0)
+        CloseWindow(nSeen);
+}
+
+/** Raise the threshold to the smallest key once every slot is published */
+static void RaiseThreshold()
+{
+    uint64_t nMinKey = RPC_SLOW_LOG_CLAIMED;
+    for (const RPCSlowLogSlot& slot : slowLog) {
+        const uint64_t nKey = slot.key.load(std::memory_order_relaxed);
+        if (nKey == RPC_SLOW_LOG_CLAIMED)
+            return; // its key is not known yet, leave it to its writer
+        nMinKey = std::min(nMinKey, nKey);
+    }
+    uint64_t nThreshold = nRPCSlowLogThreshold.load(std::memory_order_relaxed);
+    while (nMinKey > nThreshold && !nRPCSlowLogThreshold.compare_exchange_weak(nThreshold, nMinKey, std::memory_order_relaxed)) {
+    }
+}
+
+void RPCSlowLogRecord(uint64_t nKey, const RPCSlowRequest& request)
+{
+    // The first call of a window closes the one before, unless the timer
+    // got there first, so that the new window's calls do not evict the old
+    // one's requests before they are kept. Calls racing it may still evict
+    // some. This only copies the slots; the file is left to the timer.
+    AdvanceWindow(nKey >> RPC_SLOW_LOG_LATENCY_BITS);
+
+    uint64_t words[RPC_SLOW_LOG_WORDS] = {};
+    memcpy(words, &request, sizeof(request));
+    // Evict the fastest request, unless another writer got to it first
+    for (int nTry = 0; nTry < 8; nTry++) {
+        RPCSlowLogSlot* victim = nullptr;
+        uint64_t nVictimKey = RPC_SLOW_LOG_CLAIMED;
+        for (RPCSlowLogSlot& slot : slowLog) {
+            const uint64_t nSlotKey = slot.key.load(std::memory_order_relaxed);
+            if (nSlotKey < nVictimKey) {
+                victim = &slot;
+                nVictimKey = nSlotKey;
+            }
+        }
+        if (!victim || nKey <= nVictimKey)
+            return;
+        if (!victim->key.compare_exchange_strong(nVictimKey, RPC_SLOW_LOG_CLAIMED, std::memory_order_acquire))
+            continue;
+        const uint64_t nSeq = victim->seq.load(std::memory_order_relaxed);
+        victim->seq.store(nSeq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < RPC_SLOW_LOG_WORDS; i++)
+            victim->words[i].store(words[i], std::memory_order_relaxed);
+        victim->seq.store(nSeq + 2, std::memory_order_release);
+        victim->key.store(nKey, std::memory_order_release);
+        RaiseThreshold();
+        return;
+    }
+}
+
+RPCSlowLogWindow GetRPCSlowLog(bool fPrevious)
+{
+    if (!fPrevious)
+        return SnapshotWindow(nSlowLogWindow.load(std::memory_order_relaxed));
+    std::lock_guard<std::mutex> lock(cs_slowLog);
+    return previousWindow;
+}
+
+json RPCSlowLogToJSON(const RPCSlowLogWindow& window)
+{
+    json requests = json::array();
+    for (const RPCSlowRequest& request : window.requests) {
+        // Timeline relative to the first point known, in microseconds
+        const int64_t nBegin = request.nReceived ? request.nReceived : request.nStart;
+        char digest[17];
+        snprintf(digest, sizeof(digest), "%016llx", (unsigned long long)request.nParamsDigest);
+        json timeline = json::object();
+        if (request.nReceived)
+            timeline["received"] = 0.0;
+        timeline["exec_start"] = (request.nStart - nBegin) / 1000.0;
+        timeline["exec_end"] = (request.nEnd - nBegin) / 1000.0;
+
+        json obj = json::object();
+        obj["method"] = std::string(request.method, strnlen(request.method, sizeof(request.method)));
+        obj["params_digest"] = digest;
+        obj["bytes_in"] = request.nBytesIn;
+        obj["error_code"] = request.nErrorCode;
+        obj["time"] = request.nTime / 1e6;
+        obj["latency_us"] = (request.nEnd - nBegin) / 1000.0;
+        obj["timeline_us"] = timeline;
+        requests.push_back(obj);
+    }
+    json result = json::object();
+    result["window_start"] = window.nStartTime;
+    result["window_seconds"] = RPC_SLOW_LOG_WINDOW;
+    result["requests"] = requests;
+    return result;
+}
+
+void RPCSlowLogSetDumpFile(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(cs_slowLog);
+    strSlowLogFile = path;
+}
+
+int64_t RPCSlowLogTick(int64_t nNow)
+{
+    const int64_t nWindowNanos = RPC_SLOW_LOG_WINDOW * 1000000000;
+    const uint64_t nWindow = nNow / nWindowNanos;
+    AdvanceWindow(nWindow);
+
+    std::lock_guard<std::mutex> dumpLock(cs_slowLogDump);
+    RPCSlowLogWindow window;
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lock(cs_slowLog);
+        if (fDumpPending) {
+            window = previousWindow;
+            path = strSlowLogFile;
+            fDumpPending = false;
+        }
+    }
+    DumpWindow(path, window);
+    return (int64_t)(nWindow + 1) * nWindowNanos - nNow;
+}
+
+void RPCSlowLogFlush()
+{
+    RPCSlowLogWindow window = SnapshotWindow(nSlowLogWindow.load(std::memory_order_relaxed));
+    std::lock_guard<std::mutex> dumpLock(cs_slowLogDump);
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lock(cs_slowLog);
+        if (window.requests.empty()) {
+            // Nothing new since the last closed window; write that one if
+            // the timer has not yet
+            if (!fDumpPending)
+                return;
+            window = previousWindow;
+        }
+        path = strSlowLogFile;
+        fDumpPending = false;
+    }
+    DumpWindow(path, window);
+}
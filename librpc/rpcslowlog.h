@@ -0,0 +1,106 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RPCSLOWLOG_H
+#define BITCOIN_RPCSLOWLOG_H
+
+#include "json.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+/** Slowest calls kept per window */
+static const size_t RPC_SLOW_LOG_SIZE = 16;
+/** Length of a window in seconds */
+static const int64_t RPC_SLOW_LOG_WINDOW = 60;
+/** Name of the file closed windows are dumped to, next to the auth cookie */
+static const char* const RPC_SLOW_LOG_FILE = "rpcslow.json";
+/** Bits of a slow log key holding the latency; the window is above them */
+static const int RPC_SLOW_LOG_LATENCY_BITS = 40;
+
+/** A call caught by the slow log, with its timeline in nanoseconds of
+ * RPCStatsNow(). Plain data, stored word by word.
+ */
+struct RPCSlowRequest
+{
+    char method[32];        //!< truncated
+    uint64_t nParamsDigest; //!< FNV-1a of the serialized params, to spot repeats
+    uint64_t nBytesIn;      //!< size of the request, 0 if unknown
+    int64_t nReceived;      //!< 0 if unknown
+    int64_t nStart;
+    int64_t nEnd;
+    int64_t nTime;          //!< wall clock time execution ended, in microseconds since the epoch
+    int32_t nErrorCode;     //!< RPCErrorCode, 0 if the call succeeded
+};
+
+/** The slowest calls of one window, slowest first */
+struct RPCSlowLogWindow
+{
+    int64_t nStartTime; //!< wall clock time the window started, in seconds since the epoch; 0 if none
+    std::vector<RPCSlowRequest> requests;
+};
+
+/** Key of a call in the slow log: the window it ended in, then its latency
+ * from being received, or from starting when that is unknown. Keys of later
+ * windows sort above all keys of earlier ones.
+ */
+inline uint64_t RPCSlowLogKey(int64_t nBegin, int64_t nEnd)
+{
+    const uint64_t nMaxLatency = (uint64_t(1) << RPC_SLOW_LOG_LATENCY_BITS) - 1;
+    const uint64_t nLatency = nEnd > nBegin ? std::min<uint64_t>(nEnd - nBegin, nMaxLatency) : 1;
+    const uint64_t nWindow = nEnd / (RPC_SLOW_LOG_WINDOW * 1000000000);
+    return (nWindow << RPC_SLOW_LOG_LATENCY_BITS) | nLatency;
+}
+
+/** Smallest key in the slow log once it is full; only ever grows */
+extern std::atomic<uint64_t> nRPCSlowLogThreshold;
+
+/** Whether a call with this key makes the slow log. This is all a call that
+ * does not make it pays: a relaxed load and a compare.
+ */
+inline bool RPCSlowLogWanted(uint64_t nKey)
+{
+    return nKey > nRPCSlowLogThreshold.load(std::memory_order_relaxed);
+}
+
+/**
+ * Put a call in the slow log of its window, evicting the fastest one there.
+ * Lock-free; the first call of a new window also closes the previous one in
+ * memory, keeping it for GetRPCSlowLog. The dump file is only written by
+ * RPCSlowLogTick and RPCSlowLogFlush.
+ * Precondition: RPCSlowLogWanted(nKey).
+ */
+void RPCSlowLogRecord(uint64_t nKey, const RPCSlowRequest& request);
+
+/** The slowest calls of the current window, or of the last closed window
+ * that had any
+ */
+RPCSlowLogWindow GetRPCSlowLog(bool fPrevious);
+
+json RPCSlowLogToJSON(const RPCSlowLogWindow& window);
+
+/** Write every closed window to path, replacing its contents; an empty path
+ * stops that
+ */
+void RPCSlowLogSetDumpFile(const std::string& path);
+/**
+ * Close the current window if it is over at nNow (nanoseconds of
+ * RPCStatsNow()), even when no call came since, and write the last closed
+ * window to the dump file if that has not been done. Meant for a timer, so
+ * that the file is never written on the request path.
+ * @returns nanoseconds until the current window ends
+ */
+int64_t RPCSlowLogTick(int64_t nNow);
+/** Write the current window to the dump file, e.g. on shutdown; the last
+ * closed one if the current window has no requests yet
+ */
+void RPCSlowLogFlush();
+
+#endif // BITCOIN_RPCSLOWLOG_H
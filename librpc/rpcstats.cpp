@@ -0,0 +1,280 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcstats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string.h>
+
+const int RPCLatencyHistogram::SUB_BITS;
+const size_t RPCLatencyHistogram::SUB_BUCKETS;
+const int RPCLatencyHistogram::MAX_EXPONENT;
+const size_t RPCLatencyHistogram::BUCKETS;
+
+/** Distinct error codes tracked per method and thread; further codes are
+ * counted as errors only
+ */
+static const size_t RPC_STATS_ERROR_SLOTS = 8;
+
+RPCLatencyHistogram::RPCLatencyHistogram() : nCount(0), nSum(0), nMax(0)
+{
+    memset(counts, 0, sizeof(counts));
+}
+
+uint64_t RPCLatencyHistogram::BucketMax(size_t nBucket)
+{
+    if (nBucket < SUB_BUCKETS)
+        return nBucket;
+    const int nExponent = nBucket / SUB_BUCKETS + SUB_BITS - 1;
+    const uint64_t nWidth = uint64_t(1) << (nExponent - SUB_BITS);
+    return (SUB_BUCKETS + nBucket % SUB_BUCKETS) * nWidth + nWidth - 1;
+}
+
+uint64_t RPCLatencyHistogram::Percentile(double q) const
+{
+    if (nCount == 0)
+        return 0;
+    const uint64_t nRank = std::max<uint64_t>(1, (uint64_t)(q * nCount + 0.5));
+    uint64_t nSeen = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        nSeen += counts[i];
+        if (nSeen >= nRank)
+            return std::min(BucketMax(i), nMax);
+    }
+    return nMax;
+}
+
+/** Add to a counter only its own thread writes. A plain load and store is
+ * enough, and unlike fetch_add does not lock the bus.
+ */
+static inline void Bump(std::atomic<uint64_t>& counter, uint64_t n = 1)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/** Live counters of one method, written by one thread */
+struct RPCMethodCounters
+{
+    struct Histogram
+    {
+        std::atomic<uint64_t> counts[RPCLatencyHistogram::BUCKETS];
+        std::atomic<uint64_t> nSum;
+        std::atomic<uint64_t> nMax;
+
+        void Record(int64_t nValue)
+        {
+            const uint64_t n = nValue > 0 ? nValue : 0;
+            Bump(counts[RPCLatencyHistogram::Bucket(n)]);
+            Bump(nSum, n);
+            if (n > nMax.load(std::memory_order_relaxed))
+                nMax.store(n, std::memory_order_relaxed);
+        }
+    };
+
+    std::atomic<uint64_t> nCalls;
+    std::atomic<uint64_t> nErrors;
+    std::atomic<uint64_t> nBytesIn;
+    std::atomic<uint64_t> nBytesOut;
+    //! Error code of each slot, 0 while it is free
+    std::atomic<int> errorCodes[RPC_STATS_ERROR_SLOTS];
+    std::atomic<uint64_t> errorCounts[RPC_STATS_ERROR_SLOTS];
+    Histogram latency[RPC_PHASE_COUNT];
+
+    RPCMethodCounters()
+    {
+        // std::atomic has no constructor zeroing it, and this is too large to list
+        nCalls = nErrors = nBytesIn = nBytesOut = 0;
+        for (size_t i = 0; i < RPC_STATS_ERROR_SLOTS; i++) {
+            errorCodes[i] = 0;
+            errorCounts[i] = 0;
+        }
+        for (Histogram& histogram : latency) {
+            for (auto& count : histogram.counts)
+                count = 0;
+            histogram.nSum = 0;
+            histogram.nMax = 0;
+        }
+    }
+
+    void RecordError(int nCode)
+    {
+        Bump(nErrors);
+        for (size_t i = 0; i < RPC_STATS_ERROR_SLOTS; i++) {
+            const int nSlotCode = errorCodes[i].load(std::memory_order_relaxed);
+            if (nSlotCode == 0) {
+                // Readers may see the code before the count, never a count without its code
+                errorCodes[i].store(nCode, std::memory_order_release);
+            } else if (nSlotCode != nCode) {
+                continue;
+            }
+            Bump(errorCounts[i]);
+            return;
+        }
+    }
+};
+
+/** Counters of one thread. Blocks of methods are allocated by the thread the
+ * first time it records a call of them.
+ */
+struct RPCThreadStats
+{
+    std::atomic<RPCMethodCounters*> methods[MAX_RPC_STATS_METHODS];
+    //! Call recorded last, whose reply is still to be recorded
+    size_t nLastMethod;
+    int64_t nLastEnd;
+
+    RPCThreadStats() : nLastMethod(MAX_RPC_STATS_METHODS), nLastEnd(0)
+    {
+        for (auto& method : methods)
+            method = nullptr;
+    }
+    ~RPCThreadStats()
+    {
+        for (auto& method : methods)
+            delete method.load();
+    }
+
+    RPCMethodCounters& Method(size_t nMethod)
+    {
+        RPCMethodCounters* counters = methods[nMethod].load(std::memory_order_relaxed);
+        if (!counters) {
+            counters = new RPCMethodCounters();
+            methods[nMethod].store(counters, std::memory_order_release);
+        }
+        return *counters;
+    }
+};
+
+/** Method names, and the counters of every thread that recorded a call.
+ * The counters of a thread that exits are kept, so nothing is lost.
+ */
+struct RPCStatsRegistry
+{
+    std::mutex cs;
+    std::vector<std::string> methods;
+    std::map<std::string, size_t> ids;
+    std::vector<std::unique_ptr<RPCThreadStats>> threads;
+};
+
+static RPCStatsRegistry& Registry()
+{
+    // Constructed on first use, as commands are registered during static
+    // initialization
+    static RPCStatsRegistry registry;
+    return registry;
+}
+
+static RPCThreadStats& ThreadStats()
+{
+    static thread_local RPCThreadStats* stats = nullptr;
+    if (!stats) {
+        RPCStatsRegistry& registry = Registry();
+        std::lock_guard<std::mutex> lock(registry.cs);
+        registry.threads.emplace_back(new RPCThreadStats());
+        stats = registry.threads.back().get();
+    }
+    return *stats;
+}
+
+size_t RPCStatsRegisterMethod(const std::string& method)
+{
+    RPCStatsRegistry& registry = Registry();
+    std::lock_guard<std::mutex> lock(registry.cs);
+    auto it = registry.ids.find(method);
+    if (it != registry.ids.end())
+        return it->second;
+    if (registry.methods.size() >= MAX_RPC_STATS_METHODS)
+        return MAX_RPC_STATS_METHODS;
+    registry.methods.push_back(method);
+    registry.ids.emplace(method, registry.methods.size() - 1);
+    return registry.methods.size() - 1;
+}
+
+int64_t RPCStatsNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void RPCStatsRecordCall(size_t nMethod, int64_t nReceived, int64_t nStart, int64_t nEnd, size_t nBytesIn,
+                        int nErrorCode)
+{
+    if (nMethod >= MAX_RPC_STATS_METHODS)
+        return;
+    RPCThreadStats& stats = ThreadStats();
+    RPCMethodCounters& counters = stats.Method(nMethod);
+    Bump(counters.nCalls);
+    Bump(counters.nBytesIn, nBytesIn);
+    if (nReceived > 0)
+        counters.latency[RPC_PHASE_QUEUE].Record(nStart - nReceived);
+    counters.latency[RPC_PHASE_EXEC].Record(nEnd - nStart);
+    if (nErrorCode != 0) {
+        counters.RecordError(nErrorCode);
+        stats.nLastMethod = MAX_RPC_STATS_METHODS;
+    } else {
+        stats.nLastMethod = nMethod;
+        stats.nLastEnd = nEnd;
+    }
+}
+
+void RPCStatsRecordReply(size_t nBytesOut, bool fDispatched)
+{
+    RPCThreadStats& stats = ThreadStats();
+    if (stats.nLastMethod >= MAX_RPC_STATS_METHODS)
+        return;
+    RPCMethodCounters& counters = stats.Method(stats.nLastMethod);
+    Bump(counters.nBytesOut, nBytesOut);
+    if (fDispatched)
+        counters.latency[RPC_PHASE_DISPATCH].Record(RPCStatsNow() - stats.nLastEnd);
+    stats.nLastMethod = MAX_RPC_STATS_METHODS;
+}
+
+void RPCStatsResetCall()
+{
+    ThreadStats().nLastMethod = MAX_RPC_STATS_METHODS;
+}
+
+std::vector<RPCMethodStats> GetRPCStats()
+{
+    RPCStatsRegistry& registry = Registry();
+    std::lock_guard<std::mutex> lock(registry.cs);
+    std::vector<RPCMethodStats> vStats;
+    for (size_t nMethod = 0; nMethod < registry.methods.size(); nMethod++) {
+        RPCMethodStats stats;
+        stats.method = registry.methods[nMethod];
+        stats.nCalls = stats.nErrors = stats.nBytesIn = stats.nBytesOut = 0;
+        for (const auto& thread : registry.threads) {
+            const RPCMethodCounters* counters = thread->methods[nMethod].load(std::memory_order_acquire);
+            if (!counters)
+                continue;
+            stats.nCalls += counters->nCalls.load(std::memory_order_relaxed);
+            stats.nErrors += counters->nErrors.load(std::memory_order_relaxed);
+            stats.nBytesIn += counters->nBytesIn.load(std::memory_order_relaxed);
+            stats.nBytesOut += counters->nBytesOut.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < RPC_STATS_ERROR_SLOTS; i++) {
+                const int nCode = counters->errorCodes[i].load(std::memory_order_acquire);
+                if (nCode != 0)
+                    stats.errors[nCode] += counters->errorCounts[i].load(std::memory_order_relaxed);
+            }
+            for (int phase = 0; phase < RPC_PHASE_COUNT; phase++) {
+                const RPCMethodCounters::Histogram& live = counters->latency[phase];
+                RPCLatencyHistogram& histogram = stats.latency[phase];
+                for (size_t i = 0; i < RPCLatencyHistogram::BUCKETS; i++) {
+                    const uint64_t n = live.counts[i].load(std::memory_order_relaxed);
+                    histogram.counts[i] += n;
+                    histogram.nCount += n;
+                }
+                histogram.nSum += live.nSum.load(std::memory_order_relaxed);
+                histogram.nMax = std::max(histogram.nMax, live.nMax.load(std::memory_order_relaxed));
+            }
+        }
+        if (stats.nCalls > 0)
+            vStats.push_back(std::move(stats));
+    }
+    return vStats;
+}
@@ -0,0 +1,116 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RPCSTATS_H
+#define BITCOIN_RPCSTATS_H
+
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/** Methods that can be tracked; methods registered beyond this are not */
+static const size_t MAX_RPC_STATS_METHODS = 256;
+
+/** Phases of a call whose latency is tracked */
+enum RPCStatsPhase
+{
+    RPC_PHASE_QUEUE,    //!< from the request being received to its execution starting
+    RPC_PHASE_EXEC,     //!< executing the command and serializing its result
+    RPC_PHASE_DISPATCH, //!< from the result being serialized to the reply being handed to the client
+    RPC_PHASE_COUNT
+};
+
+/**
+ * Latency histogram in nanoseconds, with buckets spaced like those of an
+ * HDR histogram: every power of two is split in 2^SUB_BITS linear
+ * sub-buckets, so any value is known to within 1/2^SUB_BITS of itself.
+ * Values from 2^MAX_EXPONENT ns (about 18 minutes) on share the last bucket.
+ */
+struct RPCLatencyHistogram
+{
+    static const int SUB_BITS = 3;
+    static const size_t SUB_BUCKETS = 1 << SUB_BITS;
+    static const int MAX_EXPONENT = 40;
+    static const size_t BUCKETS = (MAX_EXPONENT - SUB_BITS + 1) * SUB_BUCKETS;
+
+    uint64_t counts[BUCKETS];
+    uint64_t nCount;
+    uint64_t nSum; //!< total of the values, for the mean
+    uint64_t nMax;
+
+    RPCLatencyHistogram();
+
+    /** Bucket of a value */
+    static size_t Bucket(uint64_t nValue)
+    {
+        if (nValue < SUB_BUCKETS)
+            return nValue;
+        const int nExponent = 63 - __builtin_clzll(nValue);
+        const size_t nBucket = (nExponent - SUB_BITS + 1) * SUB_BUCKETS + ((nValue >> (nExponent - SUB_BITS)) & (SUB_BUCKETS - 1));
+        return nBucket < BUCKETS ? nBucket : BUCKETS - 1;
+    }
+    /** Largest value that falls in a bucket */
+    static uint64_t BucketMax(size_t nBucket);
+
+    /** Value below which a fraction q of the values fall, rounded up to the
+     * end of its bucket and capped by the maximum; 0 if empty
+     */
+    uint64_t Percentile(double q) const;
+};
+
+/** Snapshot of the counters of one method */
+struct RPCMethodStats
+{
+    std::string method;
+    uint64_t nCalls;    //!< calls that reached the command, including failed ones
+    uint64_t nErrors;
+    uint64_t nBytesIn;  //!< request bytes, where the transport knows them
+    uint64_t nBytesOut; //!< reply bytes, where the transport knows them
+    std::map<int, uint64_t> errors; //!< failed calls by RPCErrorCode
+    RPCLatencyHistogram latency[RPC_PHASE_COUNT];
+};
+
+/** Get the id counters of method are recorded under, registering it if
+ * needed. Returns MAX_RPC_STATS_METHODS once the registry is full.
+ */
+size_t RPCStatsRegisterMethod(const std::string& method);
+
+/** Current steady clock time in nanoseconds, the clock of all timestamps
+ * passed in here
+ */
+int64_t RPCStatsNow();
+
+/**
+ * Record a call executed by this thread. Counters are sharded per thread,
+ * and only ever written by their own thread, so recording takes no lock
+ * and no atomic read-modify-write.
+ * @param nMethod      id from RPCStatsRegisterMethod
+ * @param nReceived    time the request was received, 0 if unknown
+ * @param nStart       time execution started
+ * @param nEnd         time execution ended
+ * @param nBytesIn     size of the request, 0 if unknown
+ * @param nErrorCode   RPCErrorCode the call failed with, 0 if it succeeded
+ */
+void RPCStatsRecordCall(size_t nMethod, int64_t nReceived, int64_t nStart, int64_t nEnd, size_t nBytesIn,
+                        int nErrorCode);
+
+/** Record the reply to the call this thread recorded last, once it was
+ * handed to the client. With fDispatched, the time since execution ended is
+ * recorded as the call's dispatch latency. Does nothing if no call was
+ * recorded since the last reply, e.g. because the request failed before
+ * reaching a command.
+ */
+void RPCStatsRecordReply(size_t nBytesOut, bool fDispatched);
+
+/** Forget the call this thread recorded last, so that its reply is not
+ * attributed to it
+ */
+void RPCStatsResetCall();
+
+/** Merge the counters of every thread, for the methods that were called */
+std::vector<RPCMethodStats> GetRPCStats();
+
+#endif // BITCOIN_RPCSTATS_H
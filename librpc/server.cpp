@@ -4,7 +4,16 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "server.h"
+#include "rpcslowlog.h"
+#include "rpcstats.h"
+#include "typedrpc.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <set>
+#include <string.h>
 
 #include <boost/bind.hpp>
 #include <boost/signals2/signal.hpp>
@@ -46,7 +55,7 @@ void RPCTypeCheck(const json& params,
                   bool fAllowNull)
 {
     unsigned int i = 0;
-    for (json t : typesExpected)
+    for (json::value_t t : typesExpected)
     {
         if (params.size() <= i)
             break;
@@ -59,12 +68,34 @@ void RPCTypeCheck(const json& params,
     }
 }
 
+/** Whether two json types are the same to RPC callers, which only know one number type */
+static inline bool SameRPCType(json::value_t a, json::value_t b)
+{
+    auto normalize = [](json::value_t t) {
+        return t == json::value_t::number_integer || t == json::value_t::number_unsigned ? json::value_t::number_float : t;
+    };
+    return normalize(a) == normalize(b);
+}
+
 void RPCTypeCheckArgument(const json& value, json::value_t typeExpected)
 {
-    if (value.type() != typeExpected) {
-        //std::runtime_error("json type error"); 
-        //throw JSONRPCError(RPC_TYPE_ERROR, strprintf("Expected type , got %s",value.type_name()));
-        //throw JSONRPCError(RPC_TYPE_ERROR, strprintf("Expected type %s, got %s", uvTypeName(typeExpected), uvTypeName(value.type())));
+    if (!SameRPCType(value.type(), typeExpected)) {
+        throw JSONRPCError(RPC_TYPE_ERROR, "Expected type " + RPCTypeName(typeExpected) + ", got " + RPCTypeName(value.type()));
+    }
+}
+
+std::string RPCTypeName(json::value_t type)
+{
+    switch (type) {
+    case json::value_t::null: return "null";
+    case json::value_t::boolean: return "bool";
+    case json::value_t::object: return "object";
+    case json::value_t::array: return "array";
+    case json::value_t::string: return "string";
+    case json::value_t::number_integer:
+    case json::value_t::number_unsigned:
+    case json::value_t::number_float: return "number";
+    default: return "unknown";
     }
 }
 
@@ -73,53 +104,89 @@ void RPCTypeCheckObj(const json& o,
     bool fAllowNull,
     bool fStrict)
 {
-    for (const auto& t : typesExpected) {
-        const json& v =  o[t.first]; //find_value(o, t.first);
-        if (!fAllowNull && v.is_null())
-        {
-            //throw JSONRPCError(RPC_TYPE_ERROR, strprintf("Missing %s", t.first));
-        }
-        //if (!fAllowNull && v.is_null())
-        //    std::runtime_error("json type error"); 
-           // throw JSONRPCError(RPC_TYPE_ERROR, strprintf("Missing %s", t.first));
-     /*       
-        if (!(t.second.typeAny || v.type() == t.second.type || (fAllowNull && v.isNull()))) {
-            std::string err = strprintf("Expected type %s for %s, got %s",
-                uvTypeName(t.second.type), t.first, uvTypeName(v.type()));
-            throw std::runtime_error("json type error");
-            //throw JSONRPCError(RPC_TYPE_ERROR, err);
-        }*/
-
-        if (!(t.second.typeAny || v.type() == t.second.type || (fAllowNull && v.is_null())))
-        {
-            //std::string err = strprintf("Expected type s for %s, got %s",t.first, v.type_name());
-            //throw JSONRPCError(RPC_TYPE_ERROR, err);
-        }
+    RPCObjSchema(typesExpected, fAllowNull, fStrict).Check(o);
+}
+
+RPCObjSchema::RPCObjSchema(const std::map<std::string, jsonType>& typesExpected, bool _fAllowNull, bool _fStrict) :
+    fAllowNull(_fAllowNull), fStrict(_fStrict)
+{
+    for (const auto& t : typesExpected)
+        fields.push_back(Field{RPCMethodHash(t.first.data(), t.first.size()), t.first, t.second});
+
+    size_t nSlots = 2;
+    while (nSlots < 2 * fields.size())
+        nSlots <<= 1;
+    vSlots.assign(nSlots, 0);
+    for (size_t i = 0; i < fields.size(); i++) {
+        size_t slot = fields[i].hash & (nSlots - 1);
+        while (vSlots[slot])
+            slot = (slot + 1) & (nSlots - 1);
+        vSlots[slot] = i + 1;
     }
 
-    if (fStrict)
-    {
+    vRequired.assign((fields.size() + 63) / 64, 0);
+    if (!fAllowNull) {
+        for (size_t i = 0; i < fields.size(); i++)
+            vRequired[i / 64] |= uint64_t(1) << (i % 64);
+    }
+}
 
-        json::const_iterator iter = o.begin();
-        for(;iter != o.end();iter++)
-        {
-            std::string key = iter.key();
-            if (typesExpected.count(key) == 0)
-            {
-                //std::string err = strprintf("Unexpected key %s",key);
-                //throw  JSONRPCError(RPC_TYPE_ERROR,err);
+int RPCObjSchema::Find(const std::string& key) const
+{
+    const uint64_t hash = RPCMethodHash(key.data(), key.size());
+    const size_t mask = vSlots.size() - 1;
+    for (size_t slot = hash & mask; vSlots[slot]; slot = (slot + 1) & mask) {
+        const Field& field = fields[vSlots[slot] - 1];
+        if (field.hash == hash && field.name == key)
+            return vSlots[slot] - 1;
+    }
+    return -1;
+}
+
+void RPCObjSchema::Check(const json& o) const
+{
+    // Required keys still missing; kept on the stack for up to 256 fields
+    uint64_t missingInline[4];
+    std::vector<uint64_t> missingHeap;
+    uint64_t* missing = missingInline;
+    if (vRequired.size() > 4) {
+        missingHeap = vRequired;
+        missing = missingHeap.data();
+    } else {
+        std::copy(vRequired.begin(), vRequired.end(), missingInline);
+    }
+
+    if (o.is_object()) {
+        for (json::const_iterator it = o.begin(); it != o.end(); ++it) {
+            int i = Find(it.key());
+            if (i < 0) {
+                if (fStrict)
+                    throw JSONRPCError(RPC_TYPE_ERROR, "Unexpected key " + it.key());
+                continue;
             }
+            const Field& field = fields[i];
+            const json& v = it.value();
+            if (v.is_null()) {
+                // Present but null counts as missing, unless nulls are allowed
+                if (fAllowNull)
+                    continue;
+                throw JSONRPCError(RPC_TYPE_ERROR, "Missing " + field.name);
+            }
+            if (!field.type.typeAny && !SameRPCType(v.type(), field.type.type)) {
+                throw JSONRPCError(RPC_TYPE_ERROR, "Expected type " + RPCTypeName(field.type.type) + " for " +
+                                                       field.name + ", got " + RPCTypeName(v.type()));
+            }
+            missing[i / 64] &= ~(uint64_t(1) << (i % 64));
         }
+    }
 
-        /*for (const std::string& k : o.getKeys())
-        {
-            if (typesExpected.count(k) == 0)
-            {
-                std::string err = strprintf("Unexpected key %s", k);
-                throw  std::runtime_error("json type error");
-                //throw JSONRPCError(RPC_TYPE_ERROR, err);
-            }
-        }*/
+    for (size_t w = 0; w < vRequired.size(); w++) {
+        if (missing[w]) {
+            size_t i = w * 64;
+            while (!(missing[w] & (uint64_t(1) << (i % 64))))
+                i++;
+            throw JSONRPCError(RPC_TYPE_ERROR, "Missing " + fields[i].name);
+        }
     }
 }
 /*
@@ -197,6 +264,8 @@ std::string CRPCTable::help(const std::string& strCommand, const JSONRPCRequest&
         jreq.strMethod = strMethod;
         try
         {
+            if (!pcmd->help.empty())
+                throw std::runtime_error(pcmd->help);
             rpcfn_type pfn = pcmd->actor;
             if (setDone.insert(pfn).second)
                 (*pfn)(jreq);
@@ -262,22 +331,75 @@ json stop(const JSONRPCRequest& jsonRequest)
     return "Bitcoin server stopping";
 }
 
-json uptime(const JSONRPCRequest& jsonRequest)
+static int64_t uptime()
 {
-    if (jsonRequest.fHelp || jsonRequest.params.size() > 1)
-        throw std::runtime_error(
-                "uptime\n"
-                        "\nReturns the total uptime of the server.\n"
-                        "\nResult:\n"
-                        "ttt        (numeric) The number of seconds that the server has been running\n"
-                        "\nExamples:\n"
-                + HelpExampleCli("uptime", "")
-                + HelpExampleRpc("uptime", "")
-        );
-
     return 0;//GetTime() - GetStartupTime();
 }
 
+/** Summary of a latency histogram, in microseconds */
+static json RPCLatencyToJSON(const RPCLatencyHistogram& histogram)
+{
+    json obj = json::object();
+    obj["count"] = histogram.nCount;
+    obj["mean_us"] = histogram.nCount ? histogram.nSum / 1000.0 / histogram.nCount : 0.0;
+    obj["p50_us"] = histogram.Percentile(0.50) / 1000.0;
+    obj["p90_us"] = histogram.Percentile(0.90) / 1000.0;
+    obj["p99_us"] = histogram.Percentile(0.99) / 1000.0;
+    obj["p999_us"] = histogram.Percentile(0.999) / 1000.0;
+    obj["max_us"] = histogram.nMax / 1000.0;
+    return obj;
+}
+
+static json getrpcinfo()
+{
+    const std::map<std::string, RPCCoalesceStats> coalesce = tableRPC.CoalesceStats();
+    json methods = json::object();
+    for (const RPCMethodStats& stats : GetRPCStats()) {
+        json method = json::object();
+        method["calls"] = stats.nCalls;
+        method["errors"] = stats.nErrors;
+        json errors = json::object();
+        for (const auto& error : stats.errors)
+            errors[std::to_string(error.first)] = error.second;
+        method["errors_by_code"] = errors;
+        method["bytes_in"] = stats.nBytesIn;
+        method["bytes_out"] = stats.nBytesOut;
+        method["queue_wait"] = RPCLatencyToJSON(stats.latency[RPC_PHASE_QUEUE]);
+        method["execution"] = RPCLatencyToJSON(stats.latency[RPC_PHASE_EXEC]);
+        method["reply_dispatch"] = RPCLatencyToJSON(stats.latency[RPC_PHASE_DISPATCH]);
+        auto it = coalesce.find(stats.method);
+        if (it != coalesce.end()) {
+            method["coalesced"] = it->second.nCoalesced;
+            method["coalesced_calls"] = it->second.nCalls;
+        }
+        methods[stats.method] = method;
+    }
+
+    const RPCReplyCacheStats cacheStats = tableRPC.ReplyCache().Stats();
+    json cache = json::object();
+    cache["entries"] = cacheStats.nEntries;
+    cache["bytes"] = cacheStats.nBytes;
+    cache["hits"] = cacheStats.nHits;
+    cache["misses"] = cacheStats.nMisses;
+    cache["insertions"] = cacheStats.nInsertions;
+    cache["evictions"] = cacheStats.nEvictions;
+    cache["expired"] = cacheStats.nExpired;
+    cache["invalidations"] = cacheStats.nInvalidations;
+
+    json result = json::object();
+    result["methods"] = methods;
+    result["reply_cache"] = cache;
+    return result;
+}
+
+static json getslowrequests()
+{
+    json result = json::object();
+    result["current"] = RPCSlowLogToJSON(GetRPCSlowLog(false));
+    result["previous"] = RPCSlowLogToJSON(GetRPCSlowLog(true));
+    return result;
+}
+
 /**
  * Call Table
  */
@@ -287,10 +409,75 @@ static const CRPCCommand vRPCCommands[] =
     /* Overall control/query calls */
     { "control",            "help",                   &help,                   {"command"}  },
     { "control",            "stop",                   &stop,                   {}  },
-    { "control",            "uptime",                 &uptime,                 {}  },
+    { "control",            "uptime",                 RPC_TYPED_ACTOR(uptime), {},
+      RPC_TYPED_WRITER(uptime),
+        "uptime\n"
+        "\nReturns the total uptime of the server.\n"
+        "\nResult:\n"
+        "ttt        (numeric) The number of seconds that the server has been running\n"
+        "\nExamples:\n"
+        + HelpExampleCli("uptime", "")
+        + HelpExampleRpc("uptime", "")
+    },
+    { "control",            "getrpcinfo",             RPC_TYPED_ACTOR(getrpcinfo), {},
+      RPC_TYPED_WRITER(getrpcinfo),
+        "getrpcinfo\n"
+        "\nReturns counters and latencies of the RPC methods called so far.\n"
+        "\nResult:\n"
+        "{\n"
+        "  \"methods\": {\n"
+        "    \"name\": {                 (json object) one per method\n"
+        "      \"calls\": n,             (numeric) calls that reached the command\n"
+        "      \"errors\": n,            (numeric) calls that failed\n"
+        "      \"errors_by_code\": {...},(json object) failed calls by error code\n"
+        "      \"bytes_in\": n,          (numeric) request bytes, where known\n"
+        "      \"bytes_out\": n,         (numeric) reply bytes, where known\n"
+        "      \"queue_wait\": {...},    (json object) time from receipt to execution\n"
+        "      \"execution\": {...},     (json object) time executing and serializing\n"
+        "      \"reply_dispatch\": {...},(json object) time from serialization to sending\n"
+        "      \"coalesced\": n          (numeric, optional) calls that shared a running call's result\n"
+        "    }, ...\n"
+        "  },\n"
+        "  \"reply_cache\": {...}        (json object) reply cache counters\n"
+        "}\n"
+        "Latencies have a count, mean_us, p50_us, p90_us, p99_us, p999_us and max_us,\n"
+        "in microseconds, within 12.5%.\n"
+        "\nExamples:\n"
+        + HelpExampleCli("getrpcinfo", "")
+        + HelpExampleRpc("getrpcinfo", "")
+    },
+    { "control",            "getslowrequests",        RPC_TYPED_ACTOR(getslowrequests), {},
+      RPC_TYPED_WRITER(getslowrequests),
+        "getslowrequests\n"
+        "\nReturns the slowest calls of the current and the previous window of a minute.\n"
+        "The previous window is also written to rpcslow.json next to the auth cookie\n"
+        "as it closes.\n"
+        "\nResult:\n"
+        "{\n"
+        "  \"current\": {\n"
+        "    \"window_start\": n,        (numeric) when the window started, in seconds since the epoch\n"
+        "    \"window_seconds\": n,      (numeric) length of a window\n"
+        "    \"requests\": [             (json array) slowest first\n"
+        "      {\n"
+        "        \"method\": \"name\",     (string) method called\n"
+        "        \"params_digest\": \"hex\",(string) hash of the params, equal for equal params\n"
+        "        \"bytes_in\": n,        (numeric) request bytes, where known\n"
+        "        \"error_code\": n,      (numeric) error code the call failed with, 0 if none\n"
+        "        \"time\": n,            (numeric) when the call ended, in seconds since the epoch\n"
+        "        \"latency_us\": n,      (numeric) time from receipt, or execution start, to the end\n"
+        "        \"timeline_us\": {...}  (json object) received, exec_start and exec_end, from receipt\n"
+        "      }, ...\n"
+        "    ]\n"
+        "  },\n"
+        "  \"previous\": {...}          (json object) the same for the previous window\n"
+        "}\n"
+        "\nExamples:\n"
+        + HelpExampleCli("getslowrequests", "")
+        + HelpExampleRpc("getslowrequests", "")
+    },
 };
 
-CRPCTable::CRPCTable()
+CRPCTable::CRPCTable() : fCompiled(false)
 {
     unsigned int vcidx;
     for (vcidx = 0; vcidx < (sizeof(vRPCCommands) / sizeof(vRPCCommands[0])); vcidx++)
@@ -299,15 +486,111 @@ CRPCTable::CRPCTable()
 
         pcmd = &vRPCCommands[vcidx];
         mapCommands[pcmd->name] = pcmd;
+        mapArgIndexes[pcmd->name] = RPCArgIndex(pcmd->argNames);
+        mapStatIds[pcmd->name] = RPCStatsRegisterMethod(pcmd->name);
     }
+    fCompiled = CompileDispatch();
 }
 
-const CRPCCommand *CRPCTable::operator[](const std::string &name) const
+/** Scramble a method hash with a bucket seed */
+static inline uint64_t DispatchMix(uint64_t hash, uint32_t seed)
 {
+    hash ^= (seed + 1) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+bool CRPCTable::CompileDispatch()
+{
+    static const uint32_t MAX_SEED = 1 << 20;
+
+    const size_t n = mapCommands.size();
+    std::vector<DispatchSlot> entries;
+    entries.reserve(n);
+    for (const auto& command : mapCommands)
+        entries.push_back({RPCMethodHash(command.first.data(), command.first.size()), &command.first, command.second,
+                           &mapArgIndexes.at(command.first), mapStatIds.at(command.first)});
+
+    // Place the fullest buckets first, while most slots are still free
+    std::vector<std::vector<size_t>> buckets(std::max<size_t>(n, 1));
+    for (size_t i = 0; i < n; i++)
+        buckets[entries[i].hash % buckets.size()].push_back(i);
+    std::vector<size_t> order(buckets.size());
+    for (size_t b = 0; b < order.size(); b++)
+        order[b] = b;
+    std::stable_sort(order.begin(), order.end(), [&buckets](size_t a, size_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    std::vector<uint32_t> seeds(buckets.size(), 0);
+    std::vector<DispatchSlot> slots(n, DispatchSlot{0, nullptr, nullptr, nullptr, 0});
+    std::vector<size_t> placed;
+    for (size_t b : order) {
+        const std::vector<size_t>& bucket = buckets[b];
+        if (bucket.empty())
+            break;
+        uint32_t seed = 0;
+        for (; seed < MAX_SEED; seed++) {
+            placed.clear();
+            for (size_t i : bucket) {
+                size_t slot = DispatchMix(entries[i].hash, seed) % n;
+                if (slots[slot].cmd || std::find(placed.begin(), placed.end(), slot) != placed.end())
+                    break;
+                placed.push_back(slot);
+            }
+            if (placed.size() == bucket.size())
+                break;
+        }
+        if (seed == MAX_SEED)
+            return false; // e.g. two names with the same hash
+        for (size_t k = 0; k < bucket.size(); k++)
+            slots[placed[k]] = entries[bucket[k]];
+        seeds[b] = seed;
+    }
+    vSeeds.swap(seeds);
+    vSlots.swap(slots);
+    return true;
+}
+
+void CRPCTable::Freeze()
+{
+    if (!fCompiled)
+        fCompiled = CompileDispatch();
+}
+
+bool CRPCTable::Find(const std::string& name, const CRPCCommand*& pcmd, const RPCArgIndex*& args, size_t& nStatId) const
+{
+    if (fCompiled) {
+        if (vSlots.empty())
+            return false;
+        uint64_t hash = RPCMethodHash(name.data(), name.size());
+        const DispatchSlot& slot = vSlots[DispatchMix(hash, vSeeds[hash % vSeeds.size()]) % vSlots.size()];
+        if (slot.hash != hash || *slot.name != name)
+            return false;
+        pcmd = slot.cmd;
+        args = slot.args;
+        nStatId = slot.nStatId;
+        return true;
+    }
     std::map<std::string, const CRPCCommand*>::const_iterator it = mapCommands.find(name);
     if (it == mapCommands.end())
+        return false;
+    pcmd = it->second;
+    args = &mapArgIndexes.at(name);
+    nStatId = mapStatIds.at(name);
+    return true;
+}
+
+const CRPCCommand *CRPCTable::operator[](const std::string &name) const
+{
+    const CRPCCommand* pcmd;
+    const RPCArgIndex* args;
+    size_t nStatId;
+    if (!Find(name, pcmd, args, nStatId))
         return nullptr;
-    return (*it).second;
+    return pcmd;
 }
 
 bool CRPCTable::appendCommand(const std::string& name, const CRPCCommand* pcmd)
@@ -321,13 +604,26 @@ bool CRPCTable::appendCommand(const std::string& name, const CRPCCommand* pcmd)
         return false;
 
     mapCommands[name] = pcmd;
+    mapArgIndexes[name] = RPCArgIndex(pcmd->argNames);
+    mapStatIds[name] = RPCStatsRegisterMethod(name);
+    fCompiled = false;
+    return true;
+}
+
+bool CRPCTable::appendCommand(std::unique_ptr<CRPCCommand> pcmd)
+{
+    if (!appendCommand(pcmd->name, pcmd.get()))
+        return false;
+    vOwnedCommands.push_back(std::move(pcmd));
     return true;
 }
 
 bool StartRPC()
 {
     //LogPrint(BCLog::RPC, "Starting RPC\n");
+    tableRPC.Freeze();
     fRPCRunning = true;
+    RPCSlowLogSetDumpFile(GetAuthCookieSiblingFile(RPC_SLOW_LOG_FILE));
     g_rpcSignals.Started();
     return true;
 }
@@ -344,6 +640,8 @@ void StopRPC()
     //LogPrint(BCLog::RPC, "Stopping RPC\n");
     deadlineTimers.clear();
     DeleteAuthCookie();
+    RPCSlowLogFlush();
+    RPCSlowLogSetDumpFile("");
     g_rpcSignals.Stopped();
 }
 
@@ -383,19 +681,81 @@ void JSONRPCRequest::parse(const json& valRequest)
     // Parse id now so errors from here on will have the id
     id = request["id"];//find_value(request, "id");
 
-    // Parse method
+    // Parse method and params
     json valMethod = request["method"];//find_value(request, "method");
+    json valParams = request["params"];//find_value(request, "params");
+    check(valMethod, valParams);
+}
+
+void JSONRPCRequest::parse(json&& valRequest)
+{
+    id = json();
+    if (!valRequest.is_object())
+        throw JSONRPCError(RPC_INVALID_REQUEST, "Invalid Request object");
+    json valMethod;
+    json valParams;
+    for (json::iterator it = valRequest.begin(); it != valRequest.end(); ++it) {
+        if (it.key() == "id")
+            id = std::move(it.value());
+        else if (it.key() == "method")
+            valMethod = std::move(it.value());
+        else if (it.key() == "params")
+            valParams = std::move(it.value());
+    }
+    check(valMethod, valParams);
+}
+
+bool JSONRPCRequest::parse(nlohmann::detail::input_adapter input, json& valRequest)
+{
+    // Only the members of a top-level object are picked off; any other
+    // document is built as a whole for the caller.
+    struct {
+        bool fObject = false;
+        std::string strKey;
+        json valMethod;
+        json valParams;
+    } members;
+    id = json();
+    json::parser_callback_t callback = [this, &members](int depth, json::parse_event_t event, json& parsed) {
+        if (depth == 0) {
+            if (event == json::parse_event_t::object_start)
+                members.fObject = true;
+            return true;
+        }
+        if (!members.fObject || depth > 1)
+            return true;
+        if (event == json::parse_event_t::key) {
+            members.strKey = parsed.get<std::string>();
+        } else if (event == json::parse_event_t::value) {
+            if (members.strKey == "id")
+                id = std::move(parsed);
+            else if (members.strKey == "method")
+                members.valMethod = std::move(parsed);
+            else if (members.strKey == "params")
+                members.valParams = std::move(parsed);
+            // Drop the value instead of adding it to the object
+            return false;
+        }
+        return true;
+    };
+    valRequest = json::parse(std::move(input), callback);
+    if (!members.fObject)
+        return false;
+    check(members.valMethod, members.valParams);
+    return true;
+}
+
+void JSONRPCRequest::check(json& valMethod, json& valParams)
+{
     if (valMethod.is_null())
         throw JSONRPCError(RPC_INVALID_REQUEST, "Missing method");
     if (!valMethod.is_string())
         throw JSONRPCError(RPC_INVALID_REQUEST, "Method must be a string");
-    strMethod = request["method"].get<std::string>();
+    strMethod = std::move(valMethod.get_ref<std::string&>());
     //LogPrint(BCLog::RPC, "ThreadRPCServer method=%s\n", SanitizeString(strMethod));
 
-    // Parse params
-    json valParams = request["params"];//find_value(request, "params");
     if (valParams.is_array() || valParams.is_object())
-        params = valParams;
+        params = std::move(valParams);
     else if (valParams.is_null())
         params.clear(); //= json::json_array();
     else
@@ -409,90 +769,249 @@ bool IsDeprecatedRPCEnabled(const std::string& method)
     return find(enabled_methods.begin(), enabled_methods.end(), method) != enabled_methods.end();
 }
 
-static json JSONRPCExecOne(JSONRPCRequest jreq, const json& req)
+/** Append a reply in encoding */
+static void JSONRPCWriteReplyAs(nlohmann::detail::output_adapter_t<char> out, const json& result, const json& error,
+                                const json& id, RPCEncoding encoding)
+{
+    if (encoding == RPC_ENCODING_JSON)
+        JSONRPCWriteReply(out, result, error, id);
+    else
+        RPCEncode(out, JSONRPCReplyObj(result, error, id), encoding);
+}
+
+void JSONRPCExecOne(const JSONRPCRequest& jreq, json&& req, std::string& strReply, RPCEncoding encoding)
 {
-    json rpc_result=json::object();
-    json Nulljson;
+    JSONRPCRequest request;
+    request.URI = jreq.URI;
+    request.authUser = jreq.authUser;
+    request.nReceivedTime = jreq.nReceivedTime;
+    request.nBytesIn = jreq.nBytesIn;
+    const size_t nBegin = strReply.size();
+    nlohmann::detail::output_adapter_t<char> out = nlohmann::detail::output_adapter<char>(strReply);
     try {
-        jreq.parse(req);
+        request.parse(std::move(req));
+        if (encoding == RPC_ENCODING_JSON)
+            tableRPC.execute(request, out);
+        else
+            RPCEncode(out, JSONRPCReplyObj(tableRPC.execute(request), json(), request.id), encoding);
+    } catch (const json& objError) {
+        strReply.resize(nBegin);
+        JSONRPCWriteReplyAs(out, json(), objError, request.id, encoding);
+    } catch (const std::exception& e) {
+        strReply.resize(nBegin);
+        JSONRPCWriteReplyAs(out, json(), JSONRPCError(RPC_PARSE_ERROR, e.what()), request.id, encoding);
+    }
+    RPCStatsRecordReply(strReply.size() - nBegin, false);
+}
 
-        json result = tableRPC.execute(jreq);
-        rpc_result = JSONRPCReplyObj(result, Nulljson, jreq.id);
+/** Batch being executed. Helper tasks share ownership, so a helper that is
+ * still running an entry when the caller gives up at the deadline writes
+ * into state that is simply dropped afterwards.
+ */
+struct RPCBatch
+{
+    enum EntryState {
+        PENDING,
+        RUNNING,
+        DONE,
+        EXPIRED,
+    };
+    struct Entry
+    {
+        json id;           //!< kept to answer an entry that did not finish
+        json request;      //!< moved out by the thread running the entry
+        std::string reply; //!< only read once state is DONE
+        std::atomic<int> state{PENDING};
+    };
+
+    RPCBatch(const JSONRPCRequest& jreq, json& vReq, const RPCBatchOptions& options, RPCEncoding _encoding) :
+        encoding(_encoding), nEntries(vReq.size()), entries(new Entry[nEntries]),
+        nChunkSize(std::max<size_t>(options.nChunkSize, 1)),
+        nChunks((nEntries + nChunkSize - 1) / nChunkSize), nextChunk(0),
+        fDeadline(options.nTimeout > 0),
+        deadline(std::chrono::steady_clock::now() + std::chrono::milliseconds(options.nTimeout)),
+        nResolved(0)
+    {
+        proto.URI = jreq.URI;
+        proto.authUser = jreq.authUser;
+        proto.nReceivedTime = jreq.nReceivedTime;
+        for (size_t i = 0; i < nEntries; i++) {
+            json& req = vReq[i];
+            if (req.is_object()) {
+                auto it = req.find("id");
+                if (it != req.end())
+                    entries[i].id = *it;
+            }
+            entries[i].request = std::move(req);
+        }
     }
-    catch (const json& objError)
+
+    JSONRPCRequest proto; //!< URI and user the entries run with
+    const RPCEncoding encoding;
+    const size_t nEntries;
+    const std::unique_ptr<Entry[]> entries;
+    const size_t nChunkSize;
+    const size_t nChunks;
+    std::atomic<size_t> nextChunk;
+    const bool fDeadline;
+    const std::chrono::steady_clock::time_point deadline;
+
+    std::mutex cs;
+    std::condition_variable cond;
+    size_t nResolved; //!< entries done or expired, guarded by cs
+
+    /** Execute chunks until none is left */
+    void Work()
     {
-        rpc_result = JSONRPCReplyObj(Nulljson, objError, jreq.id);
+        size_t chunk;
+        while ((chunk = nextChunk.fetch_add(1, std::memory_order_relaxed)) < nChunks) {
+            size_t begin = chunk * nChunkSize;
+            size_t end = std::min(nEntries, begin + nChunkSize);
+            for (size_t i = begin; i < end; i++)
+                Execute(entries[i]);
+            std::lock_guard<std::mutex> lock(cs);
+            nResolved += end - begin;
+            if (nResolved == nEntries)
+                cond.notify_all();
+        }
     }
-    catch (const std::exception& e)
+
+    void Execute(Entry& entry)
+    {
+        int state = PENDING;
+        if (fDeadline && std::chrono::steady_clock::now() >= deadline) {
+            entry.state.compare_exchange_strong(state, EXPIRED);
+            return;
+        }
+        if (!entry.state.compare_exchange_strong(state, RUNNING))
+            return;
+        JSONRPCExecOne(proto, std::move(entry.request), entry.reply, encoding);
+        entry.state.store(DONE, std::memory_order_release);
+    }
+};
+
+std::string JSONRPCExecBatch(const JSONRPCRequest& jreq, json& vReq, const RPCBatchOptions& options,
+                             const RPCBatchSubmitFn& submit, RPCEncoding encoding)
+{
+    std::shared_ptr<RPCBatch> batch = std::make_shared<RPCBatch>(jreq, vReq, options, encoding);
+
+    size_t nHelpers = std::min(std::max<size_t>(options.nMaxConcurrency, 1), batch->nChunks);
+    for (size_t n = 1; submit && n < nHelpers; n++) {
+        if (!submit([batch] { batch->Work(); }))
+            break;
+    }
+    batch->Work();
     {
-        rpc_result = JSONRPCReplyObj(Nulljson,
-                                     JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        // Wait for chunks still running on helpers
+        std::unique_lock<std::mutex> lock(batch->cs);
+        auto finished = [&batch] { return batch->nResolved == batch->nEntries; };
+        if (batch->fDeadline)
+            batch->cond.wait_until(lock, batch->deadline, finished);
+        else
+            batch->cond.wait(lock, finished);
     }
 
-    return rpc_result;
+    // JSON replies are joined into an array; binary ones follow an array
+    // header back to back
+    const bool fJSON = encoding == RPC_ENCODING_JSON;
+    std::string strReply;
+    if (fJSON)
+        strReply = "[";
+    else
+        RPCWriteArrayHeader(strReply, batch->nEntries, encoding);
+    for (size_t i = 0; i < batch->nEntries; i++) {
+        RPCBatch::Entry& entry = batch->entries[i];
+        if (i > 0 && fJSON)
+            strReply += ',';
+        int state = RPCBatch::PENDING;
+        if (!entry.state.compare_exchange_strong(state, RPCBatch::EXPIRED, std::memory_order_acquire) &&
+            state == RPCBatch::DONE) {
+            // Drop the newline ending every single JSON reply
+            size_t len = entry.reply.size();
+            if (fJSON && len > 0 && entry.reply[len - 1] == '\n')
+                len--;
+            strReply.append(entry.reply, 0, len);
+            continue;
+        }
+        std::string strError;
+        JSONRPCWriteReplyAs(nlohmann::detail::output_adapter<char>(strError), json(),
+                            JSONRPCError(RPC_MISC_ERROR, "Batch deadline exceeded"), entry.id, encoding);
+        if (fJSON)
+            strError.pop_back();
+        strReply += strError;
+    }
+    if (fJSON)
+        strReply += "]\n";
+    return strReply;
 }
 
-std::string JSONRPCExecBatch(const JSONRPCRequest& jreq, const json& vReq)
+RPCArgIndex::RPCArgIndex(const std::vector<std::string>& argNames) : nArgs(argNames.size())
 {
-    json ret=json::array();
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(jreq, vReq[reqIdx]));
-
-    return ret.dump() + "\n";
+    for (size_t pos = 0; pos < argNames.size(); pos++) {
+        const std::string& pattern = argNames[pos];
+        size_t begin = 0;
+        while (true) {
+            size_t end = pattern.find('|', begin);
+            // The first spec for a name wins, as when the aliases were tried in order
+            positions.emplace(pattern.substr(begin, end - begin), pos);
+            if (end == std::string::npos)
+                break;
+            begin = end + 1;
+        }
+    }
 }
 
 /**
  * Process named arguments into a vector of positional arguments, based on the
- * passed-in specification for the RPC call's arguments.
+ * command's precompiled argument index.
  */
-static inline JSONRPCRequest transformNamedArguments(const JSONRPCRequest& in, const std::vector<std::string>& argNames)
-{
-    JSONRPCRequest out = in;
-   // out.params = json::array();
-    // Build a map of parameters, and remove ones that have been processed, so that we can throw a focused error if
-    // there is an unknown one.
-    const std::vector<std::string> keys;//& keys = in.params.getKeys();
-    const std::vector<json> values; //& values = in.params.getValues();
-    std::unordered_map<std::string, const json*> argsIn;
-    for (size_t i=0; i<keys.size(); ++i) {
-        argsIn[keys[i]] = &values[i];
-    }
-    // Process expected parameters.
-    int hole = 0;
-    for (const std::string &argNamePattern: argNames) {
-        std::vector<std::string> vargNames;
-        boost::algorithm::split(vargNames, argNamePattern, boost::algorithm::is_any_of("|"));
-        auto fr = argsIn.end();
-        for (const std::string & argName : vargNames) {
-            fr = argsIn.find(argName);
-            if (fr != argsIn.end()) {
-                break;
-            }
-        }
-        if (fr != argsIn.end()) {
-            for (int i = 0; i < hole; ++i) {
-                // Fill hole between specified parameters with JSON nulls,
-                // but not at the end (for backwards compatibility with calls
-                // that act based on number of specified parameters).
-                out.params.push_back(json());
-            }
-            hole = 0;
-            out.params.push_back(*fr->second);
-            argsIn.erase(fr);
+static inline JSONRPCRequest transformNamedArguments(const JSONRPCRequest& in, const RPCArgIndex& args)
+{
+    JSONRPCRequest out;
+    out.id = in.id;
+    out.strMethod = in.strMethod;
+    out.fHelp = in.fHelp;
+    out.URI = in.URI;
+    out.authUser = in.authUser;
+    out.params = json::array();
+    json::array_t& params = out.params.get_ref<json::array_t&>();
+    params.reserve(std::min(in.params.size(), args.nArgs));
+
+    // Single pass over the named arguments; arguments not given are left
+    // as JSON nulls, but not at the end (for backwards compatibility with
+    // calls that act based on number of specified parameters).
+    uint64_t fSeen = 0;
+    std::vector<bool> vSeen;
+    if (args.nArgs > 64)
+        vSeen.resize(args.nArgs);
+    for (json::const_iterator it = in.params.begin(); it != in.params.end(); ++it) {
+        auto pos = args.positions.find(it.key());
+        if (pos == args.positions.end())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown named parameter " + it.key());
+        const size_t n = pos->second;
+        bool fDuplicate;
+        if (n < 64) {
+            fDuplicate = fSeen & (uint64_t(1) << n);
+            fSeen |= uint64_t(1) << n;
         } else {
-            hole += 1;
+            fDuplicate = vSeen[n];
+            vSeen[n] = true;
         }
-    }
-    // If there are still arguments in the argsIn map, this is an error.
-    if (!argsIn.empty()) {
-        //throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown named parameter " + argsIn.begin()->first);
+        if (fDuplicate)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Parameter " + it.key() + " specified multiple times");
+        if (params.size() <= n)
+            params.resize(n + 1);
+        params[n] = it.value();
     }
     // Return request with named arguments transformed to positional arguments
     return out;
 }
 
-json CRPCTable::execute(const JSONRPCRequest &request) const
+const CRPCCommand* CRPCTable::prepare(const JSONRPCRequest &request, const RPCArgIndex*& args, size_t& nStatId) const
 {
+    // A reply recorded from here on belongs to this call, if anything
+    RPCStatsResetCall();
+
     // Return immediately if in warmup
     {
         //LOCK(cs_rpcWarmup);
@@ -501,23 +1020,182 @@ json CRPCTable::execute(const JSONRPCRequest &request) const
     }
 
     // Find method
-    const CRPCCommand *pcmd = tableRPC[request.strMethod];
-    if (!pcmd)
+    const CRPCCommand *pcmd;
+    if (!Find(request.strMethod, pcmd, args, nStatId))
         throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
 
     g_rpcSignals.PreCommand(*pcmd);
+    return pcmd;
+}
+
+void CRPCTable::finish(const CRPCCommand& cmd) const
+{
+    for (const std::string& method : cmd.invalidates)
+        replyCache.Invalidate(method);
+}
+
+/** Execute a command and return its result as serialized in a JSON reply */
+static std::shared_ptr<const std::string> RPCSerializeResult(const CRPCCommand& cmd, const JSONRPCRequest& request)
+{
+    std::string strResult;
+    nlohmann::detail::output_adapter_t<char> out = nlohmann::detail::output_adapter<char>(strResult);
+    if (!cmd.writer) {
+        nlohmann::detail::serializer<json> s(out, ' ');
+        s.dump(cmd.actor(request), false, false, 0);
+        return std::make_shared<const std::string>(std::move(strResult));
+    }
+    // Writers produce the whole reply; cut out the result between its fixed
+    // start and end
+    cmd.writer(request, out);
+    static const std::string strBegin = "{\"result\":";
+    const std::string strEnd = ",\"error\":null,\"id\":" + request.id.dump() + "}\n";
+    if (strResult.size() < strBegin.size() + strEnd.size() ||
+        strResult.compare(0, strBegin.size(), strBegin) != 0 ||
+        strResult.compare(strResult.size() - strEnd.size(), strEnd.size(), strEnd) != 0)
+        throw std::runtime_error("Unexpected reply from " + request.strMethod);
+    strResult.erase(strResult.size() - strEnd.size());
+    strResult.erase(0, strBegin.size());
+    return std::make_shared<const std::string>(std::move(strResult));
+}
+
+std::shared_ptr<const std::string> CRPCTable::executeShared(const CRPCCommand& cmd, const JSONRPCRequest& request) const
+{
+    const std::string key = RPCReplyCache::Key(request);
+    if (cmd.nCacheTTL > 0) {
+        std::shared_ptr<const std::string> cached = replyCache.Get(key);
+        if (cached)
+            return cached;
+    }
+    auto produce = [this, &cmd, &request, &key]() {
+        const uint64_t nGeneration = replyCache.Generation(request.strMethod);
+        std::shared_ptr<const std::string> result = RPCSerializeResult(cmd, request);
+        if (cmd.nCacheTTL > 0)
+            replyCache.Insert(request.strMethod, key, nGeneration, cmd.nCacheTTL, result);
+        return result;
+    };
+    if (!cmd.fCoalesce)
+        return produce();
+    return singleFlight.Do(request.strMethod, key, produce);
+}
+
+/** Times a call from its creation, and records it with the outcome */
+class RPCCallRecorder
+{
+public:
+    RPCCallRecorder(size_t _nStatId, const JSONRPCRequest& _request) :
+        nStatId(_nStatId), request(_request), nStart(RPCStatsNow()) {}
+
+    void Succeeded() { Record(0); }
+    void Failed(int nErrorCode) { Record(nErrorCode); }
+    void Failed(const json& objError)
+    {
+        auto it = objError.find("code");
+        Record(it != objError.end() && it->is_number_integer() ? it->get<int>() : RPC_MISC_ERROR);
+    }
+
+private:
+    const size_t nStatId;
+    const JSONRPCRequest& request;
+    const int64_t nStart;
+
+    void Record(int nErrorCode)
+    {
+        const int64_t nEnd = RPCStatsNow();
+        RPCStatsRecordCall(nStatId, request.nReceivedTime, nStart, nEnd, request.nBytesIn, nErrorCode);
+        const uint64_t nKey = RPCSlowLogKey(request.nReceivedTime ? request.nReceivedTime : nStart, nEnd);
+        if (RPCSlowLogWanted(nKey))
+            RecordSlow(nKey, nEnd, nErrorCode);
+    }
+
+    void RecordSlow(uint64_t nKey, int64_t nEnd, int nErrorCode)
+    {
+        RPCSlowRequest slow;
+        memset(&slow, 0, sizeof(slow));
+        strncpy(slow.method, request.strMethod.c_str(), sizeof(slow.method));
+        const std::string strParams = request.params.dump();
+        slow.nParamsDigest = RPCMethodHash(strParams.data(), strParams.size());
+        slow.nBytesIn = request.nBytesIn;
+        slow.nReceived = request.nReceivedTime;
+        slow.nStart = nStart;
+        slow.nEnd = nEnd;
+        slow.nTime = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        slow.nErrorCode = nErrorCode;
+        RPCSlowLogRecord(nKey, slow);
+    }
+};
+
+json CRPCTable::execute(const JSONRPCRequest &request) const
+{
+    const RPCArgIndex *args;
+    size_t nStatId;
+    const CRPCCommand *pcmd = prepare(request, args, nStatId);
+    RPCCallRecorder recorder(nStatId, request);
 
     try
     {
         // Execute, convert arguments to array if necessary
-        if (request.params.is_object()) {
-            return pcmd->actor(transformNamedArguments(request, pcmd->argNames));
+        json result;
+        if (isShared(*pcmd, request)) {
+            result = json::parse(*(request.params.is_object() ? executeShared(*pcmd, transformNamedArguments(request, *args))
+                                                              : executeShared(*pcmd, request)));
+        } else if (request.params.is_object()) {
+            result = pcmd->actor(transformNamedArguments(request, *args));
         } else {
-            return pcmd->actor(request);
+            result = pcmd->actor(request);
         }
+        finish(*pcmd);
+        recorder.Succeeded();
+        return result;
+    }
+    catch (const json& objError)
+    {
+        recorder.Failed(objError);
+        throw;
+    }
+    catch (const std::exception& e)
+    {
+        recorder.Failed(RPC_MISC_ERROR);
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    }
+}
+
+void CRPCTable::execute(const JSONRPCRequest &request, nlohmann::detail::output_adapter_t<char> out) const
+{
+    const RPCArgIndex *args;
+    size_t nStatId;
+    const CRPCCommand *pcmd = prepare(request, args, nStatId);
+    RPCCallRecorder recorder(nStatId, request);
+
+    try
+    {
+        if (isShared(*pcmd, request)) {
+            std::shared_ptr<const std::string> result = request.params.is_object()
+                ? executeShared(*pcmd, transformNamedArguments(request, *args))
+                : executeShared(*pcmd, request);
+            JSONRPCWriteResultBegin(out);
+            out->write_characters(result->data(), result->size());
+            JSONRPCWriteResultEnd(out, request.id);
+        } else if (!pcmd->writer) {
+            json result = request.params.is_object() ? pcmd->actor(transformNamedArguments(request, *args))
+                                                     : pcmd->actor(request);
+            JSONRPCWriteReply(out, result, json(), request.id);
+        } else if (request.params.is_object()) {
+            pcmd->writer(transformNamedArguments(request, *args), out);
+        } else {
+            pcmd->writer(request, out);
+        }
+        finish(*pcmd);
+        recorder.Succeeded();
+    }
+    catch (const json& objError)
+    {
+        recorder.Failed(objError);
+        throw;
     }
     catch (const std::exception& e)
     {
+        recorder.Failed(RPC_MISC_ERROR);
         throw JSONRPCError(RPC_MISC_ERROR, e.what());
     }
 }
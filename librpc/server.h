@@ -7,13 +7,21 @@
 #define BITCOIN_RPCSERVER_H
 
 #include "protocol.h"
+#include "replycache.h"
+#include <functional>
 #include <list>
 #include <map>
+#include <memory>
 #include <stdint.h>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include "json.hpp"
 
 static const unsigned int DEFAULT_RPC_SERIALIZE_VERSION = 1;
+static const size_t DEFAULT_RPC_BATCH_CHUNK = 16;
+static const size_t DEFAULT_RPC_BATCH_CONCURRENCY = 4;
+static const int64_t DEFAULT_RPC_BATCH_TIMEOUT = 30000;
 
 class CRPCCommand;
 
@@ -41,9 +49,25 @@ public:
     bool fHelp;
     std::string URI;
     std::string authUser;
+    //! Time the transport received the request (see RPCStatsNow), 0 if unknown
+    int64_t nReceivedTime;
+    //! Size of the request as received, 0 if unknown
+    size_t nBytesIn;
 
-    JSONRPCRequest() : id(json::object()), params(json::object()), fHelp(false) {}
+    JSONRPCRequest() : id(json::object()), params(json::object()), fHelp(false), nReceivedTime(0), nBytesIn(0) {}
     void parse(const json& valRequest);
+    /** Same as parse(const json&), moving the members out of valRequest */
+    void parse(json&& valRequest);
+    /** Decode a request straight from its text. If the text is a request
+     * object, its id, method and params are moved into this request as they
+     * are parsed, without building the object itself, and true is returned.
+     * Anything else (e.g. a batch) is returned as a document in valRequest,
+     * and false is returned.
+     */
+    bool parse(nlohmann::detail::input_adapter input, json& valRequest);
+
+private:
+    void check(json& valMethod, json& valParams);
 };
 
 /** Query whether RPC is running */
@@ -72,14 +96,57 @@ void RPCTypeCheck(const json& params,
  */
 void RPCTypeCheckArgument(const json& value, json::value_t typeExpected);
 
+/** Name of a json type in error messages */
+std::string RPCTypeName(json::value_t type);
+
 /*
   Check for expected keys/value types in an Object.
+  This compiles an RPCObjSchema on every call; commands should build one once.
 */
 void RPCTypeCheckObj(const json& o,
     const std::map<std::string, jsonType>& typesExpected,
     bool fAllowNull = false,
     bool fStrict = false);
 
+/**
+ * Compiled check for expected keys/value types in an Object, e.g.
+ *
+ *     static const RPCObjSchema schema({{"txid", jsonType(json::value_t::string)}, ...});
+ *     schema.Check(request.params[0]);
+ *
+ * Key hashes and the set of required keys are computed once, so a check
+ * is a single pass over the object's members.
+ */
+class RPCObjSchema
+{
+public:
+    /**
+     * Every expected key is required unless fAllowNull, in which case keys
+     * may also be null. With fStrict, keys that are not expected are errors.
+     */
+    explicit RPCObjSchema(const std::map<std::string, jsonType>& typesExpected,
+                          bool fAllowNull = false, bool fStrict = false);
+
+    /** Check an object; throws JSONRPCError (RPC_TYPE_ERROR) on the first problem */
+    void Check(const json& o) const;
+
+private:
+    struct Field
+    {
+        uint64_t hash;
+        std::string name;
+        jsonType type;
+    };
+    std::vector<Field> fields;        //!< in key order
+    std::vector<uint32_t> vSlots;     //!< open addressing table of field index + 1, 0 if empty
+    std::vector<uint64_t> vRequired;  //!< bitset over fields
+    bool fAllowNull;
+    bool fStrict;
+
+    /** Index of the field for key, or -1 */
+    int Find(const std::string& key) const;
+};
+
 /** Opaque base class for timers returned by NewTimerFunc.
  * This provides no methods at the moment, but makes sure that delete
  * cleans up the whole state.
@@ -122,6 +189,21 @@ void RPCUnsetTimerInterface(RPCTimerInterface *iface);
 void RPCRunLater(const std::string& name, std::function<void(void)> func, int64_t nSeconds);
 
 typedef json(*rpcfn_type)(const JSONRPCRequest& jsonRequest);
+/** Executes a command and serializes the whole reply straight into out */
+typedef void(*rpcwritefn_type)(const JSONRPCRequest& jsonRequest, nlohmann::detail::output_adapter_t<char> out);
+
+/** FNV-1a hash of a method name, used for dispatch. constexpr, so names
+ * known at compile time can be hashed at compile time.
+ */
+constexpr uint64_t RPCMethodHash(const char* name, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
 
 class CRPCCommand
 {
@@ -130,6 +212,31 @@ public:
     std::string name;
     rpcfn_type actor;
     std::vector<std::string> argNames;
+    //! Typed commands (see typedrpc.h): writes the reply without building the result as json
+    rpcwritefn_type writer = nullptr;
+    //! Typed commands: help text. Other actors throw theirs when called with fHelp.
+    std::string help = "";
+    //! Milliseconds a result may be served from the reply cache; 0 means the
+    //! command is not cacheable. Only for commands without side effects.
+    int64_t nCacheTTL = 0;
+    //! Methods whose cached results are invalidated once this command succeeds
+    std::vector<std::string> invalidates = {};
+    //! Identical calls running at the same time share one execution and its
+    //! result. Only for commands without side effects.
+    bool fCoalesce = false;
+};
+
+/** Named arguments of a command, parsed once from its argNames.
+ * Maps every name, and every alias of a "name|alias" pattern, to the
+ * position of the argument.
+ */
+struct RPCArgIndex
+{
+    std::unordered_map<std::string, size_t> positions;
+    size_t nArgs;
+
+    RPCArgIndex() : nArgs(0) {}
+    explicit RPCArgIndex(const std::vector<std::string>& argNames);
 };
 
 /**
@@ -139,6 +246,52 @@ class CRPCTable
 {
 private:
     std::map<std::string, const CRPCCommand*> mapCommands;
+    //! Named argument index of every command, by name
+    std::map<std::string, RPCArgIndex> mapArgIndexes;
+    //! Id every command's counters are recorded under (see rpcstats.h), by name
+    std::map<std::string, size_t> mapStatIds;
+    //! Commands appended by ownership
+    std::vector<std::unique_ptr<CRPCCommand>> vOwnedCommands;
+
+    /** Minimal perfect hash over mapCommands (hash and displace): a method
+     * hashing to h lives in slot Mix(h, vSeeds[h % vSeeds.size()]) % n, so a
+     * lookup is one hash, one seed and one slot, whatever the number of
+     * commands.
+     */
+    struct DispatchSlot
+    {
+        uint64_t hash;
+        const std::string* name; //!< key in mapCommands
+        const CRPCCommand* cmd;
+        const RPCArgIndex* args;
+        size_t nStatId;
+    };
+    std::vector<uint32_t> vSeeds;
+    std::vector<DispatchSlot> vSlots;
+    //! Whether vSlots is up to date with mapCommands; lookups use the map otherwise
+    bool fCompiled;
+    //! Results of commands with a cache TTL
+    mutable RPCReplyCache replyCache;
+    //! Calls of commands with fCoalesce that are running
+    mutable RPCSingleFlight singleFlight;
+
+    /** Build the perfect hash, returns false if no seeds were found */
+    bool CompileDispatch();
+    /** Look up a command, its named argument index and stats id, returns false if not found */
+    bool Find(const std::string& name, const CRPCCommand*& pcmd, const RPCArgIndex*& args, size_t& nStatId) const;
+    /** Find the command for a request, with the checks common to all executions */
+    const CRPCCommand* prepare(const JSONRPCRequest& request, const RPCArgIndex*& args, size_t& nStatId) const;
+    /** Whether results of a command are shared, through the cache or by coalescing calls */
+    static bool isShared(const CRPCCommand& cmd, const JSONRPCRequest& request)
+    {
+        return (cmd.nCacheTTL > 0 || cmd.fCoalesce) && !request.fHelp;
+    }
+    /** Serialized result of a command whose results are shared: from the
+     * cache, from an identical call running already, or by executing it
+     */
+    std::shared_ptr<const std::string> executeShared(const CRPCCommand& cmd, const JSONRPCRequest& request) const;
+    /** Invalidate what a command that succeeded declared to invalidate */
+    void finish(const CRPCCommand& cmd) const;
 public:
     CRPCTable();
     const CRPCCommand* operator[](const std::string& name) const;
@@ -152,6 +305,14 @@ public:
      */
     json execute(const JSONRPCRequest &request) const;
 
+    /**
+     * Execute a method and serialize the reply straight into out. Typed
+     * commands write their result without building it as json.
+     * @throws an exception (json) when an error happens, before anything
+     * is written.
+     */
+    void execute(const JSONRPCRequest &request, nlohmann::detail::output_adapter_t<char> out) const;
+
     /**
     * Returns a list of registered commands
     * @returns List of registered commands.
@@ -165,6 +326,24 @@ public:
      * Commands cannot be overwritten (returns false).
      */
     bool appendCommand(const std::string& name, const CRPCCommand* pcmd);
+    /** Append a command under its name, taking ownership of it. */
+    bool appendCommand(std::unique_ptr<CRPCCommand> pcmd);
+
+    /**
+     * Compile the commands into the perfect hash dispatch table. Called by
+     * StartRPC, once no more commands can be appended.
+     */
+    void Freeze();
+
+    /**
+     * Cache of the results of commands with a cache TTL. State-changing
+     * code calls Invalidate on it for the methods whose results it changes,
+     * unless the command doing the change lists them in its invalidates.
+     */
+    RPCReplyCache& ReplyCache() const { return replyCache; }
+
+    /** Coalescing counters of the commands with fCoalesce, by method */
+    std::map<std::string, RPCCoalesceStats> CoalesceStats() const { return singleFlight.Stats(); }
 };
 
 bool IsDeprecatedRPCEnabled(const std::string& method);
@@ -188,7 +367,43 @@ extern std::string HelpExampleRpc(const std::string& methodname, const std::stri
 bool StartRPC();
 void InterruptRPC();
 void StopRPC();
-std::string JSONRPCExecBatch(const JSONRPCRequest& jreq, const json& vReq);
+/**
+ * Execute a single request of a batch or stream as jreq's URI and user,
+ * appending its reply, or the error it failed with, to strReply. A JSON
+ * reply ends in a newline. The request is moved out of req.
+ */
+void JSONRPCExecOne(const JSONRPCRequest& jreq, json&& req, std::string& strReply,
+                    RPCEncoding encoding = RPC_ENCODING_JSON);
+
+/** Limits on executing a single JSON-RPC batch */
+struct RPCBatchOptions
+{
+    /** Number of entries a thread takes at a time */
+    size_t nChunkSize = DEFAULT_RPC_BATCH_CHUNK;
+    /** Maximum number of threads working on one batch, the caller included,
+     * so that one huge batch cannot occupy every worker
+     */
+    size_t nMaxConcurrency = DEFAULT_RPC_BATCH_CONCURRENCY;
+    /** Milliseconds after which entries that have not finished are answered
+     * with an error, or 0 to wait for all of them
+     */
+    int64_t nTimeout = DEFAULT_RPC_BATCH_TIMEOUT;
+};
+
+/** Hands a task to another thread, returns false if it was not accepted */
+typedef std::function<bool(std::function<void()> task)> RPCBatchSubmitFn;
+
+/**
+ * Execute a batch, returning the array of replies in request order,
+ * serialized in encoding.
+ * Chunks of entries are executed by the calling thread and by up to
+ * nMaxConcurrency - 1 helper tasks passed to submit; the caller never
+ * depends on a helper to make progress. The entries are moved out of vReq.
+ */
+std::string JSONRPCExecBatch(const JSONRPCRequest& jreq, json& vReq,
+                             const RPCBatchOptions& options = RPCBatchOptions(),
+                             const RPCBatchSubmitFn& submit = nullptr,
+                             RPCEncoding encoding = RPC_ENCODING_JSON);
 
 // Retrieves any serialization flags requested in command line argument
 int RPCSerializationFlags();
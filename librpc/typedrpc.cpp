@@ -0,0 +1,42 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "typedrpc.h"
+
+std::string RPCArgRef::Name() const
+{
+    const CRPCCommand* pcmd = tableRPC[method];
+    if (pcmd && n < pcmd->argNames.size()) {
+        // Name the argument by its primary name, not its aliases
+        const std::string& pattern = pcmd->argNames[n];
+        return pattern.substr(0, pattern.find('|'));
+    }
+    return "argument " + std::to_string(n + 1);
+}
+
+void RPCArgTypeError(const RPCArgRef& arg, json::value_t expected, const json& value)
+{
+    throw JSONRPCError(RPC_TYPE_ERROR, "Expected type " + RPCTypeName(expected) + " for " + arg.Name() +
+                                           ", got " + RPCTypeName(value.type()));
+}
+
+void RPCArgRangeError(const RPCArgRef& arg)
+{
+    throw JSONRPCError(RPC_INVALID_PARAMETER, arg.Name() + " out of range");
+}
+
+void RPCArgMissingError(const RPCArgRef& arg)
+{
+    throw JSONRPCError(RPC_INVALID_PARAMETER, "Missing required argument " + arg.Name());
+}
+
+void to_json(json& j, const RPCArrayGenerator& generator)
+{
+    j = json::array();
+    json element;
+    while (generator.next(element)) {
+        j.push_back(std::move(element));
+        element = json();
+    }
+}
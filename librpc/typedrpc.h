@@ -0,0 +1,336 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RPCTYPEDRPC_H
+#define BITCOIN_RPCTYPEDRPC_H
+
+#include "protocol.h"
+#include "server.h"
+
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdio.h>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <boost/optional.hpp>
+
+/**
+ * Typed RPC commands.
+ *
+ * A typed command is a plain C++ function, e.g.
+ *
+ *     static std::string echo(const std::string& text, boost::optional<int> count);
+ *
+ * Decoders for its arguments and an encoder for its result are generated
+ * from the function's signature: every argument is type-checked once and
+ * handed over without an intermediate json copy, and the result is
+ * serialized straight into the reply. Arguments of type boost::optional<T>
+ * may be omitted or null; a json argument is passed through unchecked.
+ *
+ * A command whose result is too large to build in memory, such as a long
+ * listing, returns an RPCArrayGenerator: its elements are serialized one at
+ * a time, and the HTTP server streams the reply while it is being written.
+ *
+ * Typed commands are CRPCCommands like any other, so they can be listed in
+ * a command table next to legacy actors:
+ *
+ *     { "control", "echo", RPC_TYPED_ACTOR(echo), {"text", "count"}, RPC_TYPED_WRITER(echo), "echo \"text\" ( count )\n..." },
+ *
+ * or registered at runtime with RegisterTypedRPCCommand<RPC_TYPED(echo)>(...).
+ */
+
+/** Template arguments naming a typed command function */
+#define RPC_TYPED(fn) decltype(&fn), &fn
+/** CRPCCommand::actor of a typed command */
+#define RPC_TYPED_ACTOR(fn) &RPCTypedCommand<RPC_TYPED(fn)>::Actor
+/** CRPCCommand::writer of a typed command */
+#define RPC_TYPED_WRITER(fn) &RPCTypedCommand<RPC_TYPED(fn)>::Writer
+
+/** Argument n of a method, named in error messages. The name is only
+ * looked up when an error is raised.
+ */
+struct RPCArgRef
+{
+    const std::string& method;
+    size_t n;
+
+    std::string Name() const;
+};
+
+/** Throw the RPC_TYPE_ERROR for an argument having the wrong type */
+[[noreturn]] void RPCArgTypeError(const RPCArgRef& arg, json::value_t expected, const json& value);
+/** Throw the RPC_INVALID_PARAMETER for an argument being out of range */
+[[noreturn]] void RPCArgRangeError(const RPCArgRef& arg);
+/** Throw the RPC_INVALID_PARAMETER for a required argument being omitted */
+[[noreturn]] void RPCArgMissingError(const RPCArgRef& arg);
+
+/** Decoder for a present, non-null argument of type T */
+template <typename T, typename Enable = void>
+struct RPCArgDecoder;
+
+template <>
+struct RPCArgDecoder<json>
+{
+    static const json& Decode(const json& value, const RPCArgRef&) { return value; }
+};
+
+template <>
+struct RPCArgDecoder<std::string>
+{
+    static const std::string& Decode(const json& value, const RPCArgRef& arg)
+    {
+        if (!value.is_string())
+            RPCArgTypeError(arg, json::value_t::string, value);
+        return value.get_ref<const std::string&>();
+    }
+};
+
+template <>
+struct RPCArgDecoder<bool>
+{
+    static bool Decode(const json& value, const RPCArgRef& arg)
+    {
+        if (!value.is_boolean())
+            RPCArgTypeError(arg, json::value_t::boolean, value);
+        return value.get<bool>();
+    }
+};
+
+template <typename T>
+struct RPCArgDecoder<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type>
+{
+    static T Decode(const json& value, const RPCArgRef& arg)
+    {
+        if (!value.is_number_integer())
+            RPCArgTypeError(arg, json::value_t::number_integer, value);
+        if (value.is_number_unsigned()) {
+            uint64_t n = value.get<uint64_t>();
+            if (n > (uint64_t)std::numeric_limits<T>::max())
+                RPCArgRangeError(arg);
+            return (T)n;
+        }
+        int64_t n = value.get<int64_t>();
+        if (n < 0 ? (std::is_unsigned<T>::value || n < (int64_t)std::numeric_limits<T>::min())
+                  : (uint64_t)n > (uint64_t)std::numeric_limits<T>::max())
+            RPCArgRangeError(arg);
+        return (T)n;
+    }
+};
+
+template <typename T>
+struct RPCArgDecoder<T, typename std::enable_if<std::is_floating_point<T>::value>::type>
+{
+    static T Decode(const json& value, const RPCArgRef& arg)
+    {
+        if (!value.is_number())
+            RPCArgTypeError(arg, json::value_t::number_float, value);
+        return value.get<T>();
+    }
+};
+
+/** Argument n of a request, handling omitted and null arguments */
+template <typename T>
+struct RPCArg
+{
+    static auto Get(const json& params, const RPCArgRef& arg)
+        -> decltype(RPCArgDecoder<T>::Decode(params, arg))
+    {
+        if (arg.n >= params.size() || params[arg.n].is_null())
+            RPCArgMissingError(arg);
+        return RPCArgDecoder<T>::Decode(params[arg.n], arg);
+    }
+};
+
+template <typename T>
+struct RPCArg<boost::optional<T>>
+{
+    static boost::optional<T> Get(const json& params, const RPCArgRef& arg)
+    {
+        if (arg.n >= params.size() || params[arg.n].is_null())
+            return boost::none;
+        return boost::optional<T>(RPCArgDecoder<T>::Decode(params[arg.n], arg));
+    }
+};
+
+/** Result produced one element at a time, written as a json array.
+ * next() fills in the next element and returns false after the last one.
+ * It is called while the reply is being sent, so it must not depend on
+ * state owned by the command's stack frame.
+ */
+struct RPCArrayGenerator
+{
+    std::function<bool(json& element)> next;
+};
+
+/** Collect all elements, for the legacy actor */
+void to_json(json& j, const RPCArrayGenerator& generator);
+
+/** Encoder for a result of type T, serializing it without building a json
+ * value where the type allows. Other types go through their json conversion.
+ */
+template <typename T, typename Enable = void>
+struct RPCResultEncoder
+{
+    static void Write(nlohmann::detail::output_adapter_t<char> out, const T& value)
+    {
+        nlohmann::detail::serializer<json> s(out, ' ');
+        s.dump(json(value), false, false, 0);
+    }
+};
+
+template <>
+struct RPCResultEncoder<json>
+{
+    static void Write(nlohmann::detail::output_adapter_t<char> out, const json& value)
+    {
+        nlohmann::detail::serializer<json> s(out, ' ');
+        s.dump(value, false, false, 0);
+    }
+};
+
+template <>
+struct RPCResultEncoder<std::string>
+{
+    static void Write(nlohmann::detail::output_adapter_t<char> out, const std::string& value)
+    {
+        JSONWriteString(out, value);
+    }
+};
+
+template <>
+struct RPCResultEncoder<bool>
+{
+    static void Write(nlohmann::detail::output_adapter_t<char> out, bool value)
+    {
+        if (value)
+            out->write_characters("true", 4);
+        else
+            out->write_characters("false", 5);
+    }
+};
+
+template <>
+struct RPCResultEncoder<RPCArrayGenerator>
+{
+    static void Write(nlohmann::detail::output_adapter_t<char> out, const RPCArrayGenerator& generator)
+    {
+        nlohmann::detail::serializer<json> s(out, ' ');
+        json element;
+        out->write_character('[');
+        for (bool fFirst = true; generator.next(element); fFirst = false) {
+            if (!fFirst)
+                out->write_character(',');
+            s.dump(element, false, false, 0);
+            element = json();
+        }
+        out->write_character(']');
+    }
+};
+
+template <typename T>
+struct RPCResultEncoder<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type>
+{
+    static void Write(nlohmann::detail::output_adapter_t<char> out, T value)
+    {
+        char buf[24];
+        int len = std::is_signed<T>::value ? snprintf(buf, sizeof(buf), "%lld", (long long)value)
+                                           : snprintf(buf, sizeof(buf), "%llu", (unsigned long long)value);
+        out->write_characters(buf, len);
+    }
+};
+
+/** Actor and writer generated for typed command function fn */
+template <typename Fn, Fn fn>
+struct RPCTypedCommand;
+
+template <typename R, typename... Args, R (*fn)(Args...)>
+struct RPCTypedCommand<R (*)(Args...), fn>
+{
+    static const size_t ARGS = sizeof...(Args);
+
+    /** Legacy actor: returns the result as json */
+    static json Actor(const JSONRPCRequest& request)
+    {
+        return Call(request, std::integral_constant<bool, std::is_void<R>::value>(),
+                    std::index_sequence_for<Args...>());
+    }
+
+    /** Execute and serialize the whole reply straight into out */
+    static void Writer(const JSONRPCRequest& request, nlohmann::detail::output_adapter_t<char> out)
+    {
+        Write(request, out, std::integral_constant<bool, std::is_void<R>::value>(),
+              std::index_sequence_for<Args...>());
+    }
+
+private:
+    template <size_t... I>
+    static R Invoke(const JSONRPCRequest& request, std::index_sequence<I...>)
+    {
+        const json& params = request.params;
+        if (params.is_array() && params.size() > ARGS)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Too many arguments");
+        return fn(RPCArg<typename std::decay<Args>::type>::Get(params, RPCArgRef{request.strMethod, I})...);
+    }
+
+    template <size_t... I>
+    static json Call(const JSONRPCRequest& request, std::false_type, std::index_sequence<I...> seq)
+    {
+        return json(Invoke(request, seq));
+    }
+
+    template <size_t... I>
+    static json Call(const JSONRPCRequest& request, std::true_type, std::index_sequence<I...> seq)
+    {
+        Invoke(request, seq);
+        return json();
+    }
+
+    template <size_t... I>
+    static void Write(const JSONRPCRequest& request, nlohmann::detail::output_adapter_t<char> out,
+                      std::false_type, std::index_sequence<I...> seq)
+    {
+        // The call may throw; nothing is written until it has returned
+        R result = Invoke(request, seq);
+        JSONRPCWriteResultBegin(out);
+        RPCResultEncoder<typename std::decay<R>::type>::Write(out, result);
+        JSONRPCWriteResultEnd(out, request.id);
+    }
+
+    template <size_t... I>
+    static void Write(const JSONRPCRequest& request, nlohmann::detail::output_adapter_t<char> out,
+                      std::true_type, std::index_sequence<I...> seq)
+    {
+        Invoke(request, seq);
+        JSONRPCWriteResultBegin(out);
+        out->write_characters("null", 4);
+        JSONRPCWriteResultEnd(out, request.id);
+    }
+};
+
+/**
+ * Register typed command fn in table, which takes ownership of the command.
+ * argNames must name every argument of fn. Returns false if it does not, or
+ * if appendCommand refuses the command.
+ */
+template <typename Fn, Fn fn>
+bool RegisterTypedRPCCommand(CRPCTable& table, const std::string& category, const std::string& name,
+                             const std::vector<std::string>& argNames, const std::string& help)
+{
+    if (argNames.size() != RPCTypedCommand<Fn, fn>::ARGS)
+        return false;
+    std::unique_ptr<CRPCCommand> pcmd(new CRPCCommand());
+    pcmd->category = category;
+    pcmd->name = name;
+    pcmd->actor = &RPCTypedCommand<Fn, fn>::Actor;
+    pcmd->argNames = argNames;
+    pcmd->writer = &RPCTypedCommand<Fn, fn>::Writer;
+    pcmd->help = help;
+    return table.appendCommand(std::move(pcmd));
+}
+
+#endif // BITCOIN_RPCTYPEDRPC_H